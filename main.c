@@ -8,11 +8,18 @@
 #include "err.h"
 #include "source/common.h"
 #include "source/GUI/gui.h"
+#include "source/bench/bench.h"
+#include "source/network/autotune.h"
+#include "source/network/cnn.h"
+#include "source/network/kernels.h"
+#include "source/network/optimizer.h"
+#include "source/network/rng.h"
 #include "source/network/network.h"
 #include "source/network/tools.h"
 #include "source/process/process.h"
 #include "source/sdl/our_sdl.h"
 #include "source/segmentation/segmentation.h"
+#include "source/training/parallel.h"
 #include "source/training/training.h"
 #include "source/ocr/ocr.h"
 
@@ -77,7 +84,7 @@ void XOR(void)
         {
             step++;
             progressBar(step, nb);
-            shuffle(trainingSetOrder, number_training_sets);
+            shuffle(&rng_main, trainingSetOrder, number_training_sets);
 
             for (int x = 0; x < number_training_sets; x++)
             {
@@ -88,7 +95,8 @@ void XOR(void)
                 network->input_layer[1] = training_inputs[2 * index + 1];
                 network->goal[0] = training_outputs[index];
 
-                // Forward pass
+                // Forward pass, lazy Adam rows caught up first
+                network_catch_up(network);
                 forward_pass(network);
 
                 // Back propagation
@@ -156,9 +164,116 @@ void XOR(void)
     freeNetwork(network);
 }
 
+/**
+ * Consumes the global options (valid before or after the command) and
+ * removes them from argv, so the dispatch below only sees the command and
+ * its operands. Returns the new argc, or -1 on an invalid option.
+ */
+static int parse_global_options(int argc, char *argv[])
+{
+    const char *kernel_name = NULL;
+    const char *optimizer_name = NULL;
+    int retune = 0;
+    int kept = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--kernels=", 10) == 0)
+            kernel_name = argv[i] + 10;
+        else if (strncmp(argv[i], "--optimizer=", 12) == 0)
+            optimizer_name = argv[i] + 12;
+        else if (strcmp(argv[i], "--retune") == 0)
+            retune = 1;
+        else
+            argv[kept++] = argv[i];
+    }
+    argv[kept] = NULL;
+
+    // Without an explicit set, use the one tuned for this CPU, once a
+    // command that runs the kernels asks for it
+    if (kernel_name == NULL || strcmp(kernel_name, "auto") == 0)
+        kernels_autotune_request(retune);
+    else if (!kernels_select(kernel_name))
+    {
+        printf("Error: kernels '%s' unknown or unsupported by this CPU.\n", kernel_name);
+        printf("       Expected one of: scalar, sse, avx2, avx512, auto\n");
+        return -1;
+    }
+    if (optimizer_name != NULL && !optimizer_select(optimizer_name))
+    {
+        printf("Error: optimizer '%s' unknown.\n", optimizer_name);
+        printf("       Expected one of: adam, lazy\n");
+        return -1;
+    }
+    return kept;
+}
+
+/**
+ * Reads the operands of --train: --threads N, --seed S, --batch-size B,
+ * --cnn-shape NAME, --epochs N and --resume.
+ * Returns 0 on an unknown operand or a missing/invalid value, or when
+ * --resume is combined with an option the resumed run fixes.
+ */
+static int parse_training_options(int argc, char *argv[], TrainingOptions *options)
+{
+    for (int i = 2; i < argc; i++)
+    {
+        char *end = NULL;
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            long threads = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || threads < 1 || threads > 1024)
+                return 0;
+            options->threads = (int)threads;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            options->seed = strtoull(argv[++i], &end, 10);
+            if (*end != '\0')
+                return 0;
+            options->seeded = 1;
+        }
+        else if (strcmp(argv[i], "--batch-size") == 0 && i + 1 < argc)
+        {
+            long batch_size = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || batch_size < 1 || batch_size > PARALLEL_MAX_BATCH_SIZE)
+                return 0;
+            options->batch_size = (int)batch_size;
+        }
+        else if (strcmp(argv[i], "--cnn-shape") == 0 && i + 1 < argc)
+        {
+            CnnStage2 shape;
+            if (!cnn_stage2_parse(argv[++i], &shape))
+                return 0;
+            options->cnn_shape = (int)shape;
+        }
+        else if (strcmp(argv[i], "--epochs") == 0 && i + 1 < argc)
+        {
+            long epochs = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || epochs < 1 || epochs > 100000)
+                return 0;
+            options->epochs = (int)epochs;
+        }
+        else if (strcmp(argv[i], "--resume") == 0)
+        {
+            options->resume = 1;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    return !options->resume
+        || (!options->seeded && options->batch_size == 0 && options->cnn_shape < 0);
+}
+
 int main(int argc, char *argv[])
 {
-    srand((unsigned)time(NULL));
+    rng_seed(&rng_main, (uint64_t)time(NULL));
+
+    argc = parse_global_options(argc, argv);
+    if (argc < 0)
+        return 1;
 
     if (argc < 2)
     {
@@ -194,7 +309,35 @@ int main(int argc, char *argv[])
     }
     else if (strcmp(argv[1], "--train") == 0)
     {
-        TrainNetwork();
+        TrainingOptions options = { 0, 0, 0, -1, 0, 0, 0 };
+        if (!parse_training_options(argc, argv, &options))
+        {
+            printf("Usage: %s --train [--threads N] [--seed S] [--batch-size B] [--cnn-shape flat|strided|convpool] [--epochs N]\n"
+                   "       %s --train --resume [--threads N] [--epochs N]\n",
+                   argv[0], argv[0]);
+            return 1;
+        }
+        TrainNetworkWithOptions(&options);
+    }
+    else if (strcmp(argv[1], "--quantize") == 0)
+    {
+        QuantizeNetwork();
+    }
+    else if (strcmp(argv[1], "--export-inference") == 0)
+    {
+        ExportInferenceModel();
+    }
+    else if (strcmp(argv[1], "--export-text") == 0)
+    {
+        ExportTextWeights();
+    }
+    else if (strcmp(argv[1], "--import-text") == 0)
+    {
+        ImportTextWeights();
+    }
+    else if (strcmp(argv[1], "--bench") == 0)
+    {
+        return RunBenchmark(argc >= 3 ? argv[2] : NULL);
     }
     else
     {
@@ -204,9 +347,19 @@ int main(int argc, char *argv[])
         printf("-----------------------\n");
         printf("Arguments :\n");
         printf("    (Aucun) Lance l'interface utilisateur (GUI)\n");
-        printf("    --train Lance l'entrainement du réseau de neurones\n");
+        printf("    --train [--threads N] [--seed S] [--batch-size B] [--cnn-shape flat|strided|convpool] [--epochs N] Lance l'entrainement du réseau de neurones (N époques au plus, 200 par défaut)\n");
+        printf("    --train --resume [--threads N] [--epochs N] Reprend un entrainement interrompu\n");
+        printf("    --quantize Quantifie le modèle entraîné en int8 (rapport de précision)\n");
+        printf("    --export-inference Exporte le modèle figé utilisé par l'OCR\n");
+        printf("    --export-text Exporte le modèle binaire en fichiers texte (cnnwb.txt, ocrwb.txt)\n");
+        printf("    --import-text Reconstruit le modèle binaire à partir des fichiers texte\n");
         printf("    --OCR <image_path> Lance l'OCR sur l'image spécifiée\n");
         printf("    --XOR   Montre la fonction XOR\n");
+        printf("    --bench <nom> Lance un benchmark (sparse, optimizer, binary, shapes, training)\n");
+        printf("Options :\n");
+        printf("    --kernels=scalar|sse|avx2|avx512 Force les noyaux de calcul (auto par défaut : le plus rapide mesuré sur ce processeur)\n");
+        printf("    --retune Remesure les noyaux au démarrage au lieu de reprendre le choix en cache\n");
+        printf("    --optimizer=adam|lazy Adam complet (défaut) ou paresseux sur les lignes inactives\n");
     }
 
     return 0;
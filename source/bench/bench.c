@@ -0,0 +1,454 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+#include "../common.h"
+#include "../network/tools.h"
+#include "../network/network.h"
+#include "../network/cnn.h"
+#include "../network/autotune.h"
+#include "../network/modelfile.h"
+#include "../network/optimizer.h"
+#include "../network/rng.h"
+#include "../training/parallel.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum
+{
+    BENCH_CLASSES = 52,
+    BENCH_REPEATS = 20,
+    BENCH_SHAPE_EPOCHS = 15,
+    BENCH_SHAPE_HOLDOUT = 5, // every 5th glyph validates
+    BENCH_SHAPE_SEED = 7,
+    BENCH_TRAIN_EPOCHS = 5,
+    BENCH_TRAIN_MAX_THREADS = 8
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Trained weights when available (activation sparsity depends on them),
+// fresh He/Xavier init otherwise.
+static int load_models(CNN **cnn_out, struct network **net_out)
+{
+    CNN *cnn = init_cnn();
+    if (cnn == NULL) return 0;
+    ModelFile *file = model_open(OCR_MODEL_FILE);
+    if (!model_load_cnn(file, cnn))
+        printf("Note: no trained model, benchmarking a fresh init\n");
+
+    struct network *net = InitializeNetwork(cnn->output_size, OCR_HIDDEN_NODES,
+                                            BENCH_CLASSES, NULL);
+    model_load_network(file, net);
+    model_close(file);
+    network_sync_optimizer(net);
+    set_training_mode(net, 0);
+
+    *cnn_out = cnn;
+    *net_out = net;
+    return 1;
+}
+
+// Dense (cnn_forward_infer + forward_pass) against sparse
+// (cnn_forward_infer_sparse + forward_pass_sparse) inference. The MLP stage
+// is also timed on its own, from precomputed features, since the conv
+// dominates the end-to-end figure.
+static int bench_sparse(TrainingDataSet *data, CNN *cnn, struct network *net)
+{
+    int n = data->count;
+    int I = net->number_of_inputs;
+    real *features = malloc(sizeof(real) * (size_t)n * I);
+    int *indices = malloc(sizeof(int) * (size_t)n * I);
+    real *values = malloc(sizeof(real) * (size_t)n * I);
+    int *nnz = malloc(sizeof(int) * n);
+    if (features == NULL || indices == NULL || values == NULL || nnz == NULL)
+    {
+        free(features); free(indices); free(values); free(nnz);
+        return 1;
+    }
+
+    long total_nnz = 0;
+    int mismatches = 0;
+    for (int i = 0; i < n; i++)
+    {
+        real *f = features + (size_t)i * I;
+        int *idx = indices + (size_t)i * I;
+        real *val = values + (size_t)i * I;
+
+        cnn_forward_infer(cnn, data->inputs[i], f);
+        memcpy(net->input_layer, f, sizeof(real) * I);
+        forward_pass(net);
+        size_t dense_label = IndexAnswer(net);
+
+        nnz[i] = cnn_forward_infer_sparse(cnn, data->inputs[i], idx, val);
+        forward_pass_sparse(net, idx, val, nnz[i]);
+        mismatches += IndexAnswer(net) != dense_label;
+        total_nnz += nnz[i];
+    }
+
+    double t0 = now_seconds();
+    for (int r = 0; r < BENCH_REPEATS; r++)
+        for (int i = 0; i < n; i++)
+        {
+            memcpy(net->input_layer, features + (size_t)i * I,
+                   sizeof(real) * I);
+            forward_pass(net);
+        }
+    double t1 = now_seconds();
+    for (int r = 0; r < BENCH_REPEATS; r++)
+        for (int i = 0; i < n; i++)
+            forward_pass_sparse(net, indices + (size_t)i * I,
+                                values + (size_t)i * I, nnz[i]);
+    double t2 = now_seconds();
+    for (int r = 0; r < BENCH_REPEATS; r++)
+        for (int i = 0; i < n; i++)
+        {
+            cnn_forward_infer(cnn, data->inputs[i], net->input_layer);
+            forward_pass(net);
+        }
+    double t3 = now_seconds();
+    for (int r = 0; r < BENCH_REPEATS; r++)
+        for (int i = 0; i < n; i++)
+        {
+            int k = cnn_forward_infer_sparse(cnn, data->inputs[i], indices, values);
+            forward_pass_sparse(net, indices, values, k);
+        }
+    double t4 = now_seconds();
+
+    double glyphs = (double)n * BENCH_REPEATS;
+    double density = (double)total_nnz / ((double)n * I);
+    printf("\n=== SPARSE FORWARD BENCHMARK (%d glyphs x %d) ===\n", n, BENCH_REPEATS);
+    printf("Non-zero pooled features: %.1f / %d (%.1f%% sparse)\n",
+           (double)total_nnz / n, I, (1.0 - density) * 100.0);
+    printf("MLP only   : dense %8.2f us/glyph, sparse %8.2f us/glyph (%.2fx)\n",
+           (t1 - t0) * 1e6 / glyphs, (t2 - t1) * 1e6 / glyphs, (t1 - t0) / (t2 - t1));
+    printf("CNN + MLP  : dense %8.2f us/glyph, sparse %8.2f us/glyph (%.2fx)\n",
+           (t3 - t2) * 1e6 / glyphs, (t4 - t3) * 1e6 / glyphs, (t3 - t2) / (t4 - t3));
+    printf("Prediction mismatches: %d\n", mismatches);
+
+    free(features);
+    free(indices);
+    free(values);
+    free(nnz);
+    return 0;
+}
+
+// Times one MLP training step (forward + back_propagation) per glyph under
+// dense and lazy Adam, from precomputed CNN features. Both runs start from
+// the same snapshot of the network.
+static int bench_optimizer(TrainingDataSet *data, CNN *cnn, struct network *net)
+{
+    int n = data->count;
+    int I = net->number_of_inputs;
+    real *features = malloc(sizeof(real) * (size_t)n * I);
+    void *snapshot = malloc(network_arena_bytes(net));
+    if (features == NULL || snapshot == NULL)
+    {
+        free(features);
+        free(snapshot);
+        return 1;
+    }
+    for (int i = 0; i < n; i++)
+        cnn_forward_infer(cnn, data->inputs[i], features + (size_t)i * I);
+
+    const OptimizerMode modes[] = { OPTIMIZER_ADAM, OPTIMIZER_LAZY_ADAM };
+    const char *names[] = { "adam", "lazy" };
+    double seconds[2];
+    OptimizerMode saved_mode = optimizer_mode;
+
+    set_training_mode(net, 1);
+    network_snapshot(net, snapshot);
+    for (int m = 0; m < 2; m++)
+    {
+        optimizer_mode = modes[m];
+        network_restore(net, snapshot);
+        double t0 = now_seconds();
+        for (int i = 0; i < n; i++)
+        {
+            memcpy(net->input_layer, features + (size_t)i * I,
+                   sizeof(real) * I);
+            int label = LabelIndex(data->labels[i]);
+            memset(net->goal, 0, sizeof(real) * BENCH_CLASSES);
+            if (label >= 0 && label < BENCH_CLASSES)
+                net->goal[label] = 1;
+            network_catch_up(net);
+            forward_pass(net);
+            back_propagation(net);
+        }
+        network_sync_optimizer(net);
+        seconds[m] = now_seconds() - t0;
+    }
+    optimizer_mode = saved_mode;
+    network_restore(net, snapshot);
+    set_training_mode(net, 0);
+
+    printf("\n=== OPTIMIZER BENCHMARK (%d glyphs, kernels %s) ===\n", n, kernels.name);
+    for (int m = 0; m < 2; m++)
+        printf("%-5s: %8.2f us/step\n", names[m], seconds[m] * 1e6 / n);
+    printf("lazy speedup: %.2fx\n", seconds[0] / seconds[1]);
+
+    free(features);
+    free(snapshot);
+    return 0;
+}
+
+// Float conv (stage 1 of cnn_forward_infer) against the bit-packed
+// lookup-table conv (glyph packing + cnn_forward_binary), which must give
+// identical features.
+static int bench_binary(TrainingDataSet *data, CNN *cnn, struct network *net)
+{
+    (void)net;
+    int n = data->count;
+    real *lut = malloc(sizeof(real) * NUM_FILTERS * CONV_PATTERNS);
+    GlyphBits *glyphs = malloc(sizeof(GlyphBits) * n);
+    if (lut == NULL || glyphs == NULL)
+    {
+        free(lut);
+        free(glyphs);
+        return 1;
+    }
+
+    cnn_binary_lut(&cnn->filters[0][0][0], cnn->biases, lut);
+    real dense[FLATTEN_SIZE], binary[FLATTEN_SIZE];
+    int mismatches = 0;
+    for (int i = 0; i < n; i++)
+    {
+        glyph_pack_image(data->inputs[i], &glyphs[i]);
+        cnn_forward_infer_weights(&cnn->filters[0][0][0], cnn->biases,
+                                  data->inputs[i], dense);
+        cnn_forward_binary(lut, &glyphs[i], binary);
+        mismatches += memcmp(dense, binary, sizeof(dense)) != 0;
+    }
+
+    double t0 = now_seconds();
+    for (int r = 0; r < BENCH_REPEATS; r++)
+        for (int i = 0; i < n; i++)
+            cnn_forward_infer_weights(&cnn->filters[0][0][0], cnn->biases,
+                                      data->inputs[i], dense);
+    double t1 = now_seconds();
+    for (int r = 0; r < BENCH_REPEATS; r++)
+        for (int i = 0; i < n; i++)
+        {
+            glyph_pack_image(data->inputs[i], &glyphs[i]);
+            cnn_forward_binary(lut, &glyphs[i], binary);
+        }
+    double t2 = now_seconds();
+
+    double count = (double)n * BENCH_REPEATS;
+    printf("\n=== BINARY CONV BENCHMARK (%d glyphs x %d) ===\n", n, BENCH_REPEATS);
+    printf("float conv : %8.2f us/glyph\n", (t1 - t0) * 1e6 / count);
+    printf("binary conv: %8.2f us/glyph, packing included (%.2fx)\n",
+           (t2 - t1) * 1e6 / count, (t1 - t0) / (t2 - t1));
+    printf("Glyphs with differing features: %d\n", mismatches);
+
+    free(lut);
+    free(glyphs);
+    return mismatches != 0;
+}
+
+// Trains a CNN of the given shape from scratch on `train` (seeded, so
+// every shape starts from the same stream) and returns it with its MLP.
+static void train_shape(CnnStage2 shape, TrainingDataSet *train,
+                        CNN **cnn_out, struct network **net_out)
+{
+    rng_seed(&rng_main, BENCH_SHAPE_SEED);
+    CNN *cnn = init_cnn();
+    if (cnn == NULL) errx(1, "Failed to init CNN");
+    cnn_set_stage2(cnn, shape);
+    struct network *net = InitializeNetwork(cnn->output_size, OCR_HIDDEN_NODES,
+                                            BENCH_CLASSES, NULL);
+    net->eta = 0.001;
+
+    int *order = malloc(sizeof(int) * train->count);
+    ParallelTrainer *trainer = parallel_trainer_create(cnn, net, 1, PARALLEL_BATCH_SIZE);
+    if (order == NULL || trainer == NULL) errx(1, "Not enough memory!");
+    for (int i = 0; i < train->count; i++) order[i] = i;
+
+    EpochStats stats;
+    for (int epoch = 0; epoch < BENCH_SHAPE_EPOCHS; epoch++)
+    {
+        shuffle(&rng_main, order, train->count);
+        parallel_train_epoch(trainer, train, order, train->count,
+                             BENCH_SHAPE_SEED, epoch, &stats);
+    }
+    parallel_trainer_free(trainer);
+    free(order);
+    set_training_mode(net, 0);
+
+    *cnn_out = cnn;
+    *net_out = net;
+}
+
+static int predict(CNN *cnn, struct network *net, const double *image)
+{
+    cnn_forward_infer(cnn, image, net->input_layer);
+    forward_pass(net);
+    return (int)IndexAnswer(net);
+}
+
+// Every CNN shape trained briefly from scratch on 4/5 of the glyphs:
+// validation accuracy on the rest, and CNN + MLP inference throughput.
+static int bench_shapes(TrainingDataSet *data, CNN *cnn, struct network *net)
+{
+    (void)cnn;
+    (void)net;
+    int n = data->count;
+    TrainingDataSet train = { malloc(sizeof(double *) * n), malloc(n), 0, n, 0 };
+    TrainingDataSet val = { malloc(sizeof(double *) * n), malloc(n), 0, n, 0 };
+    if (!train.inputs || !train.labels || !val.inputs || !val.labels)
+        errx(1, "Not enough memory!");
+    for (int i = 0; i < n; i++)
+    {
+        TrainingDataSet *set = i % BENCH_SHAPE_HOLDOUT == 0 ? &val : &train;
+        set->inputs[set->count] = data->inputs[i];
+        set->labels[set->count] = data->labels[i];
+        set->count++;
+    }
+
+    printf("\n=== CNN SHAPE BENCHMARK (train %d, val %d, %d epochs) ===\n",
+           train.count, val.count, BENCH_SHAPE_EPOCHS);
+    printf("%-9s %8s %12s %12s %9s\n", "shape", "features", "MLP weights",
+           "glyphs/s", "val acc");
+
+    for (int shape = CNN_STAGE2_NONE; shape <= CNN_STAGE2_CONV_POOL; shape++)
+    {
+        CNN *c = NULL;
+        struct network *m = NULL;
+        train_shape((CnnStage2)shape, &train, &c, &m);
+
+        int correct = 0;
+        for (int i = 0; i < val.count; i++)
+            correct += predict(c, m, val.inputs[i]) == LabelIndex(val.labels[i]);
+
+        double t0 = now_seconds();
+        for (int r = 0; r < BENCH_REPEATS; r++)
+            for (int i = 0; i < n; i++)
+                predict(c, m, data->inputs[i]);
+        double seconds = now_seconds() - t0;
+
+        printf("%-9s %8d %12d %12.0f %8.2f%%\n", cnn_stage2_name(c->stage2),
+               c->output_size, c->output_size * OCR_HIDDEN_NODES,
+               (double)n * BENCH_REPEATS / seconds,
+               val.count > 0 ? 100.0 * correct / val.count : 0.0);
+
+        freeNetwork(m);
+        free_cnn(c);
+    }
+
+    free(train.inputs);
+    free(train.labels);
+    free(val.inputs);
+    free(val.labels);
+    return 0;
+}
+
+// Data-parallel training throughput (samples/s) for 1, 2, 4 and 8 worker
+// threads. Every run trains the same seeded fresh flat model for a few
+// epochs, so the figures only differ by the thread count.
+static int bench_training(TrainingDataSet *data, CNN *cnn, struct network *net)
+{
+    (void)cnn;
+    (void)net;
+    int n = data->count;
+    int *order = malloc(sizeof(int) * n);
+    if (order == NULL) errx(1, "Not enough memory!");
+
+    printf("\n=== TRAINING BENCHMARK (%d glyphs, %d epochs, batch %d, kernels %s) ===\n",
+           n, BENCH_TRAIN_EPOCHS, PARALLEL_BATCH_SIZE, kernels.name);
+    printf("%-8s %12s %9s\n", "threads", "samples/s", "speedup");
+
+    double single = 0;
+    for (int threads = 1; threads <= BENCH_TRAIN_MAX_THREADS; threads *= 2)
+    {
+        rng_seed(&rng_main, BENCH_SHAPE_SEED);
+        CNN *c = init_cnn();
+        if (c == NULL) errx(1, "Failed to init CNN");
+        struct network *m = InitializeNetwork(c->output_size, OCR_HIDDEN_NODES,
+                                              BENCH_CLASSES, NULL);
+        m->eta = 0.001;
+        ParallelTrainer *trainer = parallel_trainer_create(c, m, threads, PARALLEL_BATCH_SIZE);
+        if (trainer == NULL) errx(1, "Not enough memory!");
+        for (int i = 0; i < n; i++) order[i] = i;
+
+        EpochStats stats;
+        double t0 = now_seconds();
+        for (int epoch = 0; epoch < BENCH_TRAIN_EPOCHS; epoch++)
+        {
+            shuffle(&rng_main, order, n);
+            parallel_train_epoch(trainer, data, order, n, BENCH_SHAPE_SEED,
+                                 epoch, &stats);
+        }
+        double rate = (double)n * BENCH_TRAIN_EPOCHS / (now_seconds() - t0);
+        if (threads == 1) single = rate;
+        printf("%-8d %12.0f %8.2fx\n", threads, rate, rate / single);
+
+        parallel_trainer_free(trainer);
+        freeNetwork(m);
+        free_cnn(c);
+    }
+
+    free(order);
+    return 0;
+}
+
+typedef struct
+{
+    const char *name;
+    int (*run)(TrainingDataSet *data, CNN *cnn, struct network *net);
+} Benchmark;
+
+static const Benchmark benchmarks[] =
+{
+    { "sparse",    bench_sparse },
+    { "optimizer", bench_optimizer },
+    { "binary",    bench_binary },
+    { "shapes",    bench_shapes },
+    { "training",  bench_training },
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int RunBenchmark(const char *name)
+{
+    const Benchmark *bench = NULL;
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++)
+        if (name != NULL && strcmp(name, benchmarks[i].name) == 0)
+            bench = &benchmarks[i];
+
+    if (bench == NULL)
+    {
+        printf("Unknown benchmark '%s'. Available:", name ? name : "");
+        for (size_t i = 0; i < BENCHMARK_COUNT; i++)
+            printf(" %s", benchmarks[i].name);
+        printf("\n");
+        return 1;
+    }
+
+    kernels_autotune();
+    printf("Loading Dataset...\n");
+    TrainingDataSet *data = loadDataSet();
+    if (data == NULL) return 1;
+
+    CNN *cnn = NULL;
+    struct network *net = NULL;
+    if (!load_models(&cnn, &net))
+    {
+        freeDataSet(data);
+        return 1;
+    }
+
+    int status = bench->run(data, cnn, net);
+
+    freeNetwork(net);
+    free_cnn(cnn);
+    freeDataSet(data);
+    return status;
+}
@@ -0,0 +1,8 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Runs the named micro-benchmark on the real training glyphs and prints its
+// report. Returns 0 on success, 1 if the name is unknown or setup failed.
+int RunBenchmark(const char *name);
+
+#endif
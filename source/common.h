@@ -9,6 +9,16 @@
 // Suppress unused parameter warnings
 #define UNUSED(x) (void)(x)
 
+// Scalar type of every network weight, Adam moment and activation.
+// Builds default to double; `make float32` switches the model to float.
+#ifdef OCR_FLOAT32
+typedef float real;
+#define REAL_BITS 32
+#else
+typedef double real;
+#define REAL_BITS 64
+#endif
+
 // Adam optimizer hyperparameters
 #define ADAM_BETA1  0.9
 #define ADAM_BETA2  0.999
@@ -17,8 +27,16 @@
 // File paths
 #define XOR_WEIGHTS_PATH   "source/Xor/xorwb.txt"
 #define XOR_DATA_PATH      "source/Xor/xordata.txt"
+#define OCR_MODEL_FILE     "source/OCR-data/ocr.model"
+#define OCR_RESUME_STATE   "source/OCR-data/resume.txt"
+#define OCR_RESUME_MODEL_EVEN "source/OCR-data/resume-even.model"
+#define OCR_RESUME_MODEL_ODD  "source/OCR-data/resume-odd.model"
 #define OCR_MLP_WEIGHTS    "source/OCR-data/ocrwb.txt"
 #define OCR_CNN_WEIGHTS    "source/OCR-data/cnnwb.txt"
+#define OCR_Q8_WEIGHTS     "source/OCR-data/ocrq8.txt"
+#define OCR_INFERENCE_WEIGHTS "source/OCR-data/ocrinf.model"
+#define OCR_TUNING_CACHE   "source/OCR-data/tuning.txt"
+#define OCR_DATASET_CACHE  "source/OCR-data/dataset.cache"
 
 // Image processing
 #define BW_THRESHOLD       180
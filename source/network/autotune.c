@@ -0,0 +1,245 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "autotune.h"
+#include "../common.h"
+#include "cnn.h"
+#include "kernels.h"
+#include "network.h"
+#include "rng.h"
+#include "tools.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum
+{
+    TUNE_GLYPHS = 64,   // synthetic glyphs per timed pass
+    TUNE_REPEATS = 5,   // passes per kernel set, the fastest one counts
+    TUNE_SEED = 7,
+    TUNE_LINE = 256     // longest cache / cpuinfo line read
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int tune_requested;
+static int tune_retune;
+
+// "model name" of /proc/cpuinfo. Returns 0, name being "unknown", where
+// there is none: such hosts would all share one cache entry.
+static int cpu_model(char *name, size_t size)
+{
+    snprintf(name, size, "unknown");
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f == NULL) return 0;
+
+    char line[TUNE_LINE];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL)
+    {
+        char *value = strchr(line, ':');
+        if (strncmp(line, "model name", 10) != 0 || value == NULL)
+            continue;
+        value += strspn(value + 1, " \t") + 1;
+        value[strcspn(value, "\n")] = '\0';
+        if (*value != '\0')
+        {
+            snprintf(name, size, "%s", value);
+            found = 1;
+        }
+        break;
+    }
+    fclose(f);
+    return found;
+}
+
+// The directory of the cache exists and takes new files (the temporary
+// file of write_file_atomic())
+static int cache_writable(void)
+{
+    char dir[TUNE_LINE];
+    snprintf(dir, sizeof(dir), "%s", OCR_TUNING_CACHE);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        snprintf(dir, sizeof(dir), ".");
+    else
+        *slash = '\0';
+    return access(dir, W_OK | X_OK) == 0;
+}
+
+// The cache holds one "<set> <cpu model>" line per CPU model seen.
+// Copies the set cached for `cpu` into set; 0 when there is none.
+static int cache_lookup(const char *cpu, char *set, size_t size)
+{
+    FILE *f = fopen(OCR_TUNING_CACHE, "r");
+    if (f == NULL) return 0;
+
+    char line[TUNE_LINE];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        char *space = strchr(line, ' ');
+        if (space == NULL || strcmp(space + 1, cpu) != 0)
+            continue;
+        *space = '\0';
+        snprintf(set, size, "%s", line);
+        found = 1;
+    }
+    fclose(f);
+    return found;
+}
+
+// Rewrites the cache with `cpu` mapped to `set`, keeping the other models.
+// The new content replaces the file atomically, so a crash or a concurrent
+// run never leaves it truncated.
+static void cache_store(const char *cpu, const char *set)
+{
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    if (out == NULL) errx(1, "Not enough memory!");
+
+    FILE *f = fopen(OCR_TUNING_CACHE, "r");
+    if (f != NULL)
+    {
+        char line[TUNE_LINE];
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+            char model[TUNE_LINE];
+            const char *space = strchr(line, ' ');
+            snprintf(model, sizeof(model), "%s", space != NULL ? space + 1 : "");
+            model[strcspn(model, "\n")] = '\0';
+            if (strcmp(model, cpu) != 0)
+                fputs(line, out);
+        }
+        fclose(f);
+    }
+    fprintf(out, "%s %s\n", set, cpu);
+    if (fclose(out) != 0) errx(1, "Not enough memory!");
+
+    if (!write_file_atomic(OCR_TUNING_CACHE, text, length))
+        fprintf(stderr, "kernels_autotune: cannot write %s, the choice is not cached\n",
+                OCR_TUNING_CACHE);
+    free(text);
+}
+
+// Fastest of TUNE_REPEATS passes over the glyphs: batched convolution,
+// then the MLP forward pass glyph by glyph
+static double time_kernels(const CNN *cnn, struct network *net, ConvWorkspace *ws,
+                           const double *const *glyphs, real *features)
+{
+    double best = 0;
+    for (int r = 0; r < TUNE_REPEATS; r++)
+    {
+        double t0 = now_seconds();
+        cnn_forward_batch(&cnn->filters[0][0][0], cnn->biases, ws, 0, TUNE_GLYPHS,
+                          glyphs, features);
+        for (int g = 0; g < TUNE_GLYPHS; g++)
+        {
+            memcpy(net->input_layer, features + (size_t)g * FLATTEN_SIZE,
+                   sizeof(real) * FLATTEN_SIZE);
+            forward_pass(net);
+        }
+        double seconds = now_seconds() - t0;
+        if (r == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+static const char *tune(const char *cpu)
+{
+    // The freshly initialized models draw from rng_main: put it back after,
+    // so a tuning run trains the same as a cached one
+    Rng saved = rng_main;
+    CNN *cnn = init_cnn();
+    struct network *net = InitializeNetwork(FLATTEN_SIZE, OCR_HIDDEN_NODES,
+                                            OCR_OUTPUT_NODES, NULL);
+    ConvWorkspace *ws = conv_workspace_create(TUNE_GLYPHS, 0);
+    double *pixels = malloc(sizeof(double) * TUNE_GLYPHS * IMAGE_PIXELS);
+    real *features = malloc(sizeof(real) * TUNE_GLYPHS * FLATTEN_SIZE);
+    const double *glyphs[TUNE_GLYPHS];
+    if (cnn == NULL || ws == NULL || pixels == NULL || features == NULL)
+        errx(1, "Not enough memory!");
+    set_training_mode(net, 0);
+
+    // Ink blots in the middle of the frame, about as sparse as real glyphs
+    Rng rng;
+    rng_seed(&rng, TUNE_SEED);
+    for (int g = 0; g < TUNE_GLYPHS; g++)
+    {
+        double *glyph = pixels + (size_t)g * IMAGE_PIXELS;
+        for (int p = 0; p < IMAGE_PIXELS; p++)
+        {
+            int x = p % IMAGE_SIZE, y = p / IMAGE_SIZE;
+            int inside = x >= 4 && x < IMAGE_SIZE - 4 && y >= 4 && y < IMAGE_SIZE - 4;
+            glyph[p] = inside && rng_uniform(&rng) < 0.3 ? 1.0 : 0.0;
+        }
+        glyphs[g] = glyph;
+    }
+
+    printf("Tuning kernels for %s:", cpu);
+    const char *best = NULL;
+    double best_seconds = 0;
+    const char *name;
+    for (int i = 0; (name = kernels_set_name(i)) != NULL; i++)
+    {
+        if (!kernels_select(name))
+            continue;
+        double seconds = time_kernels(cnn, net, ws, glyphs, features);
+        printf(" %s %.1f us", name, seconds * 1e6 / TUNE_GLYPHS);
+        if (best == NULL || seconds < best_seconds)
+        {
+            best = name;
+            best_seconds = seconds;
+        }
+    }
+    printf(" -> %s\n", best);
+    kernels_select(best);
+
+    free(features);
+    free(pixels);
+    conv_workspace_free(ws);
+    freeNetwork(net);
+    free_cnn(cnn);
+    rng_main = saved;
+    return best;
+}
+
+void kernels_autotune_request(int retune)
+{
+    kernels_select(NULL);
+    tune_requested = 1;
+    tune_retune = retune;
+}
+
+const char *kernels_autotune(void)
+{
+    if (!tune_requested)
+        return kernels.name;
+    tune_requested = 0;
+
+    char cpu[TUNE_LINE];
+    char cached[TUNE_LINE];
+    int known = cpu_model(cpu, sizeof(cpu));
+    if (known && !tune_retune && cache_lookup(cpu, cached, sizeof(cached))
+        && kernels_select(cached))
+        return kernels.name;
+
+    int cacheable = known && cache_writable();
+    if (!cacheable && !tune_retune)
+        return kernels.name;
+    const char *best = tune(cpu);
+    if (cacheable)
+        cache_store(cpu, best);
+    return kernels.name;
+}
@@ -0,0 +1,25 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+// Picks the kernel set (kernels.h) that runs the OCR hot paths fastest on
+// this host. Every set the CPU supports times the batched convolution and
+// the MLP forward pass on synthetic glyphs; the winner is cached per CPU
+// model in OCR_TUNING_CACHE and reused by later runs.
+// Whole sets are compared, not each kernel on its own: the sets round
+// differently, and one set name per run keeps a seeded training run
+// reproducible and the cache interchangeable with --kernels.
+
+// Asks for the tuned set (`retune`: measure again instead of reading the
+// cache). Cheap: it selects the widest supported set, and the tuning waits
+// for the first kernels_autotune().
+void kernels_autotune_request(int retune);
+
+// Called by the commands that run the OCR hot paths before they start.
+// The first call after a request selects the set cached for this CPU
+// model, or tunes and caches one. Where the choice could not be cached
+// (no writable cache directory, no CPU model name) it keeps the widest set
+// instead of measuring on every run, unless `retune` asked for a
+// measurement. Returns the selected set's name.
+const char *kernels_autotune(void);
+
+#endif
@@ -3,6 +3,25 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "kernels.h"
+#include "optimizer.h"
+
+static void stage2_reset(CNN* cnn) {
+    memset(cnn->m_filters2, 0, sizeof(cnn->m_filters2));
+    memset(cnn->v_filters2, 0, sizeof(cnn->v_filters2));
+    memset(cnn->m_biases2,  0, sizeof(cnn->m_biases2));
+    memset(cnn->v_biases2,  0, sizeof(cnn->v_biases2));
+    memset(cnn->biases2,    0, sizeof(cnn->biases2));
+
+    // The flat shape draws nothing, so its runs keep their random stream
+    if (cnn->stage2 == CNN_STAGE2_NONE) {
+        memset(cnn->filters2, 0, sizeof(cnn->filters2));
+        return;
+    }
+    for (int k = 0; k < STAGE2_WEIGHTS; k++)
+        cnn->filters2[k] = init_weight_he(STAGE2_TAPS);
+}
+
 void cnn_reset(CNN* cnn) {
     if (!cnn) return;
 
@@ -26,6 +45,16 @@ void cnn_reset(CNN* cnn) {
     cnn->adam_beta1_t = 1.0;
     cnn->adam_beta2_t = 1.0;
     cnn->image_ptr    = NULL;
+
+    cnn->output_size = cnn_stage2_outputs(cnn->stage2);
+    stage2_reset(cnn);
+}
+
+void cnn_set_stage2(CNN* cnn, CnnStage2 stage2) {
+    if (cnn->stage2 == stage2) return;
+    cnn->stage2 = stage2;
+    cnn->output_size = cnn_stage2_outputs(stage2);
+    stage2_reset(cnn);
 }
 
 CNN* init_cnn() {
@@ -39,201 +68,533 @@ void free_cnn(CNN* cnn) {
     if (cnn) free(cnn);
 }
 
-// Access flat image as 2D: image[y][x] = image_ptr[y * INPUT_W + x]
-#define IMG(y, x) cnn->image_ptr[(y) * INPUT_W + (x)]
+static void forward_image(const real *filters, const real *biases,
+                          const double *image, real *out, unsigned char *pool_mask);
 
-void cnn_forward(CNN* cnn, double image[IMAGE_PIXELS], double *out) {
+void cnn_forward(CNN* cnn, double image[IMAGE_PIXELS], real *out) {
     // Store pointer to input (no copy)
     cnn->image_ptr = image;
 
-    // Convolution (valid padding) + ReLU — 3x3 kernel fully unrolled
-    for (int f = 0; f < NUM_FILTERS; f++) {
-        double f00 = cnn->filters[f][0][0], f01 = cnn->filters[f][0][1], f02 = cnn->filters[f][0][2];
-        double f10 = cnn->filters[f][1][0], f11 = cnn->filters[f][1][1], f12 = cnn->filters[f][1][2];
-        double f20 = cnn->filters[f][2][0], f21 = cnn->filters[f][2][1], f22 = cnn->filters[f][2][2];
-        double bias = cnn->biases[f];
-
-        for (int y = 0; y < CONV_H; y++) {
-            for (int x = 0; x < CONV_W; x++) {
-                double sum = bias
-                    + IMG(y,   x) * f00 + IMG(y,   x+1) * f01 + IMG(y,   x+2) * f02
-                    + IMG(y+1, x) * f10 + IMG(y+1, x+1) * f11 + IMG(y+1, x+2) * f12
-                    + IMG(y+2, x) * f20 + IMG(y+2, x+1) * f21 + IMG(y+2, x+2) * f22;
-                cnn->conv_output[f][y][x] = (sum > 0) ? sum : 0.0;
-            }
-        }
+    // Fused conv + ReLU + pool: only the pool masks are kept for backprop
+    if (cnn->stage2 == CNN_STAGE2_NONE) {
+        forward_image(&cnn->filters[0][0][0], cnn->biases, image, out,
+                      &cnn->pool_mask[0][0][0]);
+        return;
+    }
+    forward_image(&cnn->filters[0][0][0], cnn->biases, image, cnn->stage1,
+                  &cnn->pool_mask[0][0][0]);
+    cnn_stage2_forward(cnn->stage2, cnn->filters2, cnn->biases2, cnn->stage1, out,
+                       cnn->stage2_mask);
+}
+
+// `filter` is one filter's 3x3 taps, row-major.
+static inline real conv_relu_at(const double *image, const real *filter,
+                                real bias, int y, int x)
+{
+#define PX(yy, xx) ((real)image[(yy) * INPUT_W + (xx)])
+    real sum = bias
+        + PX(y, x) * filter[0]
+        + PX(y, x + 1) * filter[1]
+        + PX(y, x + 2) * filter[2]
+        + PX(y + 1, x) * filter[3]
+        + PX(y + 1, x + 1) * filter[4]
+        + PX(y + 1, x + 2) * filter[5]
+        + PX(y + 2, x) * filter[6]
+        + PX(y + 2, x + 1) * filter[7]
+        + PX(y + 2, x + 2) * filter[8];
+#undef PX
+
+    return sum > 0 ? sum : 0;
+}
+
+// Max of the four ReLU'd conv responses feeding pool cell (y, x).
+static inline real pooled_at(const double *image, const real *filter,
+                             real bias, int y, int x)
+{
+    int sy = y * POOL_SIZE;
+    int sx = x * POOL_SIZE;
+    real max_val = conv_relu_at(image, filter, bias, sy, sx);
+    real v = conv_relu_at(image, filter, bias, sy, sx + 1);
+    if (v > max_val) max_val = v;
+    v = conv_relu_at(image, filter, bias, sy + 1, sx);
+    if (v > max_val) max_val = v;
+    v = conv_relu_at(image, filter, bias, sy + 1, sx + 1);
+    if (v > max_val) max_val = v;
+    return max_val;
+}
+
+void cnn_forward_infer(CNN* cnn, const double image[IMAGE_PIXELS], real *out) {
+    if (cnn->stage2 == CNN_STAGE2_NONE) {
+        cnn_forward_infer_weights(&cnn->filters[0][0][0], cnn->biases, image, out);
+        return;
     }
+    real stage1[FLATTEN_SIZE];
+    cnn_forward_infer_weights(&cnn->filters[0][0][0], cnn->biases, image, stage1);
+    cnn_stage2_forward(cnn->stage2, cnn->filters2, cnn->biases2, stage1, out, NULL);
+}
+
+void cnn_forward_infer_weights(const real *filters, const real *biases,
+                               const double image[IMAGE_PIXELS], real *out) {
+    int idx = 0;
 
-    // Max Pooling (2x2)
     for (int f = 0; f < NUM_FILTERS; f++) {
-        for (int y = 0; y < POOL_H; y++) {
-            for (int x = 0; x < POOL_W; x++) {
-                int sy = y * POOL_SIZE;
-                int sx = x * POOL_SIZE;
-                double v00 = cnn->conv_output[f][sy][sx];
-                double v01 = cnn->conv_output[f][sy][sx+1];
-                double v10 = cnn->conv_output[f][sy+1][sx];
-                double v11 = cnn->conv_output[f][sy+1][sx+1];
-
-                double max_val = v00;
-                int max_idx = 0;
-                if (v01 > max_val) { max_val = v01; max_idx = 1; }
-                if (v10 > max_val) { max_val = v10; max_idx = 2; }
-                if (v11 > max_val) { max_val = v11; max_idx = 3; }
-
-                cnn->pool_output[f][y][x] = max_val;
-                cnn->pool_mask[f][y][x] = max_idx;
-            }
+        const real *filter = filters + f * CONV_SIZE * CONV_SIZE;
+        real bias = biases[f];
+
+        for (int y = 0; y < POOL_H; y++)
+            for (int x = 0; x < POOL_W; x++)
+                out[idx++] = pooled_at(image, filter, bias, y, x);
+    }
+}
+
+int cnn_forward_infer_sparse(CNN* cnn, const double image[IMAGE_PIXELS],
+                             int *indices, real *values) {
+    int nnz = 0;
+    real plane[POOL_H * POOL_W];
+
+    if (cnn->stage2 != CNN_STAGE2_NONE) {
+        real dense[STAGE2_MAX_OUTPUTS];
+        cnn_forward_infer(cnn, image, dense);
+        for (int k = 0; k < cnn->output_size; k++) {
+            indices[nnz] = k;
+            values[nnz] = dense[k];
+            nnz += dense[k] != 0;
         }
+        return nnz;
     }
 
-    // Flatten directly into caller-supplied buffer
-    int idx = 0;
     for (int f = 0; f < NUM_FILTERS; f++) {
-        for (int y = 0; y < POOL_H; y++) {
-            for (int x = 0; x < POOL_W; x++) {
-                out[idx++] = cnn->pool_output[f][y][x];
-            }
+        const real *filter = &cnn->filters[f][0][0];
+        real bias = cnn->biases[f];
+
+        // Dense pooled plane first (keeps the conv loop vectorizable),
+        // then a branch-free compaction: a zero's slot is overwritten.
+        for (int y = 0; y < POOL_H; y++)
+            for (int x = 0; x < POOL_W; x++)
+                plane[y * POOL_W + x] = pooled_at(image, filter, bias, y, x);
+
+        int base = f * POOL_H * POOL_W;
+        for (int k = 0; k < POOL_H * POOL_W; k++) {
+            indices[nnz] = base + k;
+            values[nnz] = plane[k];
+            nnz += plane[k] != 0;
         }
     }
+    return nnz;
 }
 
-static inline double conv_relu_at(const double *image, double filter[CONV_SIZE][CONV_SIZE],
-                                  double bias, int y, int x)
-{
-    double sum = bias
-        + image[y * INPUT_W + x] * filter[0][0]
-        + image[y * INPUT_W + x + 1] * filter[0][1]
-        + image[y * INPUT_W + x + 2] * filter[0][2]
-        + image[(y + 1) * INPUT_W + x] * filter[1][0]
-        + image[(y + 1) * INPUT_W + x + 1] * filter[1][1]
-        + image[(y + 1) * INPUT_W + x + 2] * filter[1][2]
-        + image[(y + 2) * INPUT_W + x] * filter[2][0]
-        + image[(y + 2) * INPUT_W + x + 1] * filter[2][1]
-        + image[(y + 2) * INPUT_W + x + 2] * filter[2][2];
+void glyph_pack_matrix(const int matrix[IMAGE_PIXELS], GlyphBits *bits) {
+    for (int y = 0; y < INPUT_H; y++) {
+        uint32_t row = 0;
+        for (int x = 0; x < INPUT_W; x++)
+            row |= (uint32_t)(matrix[y * INPUT_W + x] != 0) << x;
+        bits->rows[y] = row;
+    }
+}
 
-    return sum > 0.0 ? sum : 0.0;
+void glyph_pack_image(const double image[IMAGE_PIXELS], GlyphBits *bits) {
+    for (int y = 0; y < INPUT_H; y++) {
+        uint32_t row = 0;
+        for (int x = 0; x < INPUT_W; x++)
+            row |= (uint32_t)(image[y * INPUT_W + x] != 0) << x;
+        bits->rows[y] = row;
+    }
 }
 
-void cnn_forward_infer(CNN* cnn, const double image[IMAGE_PIXELS], double *out) {
-    int idx = 0;
+void cnn_binary_lut(const real *filters, const real *biases, real *lut) {
+    // Rendering each pattern as a 3x3 0/1 image and reusing conv_relu_at()
+    // performs the very same operations as the float path, so every entry
+    // is bit-identical to the response it replaces.
+    double window[3 * INPUT_W] = { 0 };
 
-    for (int f = 0; f < NUM_FILTERS; f++) {
-        double (*filter)[CONV_SIZE] = cnn->filters[f];
-        double bias = cnn->biases[f];
+    for (int code = 0; code < CONV_PATTERNS; code++) {
+        for (int k = 0; k < CONV_TAPS; k++)
+            window[(k / CONV_SIZE) * INPUT_W + k % CONV_SIZE] = (code >> k) & 1;
+        for (int f = 0; f < NUM_FILTERS; f++)
+            lut[f * CONV_PATTERNS + code] =
+                conv_relu_at(window, filters + f * CONV_TAPS, biases[f], 0, 0);
+    }
+}
 
-        for (int y = 0; y < POOL_H; y++) {
-            int sy = y * POOL_SIZE;
-            for (int x = 0; x < POOL_W; x++) {
-                int sx = x * POOL_SIZE;
-                double max_val = conv_relu_at(image, filter, bias, sy, sx);
-                double v = conv_relu_at(image, filter, bias, sy, sx + 1);
-                if (v > max_val) max_val = v;
-                v = conv_relu_at(image, filter, bias, sy + 1, sx);
-                if (v > max_val) max_val = v;
-                v = conv_relu_at(image, filter, bias, sy + 1, sx + 1);
-                if (v > max_val) max_val = v;
-
-                out[idx++] = max_val;
-            }
+void glyph_window_codes(const GlyphBits *glyph, unsigned short codes[CONV_H][CONV_W]) {
+    // Three 3-bit row slices
+    for (int y = 0; y < CONV_H; y++) {
+        uint32_t r0 = glyph->rows[y], r1 = glyph->rows[y + 1], r2 = glyph->rows[y + 2];
+        for (int x = 0; x < CONV_W; x++)
+            codes[y][x] = (unsigned short)(((r0 >> x) & 7) | ((r1 >> x) & 7) << 3
+                                           | ((r2 >> x) & 7) << 6);
+    }
+}
+
+void cnn_binary_plane(const real *table, const unsigned short codes[CONV_H][CONV_W],
+                      real *plane) {
+    for (int y = 0; y < POOL_H; y++) {
+        const unsigned short *top = codes[y * POOL_SIZE];
+        const unsigned short *bottom = codes[y * POOL_SIZE + 1];
+        for (int x = 0; x < POOL_W; x++) {
+            real a = table[top[2 * x]], b = table[top[2 * x + 1]];
+            real c = table[bottom[2 * x]], d = table[bottom[2 * x + 1]];
+            real ab = a > b ? a : b, cd = c > d ? c : d;
+            plane[y * POOL_W + x] = ab > cd ? ab : cd;
         }
     }
 }
 
-void cnn_backward(CNN* cnn, double* output_gradients, double eta) {
-    // Advance Adam timestep
-    cnn->adam_t += 1;
-    cnn->adam_beta1_t *= ADAM_BETA1;
-    cnn->adam_beta2_t *= ADAM_BETA2;
-    double inv_bc1 = 1.0 / (1.0 - cnn->adam_beta1_t);
-    double inv_bc2 = 1.0 / (1.0 - cnn->adam_beta2_t);
+void cnn_forward_binary(const real *lut, const GlyphBits *glyph, real *out) {
+    unsigned short codes[CONV_H][CONV_W];
+    glyph_window_codes(glyph, codes);
+    for (int f = 0; f < NUM_FILTERS; f++)
+        cnn_binary_plane(lut + f * CONV_PATTERNS, codes, out + f * POOL_H * POOL_W);
+}
 
-    // 1. Un-flatten gradients into pooling layer gradients
-    double pool_grads[NUM_FILTERS][POOL_H][POOL_W];
-    int idx = 0;
-    for (int f = 0; f < NUM_FILTERS; f++) {
-        for (int y = 0; y < POOL_H; y++) {
-            for (int x = 0; x < POOL_W; x++) {
-                pool_grads[f][y][x] = output_gradients[idx++];
-            }
-        }
+void cnn_backward(CNN* cnn, real* output_gradients, double eta) {
+    cnn_gradients(cnn, output_gradients);
+    cnn_adam_step(cnn, eta);
+}
+
+static void stage1_gradients(CNN* cnn, const real* output_gradients);
+
+void cnn_gradients(CNN* cnn, const real* output_gradients) {
+    if (cnn->stage2 == CNN_STAGE2_NONE) {
+        stage1_gradients(cnn, output_gradients);
+        return;
     }
+    real stage1_grads[FLATTEN_SIZE];
+    memset(cnn->filter2_grads, 0, sizeof(cnn->filter2_grads));
+    memset(cnn->bias2_grads, 0, sizeof(cnn->bias2_grads));
+    cnn_stage2_backward(cnn->stage2, cnn->filters2, cnn->stage1, cnn->stage2_mask,
+                        output_gradients, stage1_grads, cnn->filter2_grads,
+                        cnn->bias2_grads);
+    stage1_gradients(cnn, stage1_grads);
+}
 
-    // 2. Backprop through Max Pooling
-    double conv_grads[NUM_FILTERS][CONV_H][CONV_W];
-    memset(conv_grads, 0, sizeof(conv_grads));
+// Adds the filter and bias gradients of one image into fg / bg from its
+// pool masks and pooled gradients. Each pool cell that passed the ReLU
+// sends its gradient to its argmax pixel: the non-zero ones are listed
+// branch-free first, then summed in cell order into register accumulators.
+static void scatter_gradients(const double *image, const unsigned char *pool_mask,
+                              const real *output_gradients, real *fg, real *bg) {
+    int pixels[POOL_H * POOL_W];
+    real grads[POOL_H * POOL_W];
 
-    for (int f = 0; f < NUM_FILTERS; f++) {
-        for (int y = 0; y < POOL_H; y++) {
+    for (int f = 0; f < NUM_FILTERS; f++, fg += CONV_TAPS) {
+        const unsigned char *masks = pool_mask + f * POOL_H * POOL_W;
+        const real *pool_grads = output_gradients + f * POOL_H * POOL_W;
+
+        int nnz = 0;
+        for (int y = 0; y < POOL_H; y++)
             for (int x = 0; x < POOL_W; x++) {
-                int max_idx = cnn->pool_mask[f][y][x];
-                int dy = max_idx / POOL_SIZE;
-                int dx = max_idx % POOL_SIZE;
-                conv_grads[f][y * POOL_SIZE + dy][x * POOL_SIZE + dx] = pool_grads[f][y][x];
+                int mask = masks[y * POOL_W + x];
+                real grad = pool_grads[y * POOL_W + x];
+                int m = mask & POOL_ARGMAX;
+                pixels[nnz] = (y * POOL_SIZE + m / POOL_SIZE) * INPUT_W
+                            + x * POOL_SIZE + m % POOL_SIZE;
+                grads[nnz] = grad;
+                nnz += (mask & POOL_POSITIVE) && grad != 0.0;
             }
+
+        real b = 0, g0 = 0, g1 = 0, g2 = 0, g3 = 0, g4 = 0, g5 = 0, g6 = 0, g7 = 0, g8 = 0;
+        for (int k = 0; k < nnz; k++) {
+            const double *px = image + pixels[k];
+            real grad = grads[k];
+            b += grad;
+            g0 += (real)px[0] * grad;
+            g1 += (real)px[1] * grad;
+            g2 += (real)px[2] * grad;
+            g3 += (real)px[INPUT_W] * grad;
+            g4 += (real)px[INPUT_W + 1] * grad;
+            g5 += (real)px[INPUT_W + 2] * grad;
+            g6 += (real)px[2 * INPUT_W] * grad;
+            g7 += (real)px[2 * INPUT_W + 1] * grad;
+            g8 += (real)px[2 * INPUT_W + 2] * grad;
         }
+        bg[f] += b;
+        fg[0] += g0; fg[1] += g1; fg[2] += g2;
+        fg[3] += g3; fg[4] += g4; fg[5] += g5;
+        fg[6] += g6; fg[7] += g7; fg[8] += g8;
     }
+}
 
-    // 3. Backprop through ReLU
-    for (int f = 0; f < NUM_FILTERS; f++) {
-        for (int y = 0; y < CONV_H; y++) {
-            for (int x = 0; x < CONV_W; x++) {
-                if (cnn->conv_output[f][y][x] <= 0)
-                    conv_grads[f][y][x] = 0;
+static void stage1_gradients(CNN* cnn, const real* output_gradients) {
+    memset(cnn->filter_grads, 0, sizeof(cnn->filter_grads));
+    memset(cnn->bias_grads, 0, sizeof(cnn->bias_grads));
+    scatter_gradients(cnn->image_ptr, &cnn->pool_mask[0][0][0], output_gradients,
+                      &cnn->filter_grads[0][0][0], cnn->bias_grads);
+}
+
+void cnn_adam_step(CNN* cnn, double eta) {
+    AdamCoeffs adam = adam_begin_step(eta, &cnn->adam_t,
+                                      &cnn->adam_beta1_t, &cnn->adam_beta2_t);
+    adam_update(&adam, cnn->biases, cnn->m_biases, cnn->v_biases,
+                cnn->bias_grads, 1, NUM_FILTERS);
+    adam_update(&adam, &cnn->filters[0][0][0], &cnn->m_filters[0][0][0],
+                &cnn->v_filters[0][0][0], &cnn->filter_grads[0][0][0], 1,
+                NUM_FILTERS * CONV_SIZE * CONV_SIZE);
+    if (cnn->stage2 == CNN_STAGE2_NONE) return;
+    adam_update(&adam, cnn->biases2, cnn->m_biases2, cnn->v_biases2,
+                cnn->bias2_grads, 1, STAGE2_FILTERS);
+    adam_update(&adam, cnn->filters2, cnn->m_filters2, cnn->v_filters2,
+                cnn->filter2_grads, 1, STAGE2_WEIGHTS);
+}
+
+// ---------------------------------------------------------------------------
+// Second stage: a full 3x3 conv across the NUM_FILTERS pooled maps, either
+// strided (stride 2, 13 -> 6) or followed by a 2x2 max pool (13 -> 11 -> 5).
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int stride;  // conv stride
+    int pool;    // pool window side, 1 = no pooling
+    int side;    // output side
+} Stage2Shape;
+
+static Stage2Shape stage2_shape(CnnStage2 stage2) {
+    if (stage2 == CNN_STAGE2_STRIDED)
+        return (Stage2Shape){ 2, 1, (POOL_W - CONV_SIZE) / 2 + 1 };
+    return (Stage2Shape){ 1, POOL_SIZE, (POOL_W - CONV_SIZE + 1) / POOL_SIZE };
+}
+
+int cnn_stage2_outputs(CnnStage2 stage2) {
+    if (stage2 == CNN_STAGE2_NONE) return FLATTEN_SIZE;
+    Stage2Shape shape = stage2_shape(stage2);
+    return STAGE2_FILTERS * shape.side * shape.side;
+}
+
+static const char *const stage2_names[] = { "flat", "strided", "convpool" };
+
+const char *cnn_stage2_name(CnnStage2 stage2) {
+    return stage2_names[stage2];
+}
+
+int cnn_stage2_parse(const char *name, CnnStage2 *stage2) {
+    for (int k = 0; k <= CNN_STAGE2_CONV_POOL; k++)
+        if (strcmp(name, stage2_names[k]) == 0) {
+            *stage2 = (CnnStage2)k;
+            return 1;
+        }
+    return 0;
+}
+
+#define STAGE2_SPAN_MAX 10  // conv positions per side that reach an output
+
+// Lowers the span x span conv positions that reach an output to
+// patches[tap][position], taps ordered like filters2 ([c][i][j])
+static void stage2_im2col(const real *in, Stage2Shape shape, real *patches) {
+    int span = shape.side * shape.pool;
+    int len = span * span;
+    for (int c = 0; c < NUM_FILTERS; c++)
+        for (int i = 0; i < CONV_SIZE; i++)
+            for (int j = 0; j < CONV_SIZE; j++) {
+                real *dst = patches + (c * CONV_TAPS + i * CONV_SIZE + j) * len;
+                for (int y = 0; y < span; y++) {
+                    const real *src = in + c * POOL_H * POOL_W
+                                    + (y * shape.stride + i) * POOL_W + j;
+                    for (int x = 0; x < span; x++)
+                        dst[y * span + x] = src[x * shape.stride];
+                }
+            }
+}
+
+void cnn_stage2_forward(CnnStage2 stage2, const real *filters2, const real *biases2,
+                        const real *in, real *out, unsigned char *mask) {
+    real patches[STAGE2_TAPS * STAGE2_SPAN_MAX * STAGE2_SPAN_MAX];
+    real conv[STAGE2_FILTERS * STAGE2_SPAN_MAX * STAGE2_SPAN_MAX];
+    Stage2Shape shape = stage2_shape(stage2);
+    int span = shape.side * shape.pool;
+    int len = span * span;
+    int cells = shape.side * shape.side;
+
+    stage2_im2col(in, shape, patches);
+    kernels.gemm_bias(conv, len, filters2, biases2, STAGE2_FILTERS, STAGE2_TAPS,
+                      patches, len, len);
+
+    for (int o = 0; o < STAGE2_FILTERS; o++)
+        for (int y = 0; y < shape.side; y++)
+            for (int x = 0; x < shape.side; x++) {
+                // First maximum of the pool window wins, like pooled_at()
+                const real *window = conv + o * len + y * shape.pool * span + x * shape.pool;
+                real max_val = window[0];
+                int argmax = 0;
+                for (int k = 1; k < shape.pool * shape.pool; k++) {
+                    real v = window[(k / shape.pool) * span + k % shape.pool];
+                    if (v > max_val) {
+                        max_val = v;
+                        argmax = k;
+                    }
+                }
+                int cell = o * cells + y * shape.side + x;
+                out[cell] = max_val > 0 ? max_val : 0;
+                if (mask)
+                    mask[cell] = (unsigned char)((max_val > 0) * POOL_POSITIVE | argmax);
+            }
+}
+
+void cnn_stage2_backward(CnnStage2 stage2, const real *filters2, const real *in,
+                         const unsigned char *mask, const real *grad_out,
+                         real *grad_in, real *filter2_grads, real *bias2_grads) {
+    Stage2Shape shape = stage2_shape(stage2);
+    int cells = shape.side * shape.side;
+
+    memset(grad_in, 0, sizeof(real) * FLATTEN_SIZE);
+    for (int o = 0; o < STAGE2_FILTERS; o++) {
+        const real *filter = filters2 + o * STAGE2_TAPS;
+        real *fg = filter2_grads + o * STAGE2_TAPS;
+        for (int cell = 0; cell < cells; cell++) {
+            int m = mask[o * cells + cell];
+            real grad = grad_out[o * cells + cell];
+            if (!(m & POOL_POSITIVE) || grad == 0.0)
+                continue;
+
+            int y = (cell / shape.side) * shape.pool + (m & POOL_ARGMAX) / shape.pool;
+            int x = (cell % shape.side) * shape.pool + (m & POOL_ARGMAX) % shape.pool;
+            bias2_grads[o] += grad;
+            for (int c = 0; c < NUM_FILTERS; c++) {
+                int base = c * POOL_H * POOL_W + y * shape.stride * POOL_W + x * shape.stride;
+                for (int i = 0; i < CONV_SIZE; i++)
+                    for (int j = 0; j < CONV_SIZE; j++) {
+                        int t = c * CONV_TAPS + i * CONV_SIZE + j;
+                        fg[t] += in[base + i * POOL_W + j] * grad;
+                        grad_in[base + i * POOL_W + j] += filter[t] * grad;
+                    }
             }
         }
     }
+}
 
-    // 4. Accumulate filter and bias gradients (3x3 unrolled)
-    for (int f = 0; f < NUM_FILTERS; f++) {
-        cnn->bias_grads[f] = 0;
-        for (int i = 0; i < CONV_SIZE; i++)
-            for (int j = 0; j < CONV_SIZE; j++)
-                cnn->filter_grads[f][i][j] = 0;
+// ---------------------------------------------------------------------------
+// Batched convolution: im2col + blocked GEMM
+//
+// Each image is processed in bands of CONV_BAND conv rows. A band is
+// lowered to a tap-major patch tile (CONV_TAPS x CONV_BLOCK) and one GEMM
+// computes all filters from it; the band is pooled while both tiles are
+// still in L1, so the full conv planes are never stored. Backward, each
+// image scatters its non-zero pooled gradients into its own filter
+// gradients, so the images of a batch can run concurrently.
+// ---------------------------------------------------------------------------
+
+#define CONV_BAND 8                        // conv rows per band, even
+#define CONV_BLOCK (CONV_BAND * CONV_W)    // 208 pixels
+#define CONV_IMAGE_GRADS (NUM_FILTERS * CONV_TAPS + NUM_FILTERS)
+
+ConvWorkspace *conv_workspace_create(int capacity, int training) {
+    ConvWorkspace *ws = calloc(1, sizeof(ConvWorkspace));
+    if (!ws) return NULL;
+
+    ws->capacity = capacity;
+    ws->images = calloc(capacity, sizeof(double *));
+    ws->pool_argmax = malloc((size_t)capacity * FLATTEN_SIZE);
+    if (training)
+        ws->grads = calloc((size_t)capacity * CONV_IMAGE_GRADS, sizeof(real));
+
+    if (!ws->images || !ws->pool_argmax || (training && !ws->grads)) {
+        conv_workspace_free(ws);
+        return NULL;
     }
+    return ws;
+}
 
-    for (int f = 0; f < NUM_FILTERS; f++) {
-        double *fg = &cnn->filter_grads[f][0][0];
-        for (int y = 0; y < CONV_H; y++) {
-            for (int x = 0; x < CONV_W; x++) {
-                double grad = conv_grads[f][y][x];
-                if (grad == 0.0) continue;
-                cnn->bias_grads[f] += grad;
-                fg[0] += IMG(y,   x)   * grad;
-                fg[1] += IMG(y,   x+1) * grad;
-                fg[2] += IMG(y,   x+2) * grad;
-                fg[3] += IMG(y+1, x)   * grad;
-                fg[4] += IMG(y+1, x+1) * grad;
-                fg[5] += IMG(y+1, x+2) * grad;
-                fg[6] += IMG(y+2, x)   * grad;
-                fg[7] += IMG(y+2, x+1) * grad;
-                fg[8] += IMG(y+2, x+2) * grad;
+void conv_workspace_free(ConvWorkspace *ws) {
+    if (!ws) return;
+    free(ws->images);
+    free(ws->pool_argmax);
+    free(ws->grads);
+    free(ws);
+}
+
+// Lowers conv rows [y0, y0 + rows) of image to patches[tap][pixel]; every
+// tap of a row is a contiguous copy
+static void im2col_band(const double *image, int y0, int rows,
+                        real patches[CONV_TAPS][CONV_BLOCK]) {
+    for (int r = 0; r < rows; r++)
+        for (int i = 0; i < CONV_SIZE; i++)
+            for (int k = 0; k < CONV_SIZE; k++) {
+                const double *src = image + (y0 + r + i) * INPUT_W + k;
+                real *dst = patches[i * CONV_SIZE + k] + r * CONV_W;
+                for (int x = 0; x < CONV_W; x++)
+                    dst[x] = (real)src[x];
             }
-        }
+}
+
+// 2x2 max pooling + ReLU of conv rows 2y and 2y + 1. Branch-free, since the
+// raw values make branches unpredictable: the values vectorize, the pool
+// mask (first maximum wins, like pooled_at()) is a second pass of setcc.
+static void pool_row(const real *restrict conv, real *restrict out,
+                     unsigned char *restrict argmax) {
+    const real *below = conv + CONV_W;
+    for (int x = 0; x < POOL_W; x++) {
+        real top = conv[2 * x + 1] > conv[2 * x] ? conv[2 * x + 1] : conv[2 * x];
+        real bottom = below[2 * x + 1] > below[2 * x] ? below[2 * x + 1] : below[2 * x];
+        real max_val = bottom > top ? bottom : top;
+        out[x] = max_val > 0 ? max_val : 0;
+    }
+    for (int x = 0; x < POOL_W; x++) {
+        int right_top = conv[2 * x + 1] > conv[2 * x];
+        int right_bottom = below[2 * x + 1] > below[2 * x];
+        real top = right_top ? conv[2 * x + 1] : conv[2 * x];
+        real bottom = right_bottom ? below[2 * x + 1] : below[2 * x];
+        int lower = bottom > top;
+        int column = (lower & right_bottom) | ((lower ^ 1) & right_top);
+        argmax[x] = (unsigned char)((out[x] > 0) * POOL_POSITIVE | lower << 1 | column);
     }
+}
 
-    // 5. Update weights with Adam (precomputed inverse bias corrections)
-    for (int f = 0; f < NUM_FILTERS; f++) {
-        // Bias update
-        double bg = cnn->bias_grads[f];
-        cnn->m_biases[f] = ADAM_BETA1 * cnn->m_biases[f] + (1.0 - ADAM_BETA1) * bg;
-        cnn->v_biases[f] = ADAM_BETA2 * cnn->v_biases[f] + (1.0 - ADAM_BETA2) * bg * bg;
-        double m_hat_b = cnn->m_biases[f] * inv_bc1;
-        double v_hat_b = cnn->v_biases[f] * inv_bc2;
-        cnn->biases[f] -= eta * m_hat_b / (my_sqrt(v_hat_b) + ADAM_EPS);
-
-        // Filter weight update
-        for (int i = 0; i < CONV_SIZE; i++) {
-            for (int j = 0; j < CONV_SIZE; j++) {
-                double fg = cnn->filter_grads[f][i][j];
-                cnn->m_filters[f][i][j] = ADAM_BETA1 * cnn->m_filters[f][i][j] + (1.0 - ADAM_BETA1) * fg;
-                cnn->v_filters[f][i][j] = ADAM_BETA2 * cnn->v_filters[f][i][j] + (1.0 - ADAM_BETA2) * fg * fg;
-                double m_hat = cnn->m_filters[f][i][j] * inv_bc1;
-                double v_hat = cnn->v_filters[f][i][j] * inv_bc2;
-                cnn->filters[f][i][j] -= eta * m_hat / (my_sqrt(v_hat) + ADAM_EPS);
+// Fused conv + ReLU + pool of one image into out[FLATTEN_SIZE] and its
+// pool masks
+static void forward_image(const real *filters, const real *biases,
+                          const double *image, real *out, unsigned char *pool_mask) {
+    real patches[CONV_TAPS][CONV_BLOCK];
+    real conv[NUM_FILTERS][CONV_BLOCK];
+
+    for (int y0 = 0; y0 < CONV_H; y0 += CONV_BAND) {
+        int rows = CONV_H - y0 < CONV_BAND ? CONV_H - y0 : CONV_BAND;
+
+        // conv[f][p] = bias[f] + sum_k patch[k][p] * filter[f][k], taps
+        // added in the same order as cnn_forward_infer(). The ReLU is left
+        // to the pooling: relu(max(a, b, c, d)) == max(relu(a), ..., relu(d))
+        im2col_band(image, y0, rows, patches);
+        kernels.gemm_bias(&conv[0][0], CONV_BLOCK, filters, biases, NUM_FILTERS,
+                          CONV_TAPS, &patches[0][0], CONV_BLOCK, rows * CONV_W);
+
+        // Flattened as [f][y][x]
+        for (int f = 0; f < NUM_FILTERS; f++)
+            for (int y = 0; y < rows / POOL_SIZE; y++) {
+                int cell = (f * POOL_H + y0 / POOL_SIZE + y) * POOL_W;
+                pool_row(conv[f] + y * POOL_SIZE * CONV_W, out + cell, pool_mask + cell);
             }
-        }
     }
 }
 
-#undef IMG
+void cnn_forward_batch(const real *filters, const real *biases, ConvWorkspace *ws,
+                       int first, int n, const double *const *images, real *out) {
+    for (int i = 0; i < n; i++) {
+        ws->images[first + i] = images[i];
+        forward_image(filters, biases, images[i], out + (size_t)i * FLATTEN_SIZE,
+                      ws->pool_argmax + (size_t)(first + i) * FLATTEN_SIZE);
+    }
+}
+
+void cnn_backward_batch(ConvWorkspace *ws, int first, int n,
+                        const real *output_gradients) {
+    for (int i = 0; i < n; i++) {
+        real *grads = ws->grads + (size_t)(first + i) * CONV_IMAGE_GRADS;
+        memset(grads, 0, sizeof(real) * CONV_IMAGE_GRADS);
+        scatter_gradients(ws->images[first + i],
+                          ws->pool_argmax + (size_t)(first + i) * FLATTEN_SIZE,
+                          output_gradients + (size_t)i * FLATTEN_SIZE,
+                          grads, grads + NUM_FILTERS * CONV_TAPS);
+    }
+}
+
+void cnn_gradients_batch(CNN *cnn, const ConvWorkspace *ws, int n) {
+    real *fg = &cnn->filter_grads[0][0][0];
+
+    memset(cnn->filter_grads, 0, sizeof(cnn->filter_grads));
+    memset(cnn->bias_grads, 0, sizeof(cnn->bias_grads));
+    for (int i = 0; i < n; i++) {
+        const real *grads = ws->grads + (size_t)i * CONV_IMAGE_GRADS;
+        for (int k = 0; k < NUM_FILTERS * CONV_TAPS; k++)
+            fg[k] += grads[k];
+        for (int f = 0; f < NUM_FILTERS; f++)
+            cnn->bias_grads[f] += grads[NUM_FILTERS * CONV_TAPS + f];
+    }
+}
@@ -3,6 +3,7 @@
 
 #include "tools.h"
 #include "../common.h"
+#include <stdint.h>
 #include <stdlib.h>
 
 #define CONV_SIZE 3
@@ -17,23 +18,44 @@
 #define POOL_W (CONV_W / POOL_SIZE)      // 13
 #define POOL_H (CONV_H / POOL_SIZE)      // 13
 #define FLATTEN_SIZE (NUM_FILTERS * POOL_W * POOL_H) // 8 * 169 = 1352
+#define CONV_TAPS (CONV_SIZE * CONV_SIZE)                // 9
+#define CONV_PIXELS (CONV_W * CONV_H)                    // 676
+#define CONV_PATTERNS (1 << CONV_TAPS)                   // 512 binary 3x3 windows
+
+// Pool mask of one pool cell: the argmax in its 2x2 window (dy * 2 + dx),
+// plus POOL_POSITIVE if the max passed the ReLU.
+#define POOL_ARGMAX   3
+#define POOL_POSITIVE 4
+
+// Optional second stage on the 8x13x13 pooled maps, shrinking the features
+// handed to the MLP. Chosen at training time, recorded in the OCRCNN header.
+typedef enum {
+    CNN_STAGE2_NONE,      // flatten the pooled maps: 1352 features
+    CNN_STAGE2_STRIDED,   // 3x3 conv, stride 2, ReLU: 8x6x6 = 288 features
+    CNN_STAGE2_CONV_POOL  // 3x3 conv, ReLU, 2x2 max pool: 8x5x5 = 200 features
+} CnnStage2;
+
+#define STAGE2_FILTERS 8
+#define STAGE2_TAPS (NUM_FILTERS * CONV_TAPS)           // 72 weights per filter
+#define STAGE2_WEIGHTS (STAGE2_FILTERS * STAGE2_TAPS)   // 576
+#define STAGE2_MAX_OUTPUTS (STAGE2_FILTERS * 6 * 6)     // 288
 
 typedef struct {
     // Weights: [NUM_FILTERS][3][3]
-    double filters[NUM_FILTERS][CONV_SIZE][CONV_SIZE];
-    double filter_grads[NUM_FILTERS][CONV_SIZE][CONV_SIZE];
+    real filters[NUM_FILTERS][CONV_SIZE][CONV_SIZE];
+    real filter_grads[NUM_FILTERS][CONV_SIZE][CONV_SIZE];
 
     // Adam moment buffers for filters
-    double m_filters[NUM_FILTERS][CONV_SIZE][CONV_SIZE];
-    double v_filters[NUM_FILTERS][CONV_SIZE][CONV_SIZE];
+    real m_filters[NUM_FILTERS][CONV_SIZE][CONV_SIZE];
+    real v_filters[NUM_FILTERS][CONV_SIZE][CONV_SIZE];
 
     // Biases: [NUM_FILTERS]
-    double biases[NUM_FILTERS];
-    double bias_grads[NUM_FILTERS];
+    real biases[NUM_FILTERS];
+    real bias_grads[NUM_FILTERS];
 
     // Adam moment buffers for biases
-    double m_biases[NUM_FILTERS];
-    double v_biases[NUM_FILTERS];
+    real m_biases[NUM_FILTERS];
+    real v_biases[NUM_FILTERS];
 
     // Adam timestep and running beta^t products
     long adam_t;
@@ -42,9 +64,21 @@ typedef struct {
 
     // Intermediate states for backprop
     double *image_ptr; // Pointer to original flat input (avoids copy)
-    double conv_output[NUM_FILTERS][CONV_H][CONV_W]; // 26x26
-    double pool_output[NUM_FILTERS][POOL_H][POOL_W];
-    int    pool_mask[NUM_FILTERS][POOL_H][POOL_W];
+    unsigned char pool_mask[NUM_FILTERS][POOL_H][POOL_W]; // see POOL_ARGMAX
+
+    // Second stage (unused when stage2 is CNN_STAGE2_NONE)
+    CnnStage2 stage2;
+    int output_size;                    // features handed to the MLP
+    real filters2[STAGE2_WEIGHTS];      // [STAGE2_FILTERS][NUM_FILTERS][3][3]
+    real filter2_grads[STAGE2_WEIGHTS];
+    real m_filters2[STAGE2_WEIGHTS];
+    real v_filters2[STAGE2_WEIGHTS];
+    real biases2[STAGE2_FILTERS];
+    real bias2_grads[STAGE2_FILTERS];
+    real m_biases2[STAGE2_FILTERS];
+    real v_biases2[STAGE2_FILTERS];
+    real stage1[FLATTEN_SIZE];                      // stage-1 output of the last cnn_forward()
+    unsigned char stage2_mask[STAGE2_MAX_OUTPUTS];  // same encoding as pool_mask
 
 } CNN;
 
@@ -53,15 +87,109 @@ void free_cnn(CNN* cnn);
 // Reset weights, biases and Adam state to freshly-initialized values.
 void cnn_reset(CNN* cnn);
 
-// Forward pass: writes 1352 doubles into out[]. No allocation.
-void cnn_forward(CNN* cnn, double image[IMAGE_PIXELS], double *out);
+// Switches cnn to the given second stage; a new stage gets fresh weights.
+void cnn_set_stage2(CNN* cnn, CnnStage2 stage2);
+
+// Number of features a CNN with this second stage produces.
+int cnn_stage2_outputs(CnnStage2 stage2);
+
+// "flat", "strided", "convpool". parse returns 0 on an unknown name.
+const char *cnn_stage2_name(CnnStage2 stage2);
+int cnn_stage2_parse(const char *name, CnnStage2 *stage2);
+
+// Second stage on bare weights: in is the [FLATTEN_SIZE] stage-1 output,
+// out gets cnn_stage2_outputs(stage2) values. mask may be NULL; else it
+// gets one pool mask per output for cnn_stage2_backward().
+void cnn_stage2_forward(CnnStage2 stage2, const real *filters2, const real *biases2,
+                        const real *in, real *out, unsigned char *mask);
+
+// Backprop of cnn_stage2_forward(): overwrites grad_in[FLATTEN_SIZE] and
+// adds the weight gradients into filter2_grads / bias2_grads.
+void cnn_stage2_backward(CnnStage2 stage2, const real *filters2, const real *in,
+                         const unsigned char *mask, const real *grad_out,
+                         real *grad_in, real *filter2_grads, real *bias2_grads);
+
+// Forward pass: writes cnn->output_size values into out[]. No allocation.
+void cnn_forward(CNN* cnn, double image[IMAGE_PIXELS], real *out);
 
 // Inference-only forward pass. Produces the same flattened output as
 // cnn_forward(), but does not preserve intermediate state for backprop.
-void cnn_forward_infer(CNN* cnn, const double image[IMAGE_PIXELS], double *out);
+void cnn_forward_infer(CNN* cnn, const double image[IMAGE_PIXELS], real *out);
+
+// Stage 1 of cnn_forward_infer() on bare weights: filters is
+// [NUM_FILTERS][3][3] row-major, biases [NUM_FILTERS]; out gets
+// FLATTEN_SIZE values. Used by the frozen InferenceModel.
+void cnn_forward_infer_weights(const real *filters, const real *biases,
+                               const double image[IMAGE_PIXELS], real *out);
+
+// Inference-only forward pass that emits only the non-zero pooled features
+// as (index, value) pairs in ascending index order. indices/values must hold
+// FLATTEN_SIZE entries. Returns the number of pairs written.
+int cnn_forward_infer_sparse(CNN* cnn, const double image[IMAGE_PIXELS],
+                             int *indices, real *values);
+
+// A 0/1 glyph with one bit per pixel: bit x of rows[y] is pixel (y, x).
+typedef struct {
+    uint32_t rows[INPUT_H];
+} GlyphBits;
+
+// Packs a glyph whose pixels are all 0 or 1 (ImageToMatrix() matrices,
+// resize_image_to_28x28() images); any non-zero pixel counts as 1.
+void glyph_pack_matrix(const int matrix[IMAGE_PIXELS], GlyphBits *bits);
+void glyph_pack_image(const double image[IMAGE_PIXELS], GlyphBits *bits);
+
+// lut[f * CONV_PATTERNS + code] = ReLU'd response of filter f to the window
+// whose tap k (row-major) is bit k of code, summed like cnn_forward_infer().
+void cnn_binary_lut(const real *filters, const real *biases, real *lut);
 
-// Backward pass: Takes gradients coming FROM the dense layer (1352 doubles)
+// Stage 1 of a packed glyph: one table lookup per window and filter instead
+// of 9 multiply-adds. Matches cnn_forward_infer_weights() exactly.
+void cnn_forward_binary(const real *lut, const GlyphBits *glyph, real *out);
+
+// The two halves of cnn_forward_binary(), for callers that consume the
+// output one filter plane at a time: the 9-bit code of every 3x3 window
+// (shared by all filters), then the [POOL_H][POOL_W] pooled plane of the
+// filter whose table is lut + f * CONV_PATTERNS.
+void glyph_window_codes(const GlyphBits *glyph, unsigned short codes[CONV_H][CONV_W]);
+void cnn_binary_plane(const real *table, const unsigned short codes[CONV_H][CONV_W],
+                      real *plane);
+
+// Backward pass: Takes gradients coming FROM the dense layer (output_size values)
 // Updates CNN weights internally.
-void cnn_backward(CNN* cnn, double* output_gradients, double eta);
+void cnn_backward(CNN* cnn, real* output_gradients, double eta);
+
+// The two halves of cnn_backward(): gradients into filter_grads/bias_grads
+// from the last cnn_forward(), then one Adam step from those gradients.
+void cnn_gradients(CNN* cnn, const real* output_gradients);
+void cnn_adam_step(CNN* cnn, double eta);
+
+// Scratch of the batched convolution engine for up to `capacity` images
+typedef struct {
+    int capacity;
+    const double **images;      // inputs of the last cnn_forward_batch()
+    unsigned char *pool_argmax; // [capacity][FLATTEN_SIZE] pool masks
+    real *grads;                // per image filter then bias gradients, training only
+} ConvWorkspace;
+
+// training = 0 skips the gradient buffers. Returns NULL on OOM.
+ConvWorkspace *conv_workspace_create(int capacity, int training);
+void conv_workspace_free(ConvWorkspace *ws);
+
+// im2col + blocked GEMM forward of n images into workspace images
+// first..first+n-1; out is [n][FLATTEN_SIZE] and matches the stage-1
+// output of cnn_forward() bit for bit; callers run any second stage.
+// Disjoint [first, first + n) ranges may run concurrently.
+void cnn_forward_batch(const real *filters, const real *biases, ConvWorkspace *ws,
+                       int first, int n, const double *const *images, real *out);
+
+// Filter and bias gradients of workspace images first..first+n-1 from
+// their pooled gradients output_gradients ([n][FLATTEN_SIZE]), scattered
+// from the non-zero ones only. Disjoint ranges may run concurrently.
+void cnn_backward_batch(ConvWorkspace *ws, int first, int n,
+                        const real *output_gradients);
+
+// Sum over workspace images 0..n-1, in image order, of their gradients
+// into cnn->filter_grads / bias_grads.
+void cnn_gradients_batch(CNN *cnn, const ConvWorkspace *ws, int n);
 
 #endif
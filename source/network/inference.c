@@ -0,0 +1,359 @@
+#include "inference.h"
+#include "../common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "tools.h"
+
+// Glyphs per cnn_forward_batch() / mlp_forward_batch() call in
+// inference_predict_batch()
+#define INFERENCE_BATCH 256
+
+static size_t align_up(size_t n, size_t alignment)
+{
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+// The arena holds the weights unless they are to be pointed into a mapped
+// container (with_weights = 0), and always the conv lookup tables
+static InferenceModel *alloc_inference_model(CnnStage2 stage2, int I, int H, int O,
+                                             int with_weights)
+{
+    InferenceModel *model = calloc(1, sizeof(InferenceModel));
+    if (model == NULL) return NULL;
+
+    model->number_of_inputs = I;
+    model->number_of_hidden_nodes = H;
+    model->number_of_outputs = O;
+    model->output_stride = NET_ROW_PAD(O);
+    model->stage2 = stage2;
+    size_t has_stage2 = with_weights && stage2 != CNN_STAGE2_NONE;
+    size_t w = with_weights != 0;
+
+    real **fields[] =
+    {
+        &model->filters, &model->conv_bias,
+        &model->filters2, &model->biases2,
+        &model->hidden_weights, &model->hidden_bias,
+        &model->output_weights, &model->output_bias,
+        &model->conv_lut,
+    };
+    size_t counts[] =
+    {
+        w * NUM_FILTERS * CONV_SIZE * CONV_SIZE, w * NUM_FILTERS,
+        has_stage2 * STAGE2_WEIGHTS, has_stage2 * STAGE2_FILTERS,
+        w * I * H, w * H,
+        w * H * model->output_stride, w * model->output_stride,
+        (size_t)NUM_FILTERS * CONV_PATTERNS,
+    };
+    const size_t field_count = sizeof(counts) / sizeof(counts[0]);
+
+    size_t offsets[sizeof(counts) / sizeof(counts[0])];
+    size_t size = 0;
+    for (size_t k = 0; k < field_count; k++)
+    {
+        offsets[k] = size;
+        size = align_up(size + counts[k] * sizeof(real), NET_ARENA_ALIGN);
+    }
+
+    model->arena = alloc_arena(size, NET_ARENA_ALIGN);
+    if (model->arena == NULL)
+    {
+        free(model);
+        return NULL;
+    }
+    model->arena_size = size;
+
+    for (size_t k = 0; k < field_count; k++)
+        *fields[k] = (real *)((char *)model->arena + offsets[k]);
+    return model;
+}
+
+void free_inference_model(InferenceModel *model)
+{
+    if (model == NULL) return;
+    model_close(model->file);
+    free(model->arena);
+    free(model);
+}
+
+InferenceModel *inference_from_training(const CNN *cnn, const struct network *net)
+{
+    if (cnn == NULL || net == NULL) return NULL;
+
+    int I = net->number_of_inputs;
+    int H = net->number_of_hidden_nodes;
+    int O = net->number_of_outputs;
+    if (I != cnn->output_size) return NULL;
+    InferenceModel *model = alloc_inference_model(cnn->stage2, I, H, O, 1);
+    if (model == NULL) return NULL;
+
+    memcpy(model->filters, cnn->filters, sizeof(cnn->filters));
+    memcpy(model->conv_bias, cnn->biases, sizeof(cnn->biases));
+    if (cnn->stage2 != CNN_STAGE2_NONE)
+    {
+        memcpy(model->filters2, cnn->filters2, sizeof(cnn->filters2));
+        memcpy(model->biases2, cnn->biases2, sizeof(cnn->biases2));
+    }
+    memcpy(model->hidden_weights, net->hidden_weights, sizeof(real) * I * H);
+    memcpy(model->hidden_bias, net->hidden_layer_bias, sizeof(real) * H);
+    memcpy(model->output_weights, net->output_weights, sizeof(real) * H * model->output_stride);
+    memcpy(model->output_bias, net->output_layer_bias, sizeof(real) * model->output_stride);
+    cnn_binary_lut(model->filters, model->conv_bias, model->conv_lut);
+    return model;
+}
+
+InferenceModel *load_inference_model(const char *filename)
+{
+    ModelFile *file = model_open(filename);
+    if (file == NULL) return NULL;
+
+    const ModelHeader *h = file->header;
+    CnnStage2 stage2 = (CnnStage2)h->stage2;
+    int I = h->inputs, H = h->hidden, O = h->outputs, Os = NET_ROW_PAD(O);
+    size_t s2 = stage2 != CNN_STAGE2_NONE;
+    const size_t kernel_count = (size_t)NUM_FILTERS * CONV_SIZE * CONV_SIZE;
+    InferenceModel *model;
+
+    if (h->real_bits == REAL_BITS && model_synced(file))
+    {
+        // Weights used in place: the mapping is read-only, and nothing
+        // writes through these fields once the model is built
+        model = alloc_inference_model(stage2, I, H, O, 0);
+        if (model == NULL)
+        {
+            model_close(file);
+            return NULL;
+        }
+        model->filters = (real *)model_section(file, MODEL_FILTERS, kernel_count);
+        model->conv_bias = (real *)model_section(file, MODEL_CONV_BIAS, NUM_FILTERS);
+        model->filters2 = (real *)model_section(file, MODEL_FILTERS2, s2 * STAGE2_WEIGHTS);
+        model->biases2 = (real *)model_section(file, MODEL_BIASES2, s2 * STAGE2_FILTERS);
+        model->hidden_weights = (real *)model_section(file, MODEL_HIDDEN_WEIGHTS, (size_t)I * H);
+        model->hidden_bias = (real *)model_section(file, MODEL_HIDDEN_BIAS, H);
+        model->output_weights = (real *)model_section(file, MODEL_OUTPUT_WEIGHTS, (size_t)H * Os);
+        model->output_bias = (real *)model_section(file, MODEL_OUTPUT_BIAS, Os);
+        model->file = file;
+        int ok = model->filters != NULL && model->conv_bias != NULL
+              && model->hidden_weights != NULL && model->hidden_bias != NULL
+              && model->output_weights != NULL && model->output_bias != NULL
+              && (!s2 || (model->filters2 != NULL && model->biases2 != NULL));
+        if (!ok)
+        {
+            fprintf(stderr, "load_inference_model: %s lacks weights (ignored)\n", filename);
+            free_inference_model(model);
+            return NULL;
+        }
+    }
+    else
+    {
+        model = alloc_inference_model(stage2, I, H, O, 1);
+        if (model == NULL)
+        {
+            model_close(file);
+            return NULL;
+        }
+        int ok = model_read(file, MODEL_FILTERS, model->filters, 1, kernel_count, 0);
+        ok &= model_read(file, MODEL_CONV_BIAS, model->conv_bias, 1, NUM_FILTERS, 0);
+        if (s2)
+        {
+            ok &= model_read(file, MODEL_FILTERS2, model->filters2, 1, STAGE2_WEIGHTS, 0);
+            ok &= model_read(file, MODEL_BIASES2, model->biases2, 1, STAGE2_FILTERS, 0);
+        }
+        ok &= model_read_synced(file, MODEL_HIDDEN_WEIGHTS, model->hidden_weights, I, H, H);
+        ok &= model_read(file, MODEL_HIDDEN_BIAS, model->hidden_bias, 1, H, 0);
+        ok &= model_read_synced(file, MODEL_OUTPUT_WEIGHTS, model->output_weights, H, O, Os);
+        ok &= model_read(file, MODEL_OUTPUT_BIAS, model->output_bias, 1, O, 0);
+        model_close(file);
+        if (!ok)
+        {
+            fprintf(stderr, "load_inference_model: %s lacks weights (ignored)\n", filename);
+            free_inference_model(model);
+            return NULL;
+        }
+    }
+
+    cnn_binary_lut(model->filters, model->conv_bias, model->conv_lut);
+    return model;
+}
+
+static MlpWeights inference_mlp_weights(const InferenceModel *model)
+{
+    MlpWeights w =
+    {
+        model->number_of_inputs, model->number_of_hidden_nodes, model->number_of_outputs,
+        model->output_stride, model->hidden_weights, model->hidden_bias,
+        model->output_weights, model->output_bias
+    };
+    return w;
+}
+
+static void most_probable(const real *probs, int count, int O, size_t *labels)
+{
+    for (int g = 0; g < count; g++)
+    {
+        const real *row = probs + (size_t)g * O;
+        size_t best = 0;
+        for (int k = 1; k < O; k++)
+            if (row[k] > row[best])
+                best = k;
+        labels[g] = best;
+    }
+}
+
+// Writes the most probable class of each of the count rows of stage-1
+// output, running the second CNN stage first if the model has one
+static void classify_features(const InferenceModel *model, const real *stage1,
+                              int count, real *features, real *probs, size_t *labels)
+{
+    int I = model->number_of_inputs;
+    int O = model->number_of_outputs;
+    MlpWeights w = inference_mlp_weights(model);
+
+    if (model->stage2 != CNN_STAGE2_NONE)
+        for (int g = 0; g < count; g++)
+            cnn_stage2_forward(model->stage2, model->filters2, model->biases2,
+                               stage1 + (size_t)g * FLATTEN_SIZE,
+                               features + (size_t)g * I, NULL);
+
+    mlp_forward_batch(&w, features, count, probs);
+    most_probable(probs, count, O, labels);
+}
+
+int inference_predict_batch(const InferenceModel *model, const double *images,
+                            int n, size_t *labels)
+{
+    int I = model->number_of_inputs;
+    int O = model->number_of_outputs;
+
+    real *features = malloc(sizeof(real) * INFERENCE_BATCH * I);
+    real *probs = malloc(sizeof(real) * INFERENCE_BATCH * O);
+    real *stage1 = model->stage2 == CNN_STAGE2_NONE ? features
+                 : malloc(sizeof(real) * INFERENCE_BATCH * FLATTEN_SIZE);
+    ConvWorkspace *conv = conv_workspace_create(INFERENCE_BATCH, 0);
+    if (features == NULL || probs == NULL || stage1 == NULL || conv == NULL)
+    {
+        if (stage1 != features) free(stage1);
+        free(features);
+        free(probs);
+        conv_workspace_free(conv);
+        return 0;
+    }
+
+    for (int start = 0; start < n; start += INFERENCE_BATCH)
+    {
+        int count = n - start < INFERENCE_BATCH ? n - start : INFERENCE_BATCH;
+        const double *glyphs[INFERENCE_BATCH];
+        for (int g = 0; g < count; g++)
+            glyphs[g] = images + (size_t)(start + g) * IMAGE_PIXELS;
+        cnn_forward_batch(model->filters, model->conv_bias, conv, 0, count,
+                          glyphs, stage1);
+        classify_features(model, stage1, count, features, probs, labels + start);
+    }
+
+    if (stage1 != features) free(stage1);
+    free(features);
+    free(probs);
+    conv_workspace_free(conv);
+    return 1;
+}
+
+// Hidden pre-activations of one packed flat-model glyph, fused with the
+// conv: each pooled plane is compacted to its non-zero cells as soon as it
+// is produced, and one axpy_rows() pass over all of them keeps the hidden
+// accumulators in registers from the first plane to the last. Features are
+// added in ascending order, zeros skipped, like mlp_forward_batch(), so
+// the dense 1352 features are never stored and the sums are the same.
+static void fused_hidden(const InferenceModel *model, const GlyphBits *glyph,
+                         real *hidden)
+{
+    int H = model->number_of_hidden_nodes;
+    unsigned short codes[CONV_H][CONV_W];
+    real plane[POOL_H * POOL_W], values[FLATTEN_SIZE];
+    int rows[FLATTEN_SIZE];
+
+    glyph_window_codes(glyph, codes);
+    int nnz = 0;
+    for (int f = 0; f < NUM_FILTERS; f++)
+    {
+        cnn_binary_plane(model->conv_lut + f * CONV_PATTERNS, codes, plane);
+
+        // Branch-free compaction: a zero's slot is overwritten
+        for (int k = 0; k < POOL_H * POOL_W; k++)
+        {
+            rows[nnz] = f * POOL_H * POOL_W + k;
+            values[nnz] = plane[k];
+            nnz += plane[k] != 0;
+        }
+    }
+    memcpy(hidden, model->hidden_bias, sizeof(real) * H);
+    kernels.axpy_rows(hidden, values, model->hidden_weights, H, rows, nnz, H);
+}
+
+static int predict_glyphs_fused(const InferenceModel *model, const GlyphBits *glyphs,
+                                int n, size_t *labels)
+{
+    int H = model->number_of_hidden_nodes;
+    int O = model->number_of_outputs;
+    MlpWeights w = inference_mlp_weights(model);
+
+    real *hidden = malloc(sizeof(real) * INFERENCE_BATCH * H);
+    real *probs = malloc(sizeof(real) * INFERENCE_BATCH * O);
+    if (hidden == NULL || probs == NULL)
+    {
+        free(hidden);
+        free(probs);
+        return 0;
+    }
+
+    for (int start = 0; start < n; start += INFERENCE_BATCH)
+    {
+        int count = n - start < INFERENCE_BATCH ? n - start : INFERENCE_BATCH;
+        for (int g = 0; g < count; g++)
+            fused_hidden(model, &glyphs[start + g], hidden + (size_t)g * H);
+        mlp_output_batch(&w, hidden, count, probs);
+        most_probable(probs, count, O, labels + start);
+    }
+
+    free(hidden);
+    free(probs);
+    return 1;
+}
+
+int inference_predict_glyphs(const InferenceModel *model, const GlyphBits *glyphs,
+                             int n, size_t *labels)
+{
+    if (model->stage2 == CNN_STAGE2_NONE)
+        return predict_glyphs_fused(model, glyphs, n, labels);
+
+    int I = model->number_of_inputs;
+    int O = model->number_of_outputs;
+
+    real *features = malloc(sizeof(real) * INFERENCE_BATCH * I);
+    real *probs = malloc(sizeof(real) * INFERENCE_BATCH * O);
+    real *stage1 = malloc(sizeof(real) * INFERENCE_BATCH * FLATTEN_SIZE);
+    if (features == NULL || probs == NULL || stage1 == NULL)
+    {
+        free(stage1);
+        free(features);
+        free(probs);
+        return 0;
+    }
+
+    for (int start = 0; start < n; start += INFERENCE_BATCH)
+    {
+        int count = n - start < INFERENCE_BATCH ? n - start : INFERENCE_BATCH;
+        for (int g = 0; g < count; g++)
+            cnn_forward_binary(model->conv_lut, &glyphs[start + g],
+                               stage1 + (size_t)g * FLATTEN_SIZE);
+        classify_features(model, stage1, count, features, probs, labels + start);
+    }
+
+    free(stage1);
+    free(features);
+    free(probs);
+    return 1;
+}
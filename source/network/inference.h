@@ -0,0 +1,60 @@
+#ifndef INFERENCE_H
+#define INFERENCE_H
+
+#include <stddef.h>
+#include "../common.h"
+#include "network.h"
+#include "cnn.h"
+#include "modelfile.h"
+
+// Frozen, read-only CNN + MLP for OCR. Holds only weights and biases (no
+// Adam moments, gradients or backprop scratch): either in place in a mapped
+// model container, or packed back-to-back in one aligned arena in the order
+// the inference kernels read them. The arena also holds the binary conv
+// lookup tables derived from them (rebuilt on load, not saved).
+typedef struct
+{
+    void *arena;
+    size_t arena_size;
+    ModelFile *file;      // container the weights point into, or NULL
+
+    int number_of_inputs;
+    int number_of_hidden_nodes;
+    int number_of_outputs;
+    int output_stride;    // NET_ROW_PAD(O): row length of output_weights
+    CnnStage2 stage2;     // second CNN stage; I == cnn_stage2_outputs(stage2)
+
+    real *filters;        // [NUM_FILTERS][3][3]
+    real *conv_bias;      // [NUM_FILTERS]
+    real *filters2;       // [STAGE2_WEIGHTS], empty when stage2 is NONE
+    real *biases2;        // [STAGE2_FILTERS], same
+    real *hidden_weights; // [I][H]
+    real *hidden_bias;    // [H]
+    real *output_weights; // [H][output_stride], zero padding columns
+    real *output_bias;    // [output_stride], same
+
+    real *conv_lut;       // [NUM_FILTERS][CONV_PATTERNS], from filters and conv_bias
+} InferenceModel;
+
+// Copies the weights out of a trained CNN + MLP. Returns NULL on OOM.
+InferenceModel *inference_from_training(const CNN *cnn, const struct network *net);
+void free_inference_model(InferenceModel *model);
+
+// Maps a model container (modelfile.h), with or without optimizer state,
+// and uses its weights in place; a container of the other precision, or
+// with lazy Adam rows to catch up, is copied into the arena. Returns NULL if the file is missing,
+// incompatible or truncated.
+InferenceModel *load_inference_model(const char *filename);
+
+// Classifies n glyphs: images is [n][IMAGE_PIXELS], labels receives the
+// class index of each. Returns 0 on OOM.
+int inference_predict_batch(const InferenceModel *model, const double *images,
+                            int n, size_t *labels);
+// Same on bit-packed 0/1 glyphs, through the conv lookup tables. Gives the
+// labels inference_predict_batch() gives for the unpacked glyphs. Flat
+// models add each pooled plane straight into the hidden layer instead of
+// storing the flattened features.
+int inference_predict_glyphs(const InferenceModel *model, const GlyphBits *glyphs,
+                             int n, size_t *labels);
+
+#endif
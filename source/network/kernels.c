@@ -0,0 +1,525 @@
+#include "kernels.h"
+#include "cnn.h"
+#include "network.h"
+
+#include <string.h>
+
+static void axpy_scalar(real *y, real a, const real *x, int n)
+{
+    for (int k = 0; k < n; k++)
+        y[k] += a * x[k];
+}
+
+static void axpy_rows_scalar(real *y, const real *a, const real *x, size_t ldx,
+                             const int *rows, int count, int n)
+{
+    for (int t = 0; t < count; t++)
+        axpy_scalar(y, a[t], x + rows[t] * ldx, n);
+}
+
+static void axpy_rows_i8_scalar(int32_t *y, const int8_t *a, const int8_t *x,
+                                size_t ldx, const int *rows, int count, int n)
+{
+    for (int t = 0; t < count; t++)
+    {
+        const int8_t *xt = x + rows[t] * ldx;
+        for (int k = 0; k < n; k++)
+            y[k] += a[t] * xt[k];
+    }
+}
+
+static real dot_scalar(const real *x, const real *y, int n)
+{
+    real sum = 0;
+    for (int k = 0; k < n; k++)
+        sum += x[k] * y[k];
+    return sum;
+}
+
+static void dot_rows_scalar(real *out, const real *x, size_t ldx, const int *rows,
+                            int count, const real *y, int n)
+{
+    for (int t = 0; t < count; t++)
+        out[rows[t]] = dot_scalar(x + rows[t] * ldx, y, n);
+}
+
+static void gemm_bias_scalar(real *c, size_t ldc, const real *w, const real *bias,
+                             int rows, int depth, const real *p, int ldp, int len)
+{
+    for (int f = 0; f < rows; f++)
+    {
+        real *cf = c + f * ldc;
+        for (int j = 0; j < len; j++)
+            cf[j] = bias[f];
+        for (int k = 0; k < depth; k++)
+            axpy_scalar(cf, w[f * depth + k], p + k * ldp, len);
+    }
+}
+
+#ifdef OCR_FLOAT32
+#define REAL_SQRT __builtin_sqrtf
+#else
+#define REAL_SQRT __builtin_sqrt
+#endif
+
+// The SIMD variants below process whole vectors and hand the remainder to
+// these, with the same operation order so results do not depend on the ISA.
+static void adam_scalar(real *w, real *m, real *v, const real *g, real scale,
+                        int n, const AdamCoeffs *c)
+{
+    const real b1 = c->beta1, b2 = c->beta2;
+    const real c1 = c->one_minus_beta1, c2 = c->one_minus_beta2;
+    const real step = c->step, inv_bc2 = c->inv_bc2, eps = c->eps;
+    for (int k = 0; k < n; k++)
+    {
+        real grad = scale * g[k];
+        real mk = b1 * m[k] + c1 * grad;
+        real vk = b2 * v[k] + c2 * grad * grad;
+        m[k] = mk;
+        v[k] = vk;
+        w[k] -= step * mk / (REAL_SQRT(vk * inv_bc2) + eps);
+    }
+}
+
+static void adam_catch_up_scalar(real *w, real *m, real *v, int n, real decay1,
+                                 real decay2, real drift, const AdamCoeffs *c)
+{
+    const real inv_bc2 = c->inv_bc2, eps = c->eps;
+    for (int k = 0; k < n; k++)
+    {
+        w[k] -= drift * m[k] / (REAL_SQRT(v[k] * inv_bc2) + eps);
+        m[k] *= decay1;
+        v[k] *= decay2;
+    }
+}
+
+// Fixed-shape kernels
+// ------------------------------------------------------------------
+
+// MLP shapes with their own kernels: the OCR network on flat CNN features
+// and the XOR demo. X(isa, target, tag, inputs, hidden, outputs)
+#define KERNEL_SHAPES(X, isa, target)                                         \
+    X(isa, target, ocr, FLATTEN_SIZE, OCR_HIDDEN_NODES, OCR_OUTPUT_NODES)     \
+    X(isa, target, xor, 2, 4, 1)
+
+// Accumulator vectors a fixed-shape layer keeps in registers per pass over
+// its input rows
+#define SHAPE_BLOCK 8
+
+// Every layer of one shape for one ISA. The kernels are inlined with the
+// widths as constants, so the compiler unrolls the blocks and drops the
+// remainder loops that never run. Output rows are NET_ROW_PAD(O) long.
+#define DEFINE_SHAPE_KERNELS(isa, target, tag, I, H, O)                       \
+    /* out[j0..j0 + nb * LANES) = bias + sum over t < count of a[r] * w[r * n + ...], \
+       r = rows[t], or t when rows is NULL */                                 \
+    target __attribute__((always_inline))                                     \
+    static inline void dense_block_##tag##_##isa(real *out, const real *bias,  \
+                                                 const real *a, const real *w, \
+                                                 const int *rows, int count,  \
+                                                 int n, int j0, int nb)       \
+    {                                                                         \
+        vec_##isa acc[SHAPE_BLOCK];                                           \
+        for (int k = 0; k < nb; k++)                                          \
+            acc[k] = *(const vec_##isa *)(bias + j0 + k * LANES_##isa);       \
+        for (int t = 0; t < count; t++)                                       \
+        {                                                                     \
+            int r = rows != NULL ? rows[t] : t;                               \
+            const real *wr = w + (size_t)r * n + j0;                          \
+            for (int k = 0; k < nb; k++)                                      \
+                acc[k] += a[r] * *(const vec_##isa *)(wr + k * LANES_##isa);  \
+        }                                                                     \
+        for (int k = 0; k < nb; k++)                                          \
+            *(vec_##isa *)(out + j0 + k * LANES_##isa) = acc[k];              \
+    }                                                                         \
+                                                                              \
+    target __attribute__((always_inline))                                     \
+    static inline void dense_##tag##_##isa(real *out, const real *bias,       \
+                                          const real *a, const real *w,       \
+                                          const int *rows, int count, int n)  \
+    {                                                                         \
+        const int vecs = n / LANES_##isa;                                     \
+        int b = 0;                                                            \
+        for (; b + SHAPE_BLOCK <= vecs; b += SHAPE_BLOCK)                     \
+            dense_block_##tag##_##isa(out, bias, a, w, rows, count, n,        \
+                                      b * LANES_##isa, SHAPE_BLOCK);          \
+        if (b < vecs)                                                         \
+            dense_block_##tag##_##isa(out, bias, a, w, rows, count, n,        \
+                                      b * LANES_##isa, vecs - b);             \
+        for (int j = vecs * LANES_##isa; j < n; j++)                          \
+        {                                                                     \
+            real sum = bias[j];                                               \
+            for (int t = 0; t < count; t++)                                   \
+            {                                                                 \
+                int r = rows != NULL ? rows[t] : t;                           \
+                sum += a[r] * w[(size_t)r * n + j];                           \
+            }                                                                 \
+            out[j] = sum;                                                     \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    target                                                                    \
+    static void hidden_layer_##tag##_##isa(real *hidden, const real *bias,    \
+                                           const real *in, const real *w)     \
+    {                                                                         \
+        int rows[I];                                                          \
+        int count = 0;                                                        \
+        for (int i = 0; i < (I); i++)                                         \
+        {                                                                     \
+            rows[count] = i;                                                  \
+            count += in[i] != 0;                                              \
+        }                                                                     \
+        dense_##tag##_##isa(hidden, bias, in, w, rows, count, H);             \
+    }                                                                         \
+                                                                              \
+    target                                                                    \
+    static void output_layer_##tag##_##isa(real *out, const real *bias,       \
+                                           const real *hidden, const real *w) \
+    {                                                                         \
+        dense_##tag##_##isa(out, bias, hidden, w, NULL, H, NET_ROW_PAD(O));   \
+    }                                                                         \
+                                                                              \
+    target                                                                    \
+    static real output_dot_##tag##_##isa(const real *w_row, const real *delta) \
+    {                                                                         \
+        return dot_##isa(w_row, delta, NET_ROW_PAD(O));                       \
+    }                                                                         \
+                                                                              \
+    target                                                                    \
+    static void input_dots_##tag##_##isa(real *out, const real *w,            \
+                                         const int *rows, int count,          \
+                                         const real *delta)                   \
+    {                                                                         \
+        for (int t = 0; t < count; t++)                                       \
+            out[rows[t]] = dot_##isa(w + (size_t)rows[t] * (H), delta, H);    \
+    }
+
+#define SHAPE_ENTRY(isa, target, tag, I, H, O)                                \
+    { I, H, O, hidden_layer_##tag##_##isa, output_layer_##tag##_##isa,        \
+      output_dot_##tag##_##isa, input_dots_##tag##_##isa },
+#define SHAPE_ONE(isa, target, tag, I, H, O) + 1
+
+enum { SHAPE_COUNT = 0 KERNEL_SHAPES(SHAPE_ONE, , ) };
+
+// The scalar set runs the same code one element at a time
+typedef real vec_scalar;
+enum { LANES_scalar = 1 };
+KERNEL_SHAPES(DEFINE_SHAPE_KERNELS, scalar, )
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+
+#include <immintrin.h>
+
+// Hardware square root per ISA; GCC vector extensions have no sqrt of
+// their own, so the vector is reinterpreted as the intrinsic's type.
+#ifdef OCR_FLOAT32
+#define SQRT_sse(x)    ((__typeof__(x))_mm_sqrt_ps((__m128)(x)))
+#define SQRT_avx2(x)   ((__typeof__(x))_mm256_sqrt_ps((__m256)(x)))
+#define SQRT_avx512(x) ((__typeof__(x))_mm512_sqrt_ps((__m512)(x)))
+#else
+#define SQRT_sse(x)    ((__typeof__(x))_mm_sqrt_pd((__m128d)(x)))
+#define SQRT_avx2(x)   ((__typeof__(x))_mm256_sqrt_pd((__m256d)(x)))
+#define SQRT_avx512(x) ((__typeof__(x))_mm512_sqrt_pd((__m512d)(x)))
+#endif
+
+// A vector of int32 lanes sign-extended from as many int8 at p (unaligned).
+// SSE2 has no pmovsxbd: each byte is spread over a lane, then shifted down.
+__attribute__((target("sse2")))
+static inline __m128i widen_i8_sse(const int8_t *p)
+{
+    int32_t bytes;
+    memcpy(&bytes, p, sizeof(bytes));
+    __m128i x = _mm_cvtsi32_si128(bytes);
+    x = _mm_unpacklo_epi8(x, x);
+    return _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 24);
+}
+
+#define WIDEN_I8_sse(p)    widen_i8_sse(p)
+#define WIDEN_I8_avx2(p)   _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(p)))
+#define WIDEN_I8_avx512(p) _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)(p)))
+
+// Vectors of y that axpy_rows keeps in registers per pass over the rows
+#define AXPY_ROWS_BLOCK 4
+
+// One SIMD kernel pair per instruction set, written with GCC vector
+// extensions and compiled for that ISA through the target attribute, so
+// the rest of the binary stays baseline x86-64. Vector types are declared
+// with element alignment: loads and stores are unaligned.
+#define DEFINE_SIMD_KERNELS(isa, target_isa, bytes)                           \
+    typedef real vec_##isa __attribute__((vector_size(bytes), aligned(sizeof(real)))); \
+    enum { LANES_##isa = (bytes) / sizeof(real) };                            \
+    typedef int32_t ivec_##isa __attribute__((vector_size(bytes), aligned(4))); \
+    enum { ILANES_##isa = (bytes) / 4 };                                      \
+                                                                              \
+    __attribute__((target(target_isa)))                                       \
+    static void axpy_##isa(real *y, real a, const real *x, int n)             \
+    {                                                                         \
+        int k = 0;                                                            \
+        for (; k + LANES_##isa <= n; k += LANES_##isa)                        \
+        {                                                                     \
+            vec_##isa *yv = (vec_##isa *)(y + k);                             \
+            *yv += a * *(const vec_##isa *)(x + k);                           \
+        }                                                                     \
+        for (; k < n; k++)                                                    \
+            y[k] += a * x[k];                                                 \
+    }                                                                         \
+                                                                              \
+    __attribute__((target(target_isa)))                                       \
+    static void axpy_rows_##isa(real *y, const real *a, const real *x,        \
+                                size_t ldx, const int *rows, int count, int n) \
+    {                                                                         \
+        int k = 0;                                                            \
+        for (; k + AXPY_ROWS_BLOCK * LANES_##isa <= n;                        \
+             k += AXPY_ROWS_BLOCK * LANES_##isa)                              \
+        {                                                                     \
+            vec_##isa acc[AXPY_ROWS_BLOCK];                                   \
+            for (int b = 0; b < AXPY_ROWS_BLOCK; b++)                         \
+                acc[b] = *(const vec_##isa *)(y + k + b * LANES_##isa);       \
+            for (int t = 0; t < count; t++)                                   \
+            {                                                                 \
+                const real *xt = x + rows[t] * ldx + k;                       \
+                for (int b = 0; b < AXPY_ROWS_BLOCK; b++)                     \
+                    acc[b] += a[t] * *(const vec_##isa *)(xt + b * LANES_##isa); \
+            }                                                                 \
+            for (int b = 0; b < AXPY_ROWS_BLOCK; b++)                         \
+                *(vec_##isa *)(y + k + b * LANES_##isa) = acc[b];             \
+        }                                                                     \
+        for (; k + LANES_##isa <= n; k += LANES_##isa)                        \
+        {                                                                     \
+            vec_##isa acc = *(const vec_##isa *)(y + k);                      \
+            for (int t = 0; t < count; t++)                                   \
+                acc += a[t] * *(const vec_##isa *)(x + rows[t] * ldx + k);    \
+            *(vec_##isa *)(y + k) = acc;                                      \
+        }                                                                     \
+        if (k < n)                                                            \
+            axpy_rows_scalar(y + k, a, x + k, ldx, rows, count, n - k);       \
+    }                                                                         \
+                                                                              \
+    __attribute__((target(target_isa)))                                       \
+    static void axpy_rows_i8_##isa(int32_t *y, const int8_t *a,               \
+                                   const int8_t *x, size_t ldx,               \
+                                   const int *rows, int count, int n)         \
+    {                                                                         \
+        int k = 0;                                                            \
+        for (; k + AXPY_ROWS_BLOCK * ILANES_##isa <= n;                       \
+             k += AXPY_ROWS_BLOCK * ILANES_##isa)                             \
+        {                                                                     \
+            ivec_##isa acc[AXPY_ROWS_BLOCK];                                  \
+            for (int b = 0; b < AXPY_ROWS_BLOCK; b++)                         \
+                acc[b] = *(const ivec_##isa *)(y + k + b * ILANES_##isa);     \
+            for (int t = 0; t < count; t++)                                   \
+            {                                                                 \
+                const int8_t *xt = x + rows[t] * ldx + k;                     \
+                int32_t at = a[t];                                            \
+                for (int b = 0; b < AXPY_ROWS_BLOCK; b++)                     \
+                    acc[b] += at * (ivec_##isa)WIDEN_I8_##isa(xt + b * ILANES_##isa); \
+            }                                                                 \
+            for (int b = 0; b < AXPY_ROWS_BLOCK; b++)                         \
+                *(ivec_##isa *)(y + k + b * ILANES_##isa) = acc[b];           \
+        }                                                                     \
+        for (; k + ILANES_##isa <= n; k += ILANES_##isa)                      \
+        {                                                                     \
+            ivec_##isa acc = *(const ivec_##isa *)(y + k);                    \
+            for (int t = 0; t < count; t++)                                   \
+                acc += (int32_t)a[t]                                          \
+                     * (ivec_##isa)WIDEN_I8_##isa(x + rows[t] * ldx + k);     \
+            *(ivec_##isa *)(y + k) = acc;                                     \
+        }                                                                     \
+        if (k < n)                                                            \
+            axpy_rows_i8_scalar(y + k, a, x + k, ldx, rows, count, n - k);    \
+    }                                                                         \
+                                                                              \
+    __attribute__((target(target_isa)))                                       \
+    static real dot_##isa(const real *x, const real *y, int n)                \
+    {                                                                         \
+        vec_##isa acc0 = {0}, acc1 = {0};                                     \
+        int k = 0;                                                            \
+        for (; k + 2 * LANES_##isa <= n; k += 2 * LANES_##isa)                \
+        {                                                                     \
+            acc0 += *(const vec_##isa *)(x + k) * *(const vec_##isa *)(y + k); \
+            acc1 += *(const vec_##isa *)(x + k + LANES_##isa)                 \
+                  * *(const vec_##isa *)(y + k + LANES_##isa);                \
+        }                                                                     \
+        acc0 += acc1;                                                         \
+        real sum = 0;                                                         \
+        for (int l = 0; l < LANES_##isa; l++)                                 \
+            sum += acc0[l];                                                   \
+        for (; k < n; k++)                                                    \
+            sum += x[k] * y[k];                                               \
+        return sum;                                                           \
+    }                                                                         \
+                                                                              \
+    __attribute__((target(target_isa)))                                       \
+    static void dot_rows_##isa(real *out, const real *x, size_t ldx,          \
+                               const int *rows, int count, const real *y,     \
+                               int n)                                         \
+    {                                                                         \
+        for (int t = 0; t < count; t++)                                       \
+            out[rows[t]] = dot_##isa(x + rows[t] * ldx, y, n);                \
+    }                                                                         \
+                                                                              \
+    __attribute__((target(target_isa)))                                       \
+    static void gemm_bias_##isa(real *c, size_t ldc, const real *w,           \
+                                const real *bias, int rows, int depth,        \
+                                const real *p, int ldp, int len)              \
+    {                                                                         \
+        int j = 0;                                                            \
+        for (; j + 2 * LANES_##isa <= len; j += 2 * LANES_##isa)              \
+            for (int f = 0; f < rows; f++)                                    \
+            {                                                                 \
+                const real *wf = w + f * depth;                               \
+                vec_##isa acc0 = bias[f] - (vec_##isa){0}, acc1 = acc0;       \
+                for (int k = 0; k < depth; k++)                               \
+                {                                                             \
+                    const real *pk = p + k * ldp + j;                         \
+                    acc0 += *(const vec_##isa *)pk * wf[k];                   \
+                    acc1 += *(const vec_##isa *)(pk + LANES_##isa) * wf[k];   \
+                }                                                             \
+                *(vec_##isa *)(c + f * ldc + j) = acc0;                       \
+                *(vec_##isa *)(c + f * ldc + j + LANES_##isa) = acc1;         \
+            }                                                                 \
+        if (j < len)                                                          \
+            gemm_bias_scalar(c + j, ldc, w, bias, rows, depth, p + j, ldp,    \
+                             len - j);                                        \
+    }                                                                         \
+                                                                              \
+    __attribute__((target(target_isa)))                                       \
+    static void adam_##isa(real *w, real *m, real *v, const real *g,          \
+                           real scale, int n, const AdamCoeffs *c)            \
+    {                                                                         \
+        const real b1 = c->beta1, b2 = c->beta2;                              \
+        const real c1 = c->one_minus_beta1, c2 = c->one_minus_beta2;          \
+        const real step = c->step, inv_bc2 = c->inv_bc2, eps = c->eps;        \
+        int k = 0;                                                            \
+        for (; k + LANES_##isa <= n; k += LANES_##isa)                        \
+        {                                                                     \
+            vec_##isa grad = scale * *(const vec_##isa *)(g + k);             \
+            vec_##isa mk = b1 * *(vec_##isa *)(m + k) + c1 * grad;            \
+            vec_##isa vk = b2 * *(vec_##isa *)(v + k) + c2 * grad * grad;     \
+            *(vec_##isa *)(m + k) = mk;                                       \
+            *(vec_##isa *)(v + k) = vk;                                       \
+            *(vec_##isa *)(w + k) -= step * mk / (SQRT_##isa(vk * inv_bc2) + eps); \
+        }                                                                     \
+        adam_scalar(w + k, m + k, v + k, g + k, scale, n - k, c);             \
+    }                                                                         \
+                                                                              \
+    __attribute__((target(target_isa)))                                       \
+    static void adam_catch_up_##isa(real *w, real *m, real *v, int n,         \
+                                    real decay1, real decay2, real drift,     \
+                                    const AdamCoeffs *c)                      \
+    {                                                                         \
+        const real inv_bc2 = c->inv_bc2, eps = c->eps;                        \
+        int k = 0;                                                            \
+        for (; k + LANES_##isa <= n; k += LANES_##isa)                        \
+        {                                                                     \
+            vec_##isa *mv = (vec_##isa *)(m + k);                             \
+            vec_##isa *vv = (vec_##isa *)(v + k);                             \
+            *(vec_##isa *)(w + k) -= drift * *mv / (SQRT_##isa(*vv * inv_bc2) + eps); \
+            *mv *= decay1;                                                    \
+            *vv *= decay2;                                                    \
+        }                                                                     \
+        adam_catch_up_scalar(w + k, m + k, v + k, n - k, decay1, decay2,      \
+                             drift, c);                                       \
+    }
+
+DEFINE_SIMD_KERNELS(sse, "sse2", 16)
+DEFINE_SIMD_KERNELS(avx2, "avx2", 32)
+DEFINE_SIMD_KERNELS(avx512, "avx512f", 64)
+
+KERNEL_SHAPES(DEFINE_SHAPE_KERNELS, sse, __attribute__((target("sse2"))))
+KERNEL_SHAPES(DEFINE_SHAPE_KERNELS, avx2, __attribute__((target("avx2"))))
+KERNEL_SHAPES(DEFINE_SHAPE_KERNELS, avx512, __attribute__((target("avx512f"))))
+
+#undef DEFINE_SIMD_KERNELS
+#undef AXPY_ROWS_BLOCK
+#undef SQRT_sse
+#undef SQRT_avx2
+#undef SQRT_avx512
+#undef WIDEN_I8_sse
+#undef WIDEN_I8_avx2
+#undef WIDEN_I8_avx512
+#endif
+
+static const DenseKernels kernel_sets[] =
+{
+#ifdef KERNELS_X86
+    { "avx512", axpy_avx512, axpy_rows_avx512, axpy_rows_i8_avx512, dot_avx512,
+      dot_rows_avx512, gemm_bias_avx512, adam_avx512, adam_catch_up_avx512 },
+    { "avx2",   axpy_avx2,   axpy_rows_avx2,   axpy_rows_i8_avx2,   dot_avx2,
+      dot_rows_avx2,   gemm_bias_avx2,   adam_avx2,   adam_catch_up_avx2 },
+    { "sse",    axpy_sse,    axpy_rows_sse,    axpy_rows_i8_sse,    dot_sse,
+      dot_rows_sse,    gemm_bias_sse,    adam_sse,    adam_catch_up_sse },
+#endif
+    { "scalar", axpy_scalar, axpy_rows_scalar, axpy_rows_i8_scalar, dot_scalar,
+      dot_rows_scalar, gemm_bias_scalar, adam_scalar, adam_catch_up_scalar },
+};
+
+#define KERNEL_SET_COUNT (sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+// Fixed-shape kernels of each set, in kernel_sets order
+static const ShapeKernels shape_sets[][SHAPE_COUNT] =
+{
+#ifdef KERNELS_X86
+    { KERNEL_SHAPES(SHAPE_ENTRY, avx512, ) },
+    { KERNEL_SHAPES(SHAPE_ENTRY, avx2, ) },
+    { KERNEL_SHAPES(SHAPE_ENTRY, sse, ) },
+#endif
+    { KERNEL_SHAPES(SHAPE_ENTRY, scalar, ) },
+};
+
+static const ShapeKernels *active_shapes = shape_sets[KERNEL_SET_COUNT - 1];
+
+DenseKernels kernels = { "scalar", axpy_scalar, axpy_rows_scalar, axpy_rows_i8_scalar,
+                         dot_scalar, dot_rows_scalar, gemm_bias_scalar,
+                         adam_scalar, adam_catch_up_scalar };
+
+static int cpu_supports(const char *name)
+{
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx512") == 0) return __builtin_cpu_supports("avx512f");
+    if (strcmp(name, "avx2") == 0)   return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse") == 0)    return __builtin_cpu_supports("sse2");
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+int kernels_select(const char *name)
+{
+    int automatic = name == NULL || strcmp(name, "auto") == 0;
+
+    // kernel_sets is ordered widest first: auto takes the first supported one
+    for (size_t i = 0; i < KERNEL_SET_COUNT; i++)
+    {
+        if (!automatic && strcmp(name, kernel_sets[i].name) != 0)
+            continue;
+        if (!cpu_supports(kernel_sets[i].name))
+        {
+            if (automatic) continue;
+            return 0;
+        }
+        kernels = kernel_sets[i];
+        active_shapes = shape_sets[i];
+        return 1;
+    }
+    return 0;
+}
+
+const char *kernels_set_name(int index)
+{
+    if (index < 0 || (size_t)index >= KERNEL_SET_COUNT)
+        return NULL;
+    return kernel_sets[index].name;
+}
+
+const ShapeKernels *kernels_for_shape(int inputs, int hidden, int outputs)
+{
+    for (int k = 0; k < SHAPE_COUNT; k++)
+    {
+        const ShapeKernels *shape = &active_shapes[k];
+        if (shape->inputs == inputs && shape->hidden == hidden
+            && shape->outputs == outputs)
+            return shape;
+    }
+    return NULL;
+}
@@ -0,0 +1,90 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../common.h"
+
+// Per-step Adam coefficients, computed once by the optimizer (see
+// optimizer.h) and read by every adam kernel call of that step.
+typedef struct
+{
+    real eta;
+    real beta1, beta2;
+    real one_minus_beta1, one_minus_beta2;
+    real step;    // eta / (1 - beta1^t)
+    real inv_bc2; // 1 / (1 - beta2^t)
+    real eps;
+} AdamCoeffs;
+
+// Dense-layer primitives with one implementation per instruction set.
+// `kernels` holds the active set; kernels_select() picks it at startup.
+typedef struct
+{
+    const char *name;
+    // y[0..n) += a * x[0..n)
+    void (*axpy)(real *y, real a, const real *x, int n);
+    // Gathered axpy: y[0..n) += a[t] * x[rows[t] * ldx + 0..n) for t < count,
+    // terms added in t order; y stays in registers across the rows
+    void (*axpy_rows)(real *y, const real *a, const real *x, size_t ldx,
+                      const int *rows, int count, int n);
+    // axpy_rows() of the int8 model (quantize.h): products and sums in
+    // int32, so every set gives the same result
+    void (*axpy_rows_i8)(int32_t *y, const int8_t *a, const int8_t *x, size_t ldx,
+                         const int *rows, int count, int n);
+    // returns sum of x[k] * y[k] over k < n
+    real (*dot)(const real *x, const real *y, int n);
+    // out[rows[t]] = dot(x + rows[t] * ldx, y, n) for t < count, in one call
+    void (*dot_rows)(real *out, const real *x, size_t ldx, const int *rows,
+                     int count, const real *y, int n);
+    // Small GEMM with a bias column: for f < rows, j < len,
+    // c[f * ldc + j] = bias[f] + sum over k < depth of w[f * depth + k] * p[k * ldp + j]
+    // (terms added in k order)
+    void (*gemm_bias)(real *c, size_t ldc, const real *w, const real *bias,
+                      int rows, int depth, const real *p, int ldp, int len);
+    // One Adam step on n parameters whose gradient is scale * g[k]:
+    // w, m and v are read and written in a single pass
+    void (*adam)(real *w, real *m, real *v, const real *g, real scale, int n,
+                 const AdamCoeffs *c);
+    // Replays skipped zero-gradient steps: w -= drift * m / (sqrt(v * inv_bc2) + eps),
+    // then m *= decay1, v *= decay2
+    void (*adam_catch_up)(real *w, real *m, real *v, int n, real decay1,
+                          real decay2, real drift, const AdamCoeffs *c);
+} DenseKernels;
+
+extern DenseKernels kernels;
+
+// Whole-layer passes of one MLP shape, generated with the layer widths as
+// compile-time constants. Each gives the same result, in the same order,
+// as the generic kernels. Output rows, biases and deltas are
+// Os = NET_ROW_PAD(O) long (network.h), their padding zero.
+typedef struct
+{
+    int inputs, hidden, outputs;
+    // hidden[0..H) = bias + sum over i < I with in[i] != 0 of in[i] * w[i * H + 0..H)
+    void (*hidden_layer)(real *hidden, const real *bias, const real *in,
+                         const real *w);
+    // out[0..Os) = bias + sum over h < H of hidden[h] * w[h * Os + 0..Os)
+    void (*output_layer)(real *out, const real *bias, const real *hidden,
+                         const real *w);
+    // dot(w_row, delta, Os)
+    real (*output_dot)(const real *w_row, const real *delta);
+    // out[rows[t]] = dot(w + rows[t] * H, delta, H) for t < count
+    void (*input_dots)(real *out, const real *w, const int *rows, int count,
+                       const real *delta);
+} ShapeKernels;
+
+// The active set's fixed-shape kernels for an inputs-hidden-outputs MLP,
+// or NULL when the shape has none (callers then use `kernels`).
+const ShapeKernels *kernels_for_shape(int inputs, int hidden, int outputs);
+
+// Selects the kernel set by name ("scalar", "sse", "avx2", "avx512"), or the
+// widest one the CPU supports when name is NULL or "auto". Returns 0 if the
+// name is unknown or the CPU lacks the instruction set (selection unchanged).
+int kernels_select(const char *name);
+
+// Name of kernel set `index`, widest first; NULL past the last one. The CPU
+// may not support it (kernels_select() then fails).
+const char *kernels_set_name(int index);
+
+#endif
@@ -0,0 +1,534 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "modelfile.h"
+#include "optimizer.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// One section as stored: rows x cols reals, rows `stride` apart in memory
+// (longs for the row steps)
+typedef struct
+{
+    ModelSectionId id;
+    void *data;
+    int rows, cols, stride;
+    int wanted;             // part of this model (stage 2, optimizer state)
+} ModelPart;
+
+static size_t align_up(size_t n, size_t alignment)
+{
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+static int cnn_parts(CNN *cnn, CnnStage2 stage2, int optimizer, ModelPart *parts)
+{
+    const int kernel_count = NUM_FILTERS * CONV_TAPS;
+    int has_stage2 = stage2 != CNN_STAGE2_NONE;
+    ModelPart list[] =
+    {
+        { MODEL_CONV_BIAS, cnn->biases, 1, NUM_FILTERS, NUM_FILTERS, 1 },
+        { MODEL_FILTERS, &cnn->filters[0][0][0], 1, kernel_count, kernel_count, 1 },
+        { MODEL_BIASES2, cnn->biases2, 1, STAGE2_FILTERS, STAGE2_FILTERS, has_stage2 },
+        { MODEL_FILTERS2, cnn->filters2, 1, STAGE2_WEIGHTS, STAGE2_WEIGHTS, has_stage2 },
+        { MODEL_M_CONV_BIAS, cnn->m_biases, 1, NUM_FILTERS, NUM_FILTERS, optimizer },
+        { MODEL_V_CONV_BIAS, cnn->v_biases, 1, NUM_FILTERS, NUM_FILTERS, optimizer },
+        { MODEL_M_FILTERS, &cnn->m_filters[0][0][0], 1, kernel_count, kernel_count, optimizer },
+        { MODEL_V_FILTERS, &cnn->v_filters[0][0][0], 1, kernel_count, kernel_count, optimizer },
+        { MODEL_M_BIASES2, cnn->m_biases2, 1, STAGE2_FILTERS, STAGE2_FILTERS,
+          optimizer && has_stage2 },
+        { MODEL_V_BIASES2, cnn->v_biases2, 1, STAGE2_FILTERS, STAGE2_FILTERS,
+          optimizer && has_stage2 },
+        { MODEL_M_FILTERS2, cnn->m_filters2, 1, STAGE2_WEIGHTS, STAGE2_WEIGHTS,
+          optimizer && has_stage2 },
+        { MODEL_V_FILTERS2, cnn->v_filters2, 1, STAGE2_WEIGHTS, STAGE2_WEIGHTS,
+          optimizer && has_stage2 },
+    };
+    int n = 0;
+    for (size_t k = 0; k < sizeof(list) / sizeof(list[0]); k++)
+        if (list[k].wanted)
+            parts[n++] = list[k];
+    return n;
+}
+
+static int network_parts(struct network *net, int optimizer, ModelPart *parts)
+{
+    int I = net->number_of_inputs;
+    int H = net->number_of_hidden_nodes;
+    int O = net->number_of_outputs;
+    int Os = net->output_stride;
+    ModelPart list[] =
+    {
+        { MODEL_HIDDEN_BIAS, net->hidden_layer_bias, 1, H, H, 1 },
+        { MODEL_HIDDEN_WEIGHTS, net->hidden_weights, I, H, H, 1 },
+        { MODEL_OUTPUT_BIAS, net->output_layer_bias, 1, O, Os, 1 },
+        { MODEL_OUTPUT_WEIGHTS, net->output_weights, H, O, Os, 1 },
+        { MODEL_M_HIDDEN_BIAS, net->m_hidden_bias, 1, H, H, optimizer },
+        { MODEL_V_HIDDEN_BIAS, net->v_hidden_bias, 1, H, H, optimizer },
+        { MODEL_M_HIDDEN_WEIGHTS, net->m_hidden_weights, I, H, H, optimizer },
+        { MODEL_V_HIDDEN_WEIGHTS, net->v_hidden_weights, I, H, H, optimizer },
+        { MODEL_M_OUTPUT_BIAS, net->m_output_bias, 1, O, Os, optimizer },
+        { MODEL_V_OUTPUT_BIAS, net->v_output_bias, 1, O, Os, optimizer },
+        { MODEL_M_OUTPUT_WEIGHTS, net->m_output_weights, H, O, Os, optimizer },
+        { MODEL_V_OUTPUT_WEIGHTS, net->v_output_weights, H, O, Os, optimizer },
+        { MODEL_HIDDEN_ROW_STEP, net->hidden_row_step, 1, I, I, optimizer },
+        { MODEL_OUTPUT_ROW_STEP, net->output_row_step, 1, H, H, optimizer },
+    };
+    int n = 0;
+    for (size_t k = 0; k < sizeof(list) / sizeof(list[0]); k++)
+        if (list[k].wanted)
+            parts[n++] = list[k];
+    return n;
+}
+
+int model_row_length(uint32_t real_bits, ModelSectionId id, int cols)
+{
+    switch (id)
+    {
+    case MODEL_OUTPUT_BIAS: case MODEL_M_OUTPUT_BIAS: case MODEL_V_OUTPUT_BIAS:
+    case MODEL_OUTPUT_WEIGHTS: case MODEL_M_OUTPUT_WEIGHTS: case MODEL_V_OUTPUT_WEIGHTS:
+    {
+        int line = (int)(MODEL_ALIGN / (real_bits / 8));
+        return (cols + line - 1) / line * line;
+    }
+    default:
+        return cols;
+    }
+}
+
+static int is_row_steps(uint32_t id)
+{
+    return id == MODEL_HIDDEN_ROW_STEP || id == MODEL_OUTPUT_ROW_STEP;
+}
+
+static size_t element_bytes(uint32_t real_bits, uint32_t id)
+{
+    return is_row_steps(id) ? sizeof(int64_t) : real_bits / 8;
+}
+
+// Replays on rows x n weights w (rows `ld` apart) the steps lazy Adam
+// skipped, from copies of their moments, so the source stays untouched
+static int catch_up_copy(const AdamCoeffs *c, long t, real *w, int rows, int n,
+                         size_t ld, const real *m, const real *v, size_t mld,
+                         const long *row_step)
+{
+    real *scratch = malloc(sizeof(real) * 2 * n);
+    if (scratch == NULL) return 0;
+    for (int r = 0; r < rows; r++)
+    {
+        long step = row_step[r];
+        if (step >= t) continue;
+        memcpy(scratch, m + r * mld, sizeof(real) * n);
+        memcpy(scratch + n, v + r * mld, sizeof(real) * n);
+        adam_catch_up_row(c, t, w + r * ld, scratch, scratch + n, n, &step);
+    }
+    free(scratch);
+    return 1;
+}
+
+// The checksum as stored: the header with a zero checksum, then the rest
+static uint64_t container_checksum(const unsigned char *data, size_t size)
+{
+    ModelHeader header;
+    memcpy(&header, data, sizeof(header));
+    header.checksum = 0;
+    uint64_t hash = fnv1a(FNV1A_INIT, &header, sizeof(header));
+    return fnv1a(hash, data + sizeof(header), size - sizeof(header));
+}
+
+void *model_pack(const CNN *cnn, const struct network *net, int optimizer,
+                 size_t *size)
+{
+    // The parts only read from cnn and net
+    ModelPart parts[MODEL_SECTION_IDS];
+    int n = cnn_parts((CNN *)cnn, cnn->stage2, optimizer, parts);
+    n += network_parts((struct network *)net, optimizer, parts + n);
+
+    ModelSection table[MODEL_SECTION_IDS];
+    size_t data_start = align_up(sizeof(ModelHeader) + n * sizeof(ModelSection), MODEL_ALIGN);
+    size_t total = data_start;
+    int lengths[MODEL_SECTION_IDS];
+    for (int k = 0; k < n; k++)
+    {
+        lengths[k] = model_row_length(REAL_BITS, parts[k].id, parts[k].cols);
+        table[k].id = parts[k].id;
+        table[k].reserved = 0;
+        table[k].offset = total;
+        table[k].count = (uint64_t)parts[k].rows * lengths[k];
+        total = align_up(total + table[k].count * element_bytes(REAL_BITS, parts[k].id),
+                         MODEL_ALIGN);
+    }
+
+    // Zeroed, so the row padding is written as zeros
+    unsigned char *buffer = calloc(1, total);
+    if (buffer == NULL) return NULL;
+    for (int k = 0; k < n; k++)
+    {
+        if (is_row_steps(parts[k].id))
+        {
+            int64_t *dst = (int64_t *)(buffer + table[k].offset);
+            for (int c = 0; c < parts[k].cols; c++)
+                dst[c] = ((const long *)parts[k].data)[c];
+            continue;
+        }
+        real *dst = (real *)(buffer + table[k].offset);
+        for (int r = 0; r < parts[k].rows; r++)
+            memcpy(dst + (size_t)r * lengths[k],
+                   (const real *)parts[k].data + (size_t)r * parts[k].stride,
+                   sizeof(real) * parts[k].cols);
+    }
+
+    // Without the row steps, the saved weights must be the synced ones
+    if (!optimizer)
+    {
+        AdamCoeffs adam = adam_coeffs(net->eta, net->adam_beta1_t, net->adam_beta2_t);
+        int I = net->number_of_inputs, H = net->number_of_hidden_nodes;
+        int Os = net->output_stride;
+        int ok = 1;
+        for (int k = 0; k < n; k++)
+        {
+            real *w = (real *)(buffer + table[k].offset);
+            if (parts[k].id == MODEL_HIDDEN_WEIGHTS)
+                ok &= catch_up_copy(&adam, net->adam_t, w, I, H, lengths[k],
+                                    net->m_hidden_weights, net->v_hidden_weights, H,
+                                    net->hidden_row_step);
+            else if (parts[k].id == MODEL_OUTPUT_WEIGHTS)
+                ok &= catch_up_copy(&adam, net->adam_t, w, H, Os, lengths[k],
+                                    net->m_output_weights, net->v_output_weights, Os,
+                                    net->output_row_step);
+        }
+        if (!ok)
+        {
+            free(buffer);
+            return NULL;
+        }
+    }
+
+    ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.byte_order = MODEL_BYTE_ORDER;
+    header.real_bits = REAL_BITS;
+    header.flags = optimizer ? MODEL_OPTIMIZER : 0;
+    header.section_count = n;
+    header.stage2 = cnn->stage2;
+    header.num_filters = NUM_FILTERS;
+    header.conv_size = CONV_SIZE;
+    header.inputs = net->number_of_inputs;
+    header.hidden = net->number_of_hidden_nodes;
+    header.outputs = net->number_of_outputs;
+    header.file_size = total;
+    header.cnn_adam_t = optimizer ? cnn->adam_t : 0;
+    header.net_adam_t = optimizer ? net->adam_t : 0;
+    header.cnn_beta1_t = optimizer ? cnn->adam_beta1_t : 1.0;
+    header.cnn_beta2_t = optimizer ? cnn->adam_beta2_t : 1.0;
+    header.net_beta1_t = optimizer ? net->adam_beta1_t : 1.0;
+    header.net_beta2_t = optimizer ? net->adam_beta2_t : 1.0;
+    header.net_eta = net->eta;
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), table, n * sizeof(ModelSection));
+    header.checksum = container_checksum(buffer, total);
+    memcpy(buffer, &header, sizeof(header));
+
+    *size = total;
+    return buffer;
+}
+
+size_t model_save(const char *filename, const CNN *cnn, const struct network *net,
+                  int optimizer)
+{
+    if (filename == NULL || cnn == NULL || net == NULL) return 0;
+    size_t size = 0;
+    void *buffer = model_pack(cnn, net, optimizer, &size);
+    if (buffer == NULL) return 0;
+
+    int ok = write_file_atomic(filename, buffer, size);
+    free(buffer);
+    return ok ? size : 0;
+}
+
+static const ModelSection *find_section(const ModelFile *file, ModelSectionId id)
+{
+    for (uint32_t k = 0; k < file->header->section_count; k++)
+        if (file->sections[k].id == (uint32_t)id)
+            return &file->sections[k];
+    return NULL;
+}
+
+// Header and section table sane for this build: 1 if compatible, 0 if
+// incompatible, -1 if truncated or corrupt
+static int check_container(const ModelFile *file)
+{
+    const ModelHeader *h = file->header;
+    if (file->size < sizeof(ModelHeader))
+        return -1;
+    if (memcmp(h->magic, MODEL_MAGIC, sizeof(h->magic)) != 0
+        || h->version != MODEL_VERSION
+        || h->byte_order != MODEL_BYTE_ORDER
+        || (h->real_bits != 32 && h->real_bits != 64))
+        return 0;
+
+    // Nothing else in the header is trusted before the checksum matches
+    if (h->file_size != file->size
+        || container_checksum(file->map, file->size) != h->checksum)
+        return -1;
+
+    if (h->num_filters != NUM_FILTERS || h->conv_size != CONV_SIZE
+        || h->stage2 < CNN_STAGE2_NONE || h->stage2 > CNN_STAGE2_CONV_POOL
+        || h->inputs != cnn_stage2_outputs((CnnStage2)h->stage2)
+        || h->hidden <= 0 || h->outputs <= 0)
+        return 0;
+
+    size_t data_start = sizeof(ModelHeader) + (size_t)h->section_count * sizeof(ModelSection);
+    if (h->section_count > MODEL_SECTION_IDS || data_start > file->size)
+        return -1;
+    data_start = align_up(data_start, MODEL_ALIGN);
+
+    for (uint32_t k = 0; k < h->section_count; k++)
+    {
+        const ModelSection *s = &file->sections[k];
+        if (s->offset % MODEL_ALIGN != 0 || s->offset < data_start
+            || s->offset > file->size
+            || s->count > (file->size - s->offset) / element_bytes(h->real_bits, s->id))
+            return -1;
+    }
+    return 1;
+}
+
+ModelFile *model_open(const char *filename)
+{
+    if (filename == NULL) return NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror(filename);
+        return NULL;
+    }
+
+    ModelFile *file = calloc(1, sizeof(ModelFile));
+    if (file == NULL)
+    {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    file->map = map;
+    file->size = (size_t)st.st_size;
+    file->header = map;
+    file->sections = (const ModelSection *)((const char *)map + sizeof(ModelHeader));
+
+    int status = check_container(file);
+    if (status <= 0)
+    {
+        if (status == 0)
+            fprintf(stderr, "model_open: incompatible file %s (ignored)\n", filename);
+        else
+            fprintf(stderr, "model_open: file %s truncated or corrupt\n", filename);
+        model_close(file);
+        return NULL;
+    }
+    if (file->header->real_bits != REAL_BITS)
+        fprintf(stderr, "model_open: %s holds %u-bit weights, converting to %d-bit\n",
+                filename, file->header->real_bits, REAL_BITS);
+    return file;
+}
+
+void model_close(ModelFile *file)
+{
+    if (file == NULL) return;
+    munmap(file->map, file->size);
+    free(file);
+}
+
+const real *model_section(const ModelFile *file, ModelSectionId id, size_t count)
+{
+    const ModelSection *s = find_section(file, id);
+    if (s == NULL || s->count != count || file->header->real_bits != REAL_BITS)
+        return NULL;
+    return (const real *)((const char *)file->map + s->offset);
+}
+
+int model_read(const ModelFile *file, ModelSectionId id, real *dst,
+               int rows, int cols, int stride)
+{
+    const ModelSection *s = find_section(file, id);
+    int length = model_row_length(file->header->real_bits, id, cols);
+    if (s == NULL || s->count != (uint64_t)rows * length) return 0;
+
+    const char *src = (const char *)file->map + s->offset;
+    for (int r = 0; r < rows; r++)
+    {
+        real *row = dst + (size_t)r * stride;
+        size_t first = (size_t)r * length;
+        if (file->header->real_bits == REAL_BITS)
+            memcpy(row, (const real *)src + first, sizeof(real) * cols);
+        else if (file->header->real_bits == 32)
+            for (int c = 0; c < cols; c++)
+                row[c] = ((const float *)src)[first + c];
+        else
+            for (int c = 0; c < cols; c++)
+                row[c] = (real)((const double *)src)[first + c];
+    }
+    return 1;
+}
+
+// The n row steps of section id, checked to lie in [0, the saved step];
+// NULL if absent or out of range
+static const int64_t *row_steps(const ModelFile *file, ModelSectionId id, int n)
+{
+    const ModelSection *s = find_section(file, id);
+    if (s == NULL || s->count != (uint64_t)n) return NULL;
+    const int64_t *steps = (const int64_t *)((const char *)file->map + s->offset);
+    for (int k = 0; k < n; k++)
+        if (steps[k] < 0 || steps[k] > file->header->net_adam_t)
+            return NULL;
+    return steps;
+}
+
+int model_synced(const ModelFile *file)
+{
+    const ModelHeader *h = file->header;
+    if (!(h->flags & MODEL_OPTIMIZER)) return 1;
+    const int64_t *hidden = row_steps(file, MODEL_HIDDEN_ROW_STEP, h->inputs);
+    const int64_t *output = row_steps(file, MODEL_OUTPUT_ROW_STEP, h->hidden);
+    if (hidden == NULL || output == NULL) return 0;
+    for (int i = 0; i < h->inputs; i++)
+        if (hidden[i] != h->net_adam_t) return 0;
+    for (int j = 0; j < h->hidden; j++)
+        if (output[j] != h->net_adam_t) return 0;
+    return 1;
+}
+
+int model_read_synced(const ModelFile *file, ModelSectionId id, real *dst,
+                      int rows, int cols, int stride)
+{
+    if (!model_read(file, id, dst, rows, cols, stride)) return 0;
+    if ((id != MODEL_HIDDEN_WEIGHTS && id != MODEL_OUTPUT_WEIGHTS) || model_synced(file))
+        return 1;
+
+    const ModelHeader *h = file->header;
+    ModelSectionId m_id = id == MODEL_HIDDEN_WEIGHTS ? MODEL_M_HIDDEN_WEIGHTS
+                                                     : MODEL_M_OUTPUT_WEIGHTS;
+    ModelSectionId v_id = id == MODEL_HIDDEN_WEIGHTS ? MODEL_V_HIDDEN_WEIGHTS
+                                                     : MODEL_V_OUTPUT_WEIGHTS;
+    const int64_t *steps = row_steps(file, id == MODEL_HIDDEN_WEIGHTS
+                                           ? MODEL_HIDDEN_ROW_STEP
+                                           : MODEL_OUTPUT_ROW_STEP, rows);
+    if (steps == NULL) return 0;
+
+    real *moments = malloc(sizeof(real) * 2 * (size_t)rows * cols);
+    long *row_step = malloc(sizeof(long) * rows);
+    if (moments == NULL || row_step == NULL) errx(1, "Not enough memory!");
+    int ok = model_read(file, m_id, moments, rows, cols, cols)
+          && model_read(file, v_id, moments + (size_t)rows * cols, rows, cols, cols);
+    if (ok)
+    {
+        for (int r = 0; r < rows; r++)
+            row_step[r] = steps[r];
+        AdamCoeffs adam = adam_coeffs(h->net_eta, h->net_beta1_t, h->net_beta2_t);
+        if (!catch_up_copy(&adam, h->net_adam_t, dst, rows, cols, stride, moments,
+                           moments + (size_t)rows * cols, cols, row_step))
+            errx(1, "Not enough memory!");
+    }
+    free(row_step);
+    free(moments);
+    return ok;
+}
+
+// Every part present with its size before any is copied
+static int read_parts(const ModelFile *file, const ModelPart *parts, int n)
+{
+    for (int k = 0; k < n; k++)
+    {
+        if (is_row_steps(parts[k].id))
+        {
+            if (row_steps(file, parts[k].id, parts[k].cols) == NULL)
+                return 0;
+            continue;
+        }
+        const ModelSection *s = find_section(file, parts[k].id);
+        int length = model_row_length(file->header->real_bits, parts[k].id, parts[k].cols);
+        if (s == NULL || s->count != (uint64_t)parts[k].rows * length)
+            return 0;
+    }
+    for (int k = 0; k < n; k++)
+    {
+        if (is_row_steps(parts[k].id))
+        {
+            const int64_t *steps = row_steps(file, parts[k].id, parts[k].cols);
+            for (int c = 0; c < parts[k].cols; c++)
+                ((long *)parts[k].data)[c] = steps[c];
+            continue;
+        }
+        model_read(file, parts[k].id, parts[k].data,
+                   parts[k].rows, parts[k].cols, parts[k].stride);
+    }
+    return 1;
+}
+
+int model_load_cnn(const ModelFile *file, CNN *cnn)
+{
+    if (file == NULL || cnn == NULL) return 0;
+    const ModelHeader *h = file->header;
+    int optimizer = (h->flags & MODEL_OPTIMIZER) != 0;
+
+    ModelPart parts[MODEL_SECTION_IDS];
+    int n = cnn_parts(cnn, (CnnStage2)h->stage2, optimizer, parts);
+    if (!read_parts(file, parts, n)) return 0;
+
+    cnn->stage2 = (CnnStage2)h->stage2;
+    cnn->output_size = cnn_stage2_outputs(cnn->stage2);
+    if (optimizer)
+    {
+        cnn->adam_t = h->cnn_adam_t;
+        cnn->adam_beta1_t = h->cnn_beta1_t;
+        cnn->adam_beta2_t = h->cnn_beta2_t;
+    }
+    return 1;
+}
+
+int model_load_network(const ModelFile *file, struct network *net)
+{
+    if (file == NULL || net == NULL) return 0;
+    const ModelHeader *h = file->header;
+    int optimizer = (h->flags & MODEL_OPTIMIZER) != 0;
+    if (h->inputs != net->number_of_inputs || h->hidden != net->number_of_hidden_nodes
+        || h->outputs != net->number_of_outputs)
+        return 0;
+
+    ModelPart parts[MODEL_SECTION_IDS];
+    int n = network_parts(net, optimizer, parts);
+    if (!read_parts(file, parts, n)) return 0;
+
+    if (optimizer)
+    {
+        // Lazy rows resume from their saved steps
+        net->adam_t = h->net_adam_t;
+        net->adam_beta1_t = h->net_beta1_t;
+        net->adam_beta2_t = h->net_beta2_t;
+        net->eta = h->net_eta;
+        return 1;
+    }
+    // Files without optimizer state hold synced weights
+    for (int i = 0; i < net->number_of_inputs; i++)
+        net->hidden_row_step[i] = net->adam_t;
+    for (int j = 0; j < net->number_of_hidden_nodes; j++)
+        net->output_row_step[j] = net->adam_t;
+    return 1;
+}
@@ -0,0 +1,149 @@
+#ifndef MODELFILE_H
+#define MODELFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../common.h"
+#include "cnn.h"
+#include "network.h"
+
+// Binary model container: the CNN and the MLP in one file that is mapped,
+// not parsed. Layout, in the byte order of the machine that wrote it:
+//   ModelHeader, then section_count ModelSection entries, then the
+//   sections, each a raw array of real_bits-bit reals (int64 for the row
+//   steps) starting on a MODEL_ALIGN boundary and zero-padded to the next.
+// The checksum covers the whole file, the header with its checksum field
+// zeroed included, so a corrupt shape or offset is caught before any
+// section is read. Output-layer
+// sections (weights, bias and their moments) have their rows zero-padded
+// to a whole MODEL_ALIGN line, like NET_ROW_PAD() in memory, so a container
+// of the build's precision is used in place row for row.
+#define MODEL_MAGIC "OCRMODEL"
+#define MODEL_VERSION 3
+#define MODEL_ALIGN 64
+#define MODEL_BYTE_ORDER 0x01020304u
+
+// flags
+#define MODEL_OPTIMIZER 1u // Adam moments and step counters are saved, lazy
+                           // Adam rows as they are, with the step of each
+
+typedef struct
+{
+    char magic[8];          // MODEL_MAGIC, not NUL-terminated
+    uint32_t version;
+    uint32_t byte_order;    // MODEL_BYTE_ORDER as the writer saw it
+    uint32_t real_bits;     // 32 or 64
+    uint32_t flags;
+    uint32_t section_count;
+    int32_t stage2;         // CnnStage2
+    int32_t num_filters;
+    int32_t conv_size;
+    int32_t inputs;
+    int32_t hidden;
+    int32_t outputs;
+    int32_t reserved;
+    uint64_t checksum;      // FNV-1a 64 of the file, this field zeroed
+    uint64_t file_size;
+    int64_t cnn_adam_t;     // Adam steps and beta^t products, 0 and 1
+    int64_t net_adam_t;     // without MODEL_OPTIMIZER
+    double cnn_beta1_t;
+    double cnn_beta2_t;
+    double net_beta1_t;
+    double net_beta2_t;
+    double net_eta;         // learning rate the skipped lazy steps replay with
+} ModelHeader;
+
+typedef struct
+{
+    uint32_t id;            // ModelSectionId
+    uint32_t reserved;
+    uint64_t offset;        // from the start of the file, multiple of MODEL_ALIGN
+    uint64_t count;         // reals
+} ModelSection;
+
+typedef enum
+{
+    MODEL_CONV_BIAS,        // [NUM_FILTERS]
+    MODEL_FILTERS,          // [NUM_FILTERS][3][3]
+    MODEL_BIASES2,          // [STAGE2_FILTERS], only with a second stage
+    MODEL_FILTERS2,         // [STAGE2_WEIGHTS], same
+    MODEL_HIDDEN_BIAS,      // [H]
+    MODEL_HIDDEN_WEIGHTS,   // [I][H]
+    MODEL_OUTPUT_BIAS,      // [O]
+    MODEL_OUTPUT_WEIGHTS,   // [H][O]
+    // Adam moments of the above, only with MODEL_OPTIMIZER
+    MODEL_M_CONV_BIAS, MODEL_V_CONV_BIAS,
+    MODEL_M_FILTERS, MODEL_V_FILTERS,
+    MODEL_M_BIASES2, MODEL_V_BIASES2,
+    MODEL_M_FILTERS2, MODEL_V_FILTERS2,
+    MODEL_M_HIDDEN_BIAS, MODEL_V_HIDDEN_BIAS,
+    MODEL_M_HIDDEN_WEIGHTS, MODEL_V_HIDDEN_WEIGHTS,
+    MODEL_M_OUTPUT_BIAS, MODEL_V_OUTPUT_BIAS,
+    MODEL_M_OUTPUT_WEIGHTS, MODEL_V_OUTPUT_WEIGHTS,
+    // Last Adam step of each weight row, int64, only with MODEL_OPTIMIZER
+    MODEL_HIDDEN_ROW_STEP,  // [I]
+    MODEL_OUTPUT_ROW_STEP,  // [H]
+    MODEL_SECTION_IDS
+} ModelSectionId;
+
+// A container mapped read-only
+typedef struct
+{
+    void *map;
+    size_t size;
+    const ModelHeader *header;
+    const ModelSection *sections;
+} ModelFile;
+
+// Lays cnn and net out as a container in one malloc'ed block of *size
+// bytes. With `optimizer` set, the Adam state comes along and lazy rows are
+// saved as they are, with their steps; without it, the copied weights get
+// the steps lazy rows skipped replayed. cnn and net are not modified.
+// Returns NULL on OOM.
+void *model_pack(const CNN *cnn, const struct network *net, int optimizer,
+                 size_t *size);
+
+// model_pack() through write_file_atomic(). Returns the bytes written, 0 on
+// failure.
+size_t model_save(const char *filename, const CNN *cnn, const struct network *net,
+                  int optimizer);
+
+// Maps and checks a container (magic, version, byte order, checksum, shapes,
+// section bounds). Returns NULL if the file is missing or empty, and with
+// a message if it is incompatible, truncated or corrupt.
+ModelFile *model_open(const char *filename);
+void model_close(ModelFile *file);
+
+// Section id in place in the mapping when it holds `count` reals of this
+// build's precision; NULL otherwise.
+const real *model_section(const ModelFile *file, ModelSectionId id, size_t count);
+
+// Reals a stored row of `cols` reals of section id takes in a file of
+// real_bits-bit reals: cols, or the padded length for output-layer sections.
+int model_row_length(uint32_t real_bits, ModelSectionId id, int cols);
+
+// Copies section id (rows x cols reals, padding left out) into rows
+// `stride` reals apart, converting the precision if needed. Returns 0 if it
+// is missing or of another size.
+int model_read(const ModelFile *file, ModelSectionId id, real *dst,
+               int rows, int cols, int stride);
+
+// 1 if no weight row of the file lags behind the saved step (dense Adam,
+// or no optimizer state): its weights are then usable as they are.
+int model_synced(const ModelFile *file);
+
+// model_read() of MODEL_HIDDEN_WEIGHTS or MODEL_OUTPUT_WEIGHTS with the
+// steps lazy rows skipped replayed, as network_sync_optimizer() would.
+int model_read_synced(const ModelFile *file, ModelSectionId id, real *dst,
+                      int rows, int cols, int stride);
+
+// Load the CNN (its shape comes from the file) and the MLP, with their Adam
+// state when the file has it: lazy rows keep their saved steps, and net's
+// learning rate becomes the saved one (call network_sync_optimizer() before
+// using the weights outside training). model_load_network() needs net's
+// shape to match the file's. Both return 0 and leave the model untouched
+// on failure.
+int model_load_cnn(const ModelFile *file, CNN *cnn);
+int model_load_network(const ModelFile *file, struct network *net);
+
+#endif
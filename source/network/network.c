@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "kernels.h"
+#include "optimizer.h"
 #include "tools.h"
 
 
@@ -14,31 +16,8 @@ void freeNetwork(struct network *net)
     if (!net)
         return;
 
-    free(net->input_layer);
-    free(net->delta_input);
-
-    free(net->hidden_layer);
-    free(net->hidden_pre_activation);
-    free(net->delta_hidden);
-    free(net->hidden_layer_bias);
-    free(net->hidden_weights);
-    free(net->m_hidden_weights);
-    free(net->v_hidden_weights);
-    free(net->m_hidden_bias);
-    free(net->v_hidden_bias);
-
-    free(net->output_layer);
-    free(net->delta_output);
-    free(net->output_layer_bias);
-    free(net->output_weights);
-    free(net->m_output_weights);
-    free(net->v_output_weights);
-    free(net->m_output_bias);
-    free(net->v_output_bias);
-
-    free(net->goal);
-    free(net->dropout_mask);
-
+    // Every buffer lives in the arena
+    free(net->arena);
     free(net);
 }
 
@@ -48,93 +27,119 @@ void set_training_mode(struct network *net, int is_training)
         net->is_training = is_training;
 }
 
+size_t network_arena_bytes(const struct network *net)
+{
+    return net->arena_size;
+}
 
-struct network *InitializeNetwork(double i, double h, double o, char *filepath)
+void network_snapshot(const struct network *net, void *dst)
 {
-    struct network *network = malloc(sizeof(struct network));
-    if (network == NULL)
-    {
-        errx(1, "Not enough memory!");
-    }
-    network->number_of_inputs = i;
-    network->number_of_hidden_nodes = h;
-    network->number_of_outputs = o;
+    memcpy(dst, net->arena, net->arena_size);
+}
+
+void network_restore(struct network *net, const void *src)
+{
+    memcpy(net->arena, src, net->arena_size);
+}
+
+// One buffer carved from the network arena: the struct field to point at
+// it, its size in bytes, and whether it is model state (parameters and
+// optimizer state), which replicas share with their master.
+typedef struct
+{
+    void **field;
+    size_t bytes;
+    int shared;
+} ArenaSlot;
 
-    // Initialize all pointers to NULL to ensure safe cleanup on error
-    network->input_layer = NULL;
-    network->delta_input = NULL;
-    network->hidden_layer = NULL;
-    network->delta_hidden = NULL;
-    network->hidden_layer_bias = NULL;
-    network->hidden_weights = NULL;
-    network->m_hidden_weights = NULL;
-    network->v_hidden_weights = NULL;
-    network->m_hidden_bias = NULL;
-    network->v_hidden_bias = NULL;
-    network->output_layer = NULL;
-    network->delta_output = NULL;
-    network->output_layer_bias = NULL;
-    network->output_weights = NULL;
-    network->m_output_weights = NULL;
-    network->v_output_weights = NULL;
-    network->m_output_bias = NULL;
-    network->v_output_bias = NULL;
-    network->goal = NULL;
-    network->hidden_pre_activation = NULL;
-    network->dropout_mask = NULL;
-
-    network->input_layer = calloc(network->number_of_inputs, sizeof(double));
-    network->delta_input = calloc(network->number_of_inputs, sizeof(double));
-    if (network->input_layer == NULL || network->delta_input == NULL)
+#define ARENA_SLOT(field, count)   { (void **)&(field), (count) * sizeof(*(field)), 0 }
+#define ARENA_SHARED(field, count) { (void **)&(field), (count) * sizeof(*(field)), 1 }
+
+static size_t align_up(size_t n, size_t alignment)
+{
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+// Carves every buffer from one NET_ARENA_ALIGN-aligned block, laid out
+// hot-to-cold: parameters, then activations and per-sample gradients,
+// then the Adam moments that only the optimizer step touches. A replica
+// only gets the per-sample buffers.
+static void allocate_arena(struct network *net, int replica)
+{
+    size_t I = net->number_of_inputs;
+    size_t H = net->number_of_hidden_nodes;
+    size_t O = net->number_of_outputs;
+    size_t Os = net->output_stride;
+
+    ArenaSlot slots[] =
     {
-        freeNetwork(network);
-        errx(1, "Not enough memory!");
+        // Parameters
+        ARENA_SHARED(net->hidden_weights,      I * H),
+        ARENA_SHARED(net->hidden_layer_bias,   H),
+        ARENA_SHARED(net->output_weights,      H * Os),
+        ARENA_SHARED(net->output_layer_bias,   Os),
+
+        // Activations and gradients of the current sample
+        ARENA_SLOT(net->input_layer,           I),
+        ARENA_SLOT(net->hidden_layer,          H),
+        ARENA_SLOT(net->hidden_pre_activation, H),
+        ARENA_SLOT(net->dropout_mask,          RNG_MASK_WORDS(H)),
+        ARENA_SLOT(net->output_layer,          Os),
+        ARENA_SLOT(net->goal,                  O),
+        ARENA_SLOT(net->delta_output,          Os),
+        ARENA_SLOT(net->delta_hidden,          H),
+        ARENA_SLOT(net->delta_input,           I),
+        ARENA_SLOT(net->active_inputs,         I),
+
+        // Optimizer state
+        ARENA_SHARED(net->m_hidden_weights,    I * H),
+        ARENA_SHARED(net->v_hidden_weights,    I * H),
+        ARENA_SHARED(net->m_hidden_bias,       H),
+        ARENA_SHARED(net->v_hidden_bias,       H),
+        ARENA_SHARED(net->m_output_weights,    H * Os),
+        ARENA_SHARED(net->v_output_weights,    H * Os),
+        ARENA_SHARED(net->m_output_bias,       Os),
+        ARENA_SHARED(net->v_output_bias,       Os),
+        ARENA_SHARED(net->hidden_row_step,     I),
+        ARENA_SHARED(net->output_row_step,     H),
+    };
+    const size_t slot_count = sizeof(slots) / sizeof(slots[0]);
+
+    size_t offsets[sizeof(slots) / sizeof(slots[0])];
+    size_t size = 0;
+    for (size_t k = 0; k < slot_count; k++)
+    {
+        offsets[k] = size;
+        if (!(replica && slots[k].shared))
+            size = align_up(size + slots[k].bytes, NET_ARENA_ALIGN);
     }
 
-    int I = network->number_of_inputs;
-    int H = network->number_of_hidden_nodes;
-    int O = network->number_of_outputs;
-
-    network->hidden_layer           = calloc(H, sizeof(double));
-    network->hidden_pre_activation  = calloc(H, sizeof(double));
-    network->delta_hidden           = calloc(H, sizeof(double));
-    network->hidden_layer_bias      = calloc(H, sizeof(double));
-    network->hidden_weights         = calloc(I * H, sizeof(double));
-    network->m_hidden_weights       = calloc(I * H, sizeof(double));
-    network->v_hidden_weights       = calloc(I * H, sizeof(double));
-    network->m_hidden_bias          = calloc(H, sizeof(double));
-    network->v_hidden_bias          = calloc(H, sizeof(double));
-
-    if (network->hidden_layer == NULL || network->hidden_pre_activation == NULL ||
-        network->delta_hidden == NULL ||
-        network->hidden_layer_bias == NULL || network->hidden_weights == NULL ||
-        network->m_hidden_weights == NULL || network->v_hidden_weights == NULL ||
-        network->m_hidden_bias == NULL || network->v_hidden_bias == NULL)
+    net->arena = alloc_arena(size, NET_ARENA_ALIGN);
+    if (net->arena == NULL)
     {
-        freeNetwork(network);
+        free(net);
         errx(1, "Not enough memory!");
     }
+    net->arena_size = size;
 
-    network->output_layer       = calloc(O, sizeof(double));
-    network->delta_output       = calloc(O, sizeof(double));
-    network->output_layer_bias  = calloc(O, sizeof(double));
-    network->output_weights     = calloc(H * O, sizeof(double));
-    network->m_output_weights   = calloc(H * O, sizeof(double));
-    network->v_output_weights   = calloc(H * O, sizeof(double));
-    network->m_output_bias      = calloc(O, sizeof(double));
-    network->v_output_bias      = calloc(O, sizeof(double));
-    network->goal               = calloc(O, sizeof(double));
-    network->dropout_mask       = calloc(H, sizeof(double));
-
-    if (network->output_layer == NULL || network->delta_output == NULL ||
-        network->output_layer_bias == NULL || network->output_weights == NULL ||
-        network->m_output_weights == NULL || network->v_output_weights == NULL ||
-        network->m_output_bias == NULL || network->v_output_bias == NULL ||
-        network->goal == NULL || network->dropout_mask == NULL)
+    for (size_t k = 0; k < slot_count; k++)
+        if (!(replica && slots[k].shared))
+            *slots[k].field = (char *)net->arena + offsets[k];
+}
+
+struct network *InitializeNetwork(double i, double h, double o, char *filepath)
+{
+    struct network *network = calloc(1, sizeof(struct network));
+    if (network == NULL)
     {
-        freeNetwork(network);
         errx(1, "Not enough memory!");
     }
+    network->number_of_inputs = i;
+    network->number_of_hidden_nodes = h;
+    network->number_of_outputs = o;
+    network->output_stride = NET_ROW_PAD(network->number_of_outputs);
+
+    allocate_arena(network, 0);
 
     network->eta = 0.001;  // Adam default learning rate
 
@@ -146,14 +151,47 @@ struct network *InitializeNetwork(double i, double h, double o, char *filepath)
         if (!load_network(filepath, network))
             initialization(network);
     }
+    network_seed_dropout(network, rng_next(&rng_main));
     return network;
 }
 
+struct network *network_replica(const struct network *master)
+{
+    struct network *replica = calloc(1, sizeof(struct network));
+    if (replica == NULL)
+    {
+        errx(1, "Not enough memory!");
+    }
+    replica->number_of_inputs = master->number_of_inputs;
+    replica->number_of_hidden_nodes = master->number_of_hidden_nodes;
+    replica->number_of_outputs = master->number_of_outputs;
+    replica->output_stride = master->output_stride;
+
+    allocate_arena(replica, 1);
+
+    replica->hidden_weights = master->hidden_weights;
+    replica->hidden_layer_bias = master->hidden_layer_bias;
+    replica->output_weights = master->output_weights;
+    replica->output_layer_bias = master->output_layer_bias;
+
+    replica->eta = master->eta;
+    replica->dropout_rate = master->dropout_rate;
+    replica->is_training = master->is_training;
+    replica->dropout_rng = master->dropout_rng;
+    return replica;
+}
+
+void network_seed_dropout(struct network *net, uint64_t seed)
+{
+    rng_seed(&net->dropout_rng, seed);
+}
+
 void initialization(struct network *net)
 {
     int I = net->number_of_inputs;
     int H = net->number_of_hidden_nodes;
     int O = net->number_of_outputs;
+    int Os = net->output_stride;
 
     // He initialization for hidden layer (ReLU)
     for (int i = 0; i < I; i++)
@@ -174,7 +212,7 @@ void initialization(struct network *net)
     {
         for (int l = 0; l < O; l++)
         {
-            net->output_weights[k * O + l] =
+            net->output_weights[k * Os + l] =
                 init_weight_xavier(H, O);
         }
     }
@@ -183,15 +221,17 @@ void initialization(struct network *net)
         net->output_layer_bias[l] = 0.0;
 
     // Reset Adam moment buffers and timestep
-    memset(net->m_hidden_weights, 0, sizeof(double) * I * H);
-    memset(net->v_hidden_weights, 0, sizeof(double) * I * H);
-    memset(net->m_hidden_bias,    0, sizeof(double) * H);
-    memset(net->v_hidden_bias,    0, sizeof(double) * H);
-
-    memset(net->m_output_weights, 0, sizeof(double) * H * O);
-    memset(net->v_output_weights, 0, sizeof(double) * H * O);
-    memset(net->m_output_bias,    0, sizeof(double) * O);
-    memset(net->v_output_bias,    0, sizeof(double) * O);
+    memset(net->m_hidden_weights, 0, sizeof(real) * I * H);
+    memset(net->v_hidden_weights, 0, sizeof(real) * I * H);
+    memset(net->m_hidden_bias,    0, sizeof(real) * H);
+    memset(net->v_hidden_bias,    0, sizeof(real) * H);
+
+    memset(net->m_output_weights, 0, sizeof(real) * H * Os);
+    memset(net->v_output_weights, 0, sizeof(real) * H * Os);
+    memset(net->m_output_bias,    0, sizeof(real) * Os);
+    memset(net->v_output_bias,    0, sizeof(real) * Os);
+    memset(net->hidden_row_step,  0, sizeof(long) * I);
+    memset(net->output_row_step,  0, sizeof(long) * H);
 
     net->adam_t      = 0;
     net->adam_beta1_t = 1.0;
@@ -201,24 +241,33 @@ void initialization(struct network *net)
 }
 
 
-void forward_pass(struct network *net)
+// Lazy Adam: brings the weight rows an active unit reads up to the current
+// step before the forward pass uses them, so training sees the same
+// weights as with dense Adam. Mini-batch training does it for the whole
+// batch with network_catch_up_batch().
+static void catch_up_active_rows(const struct network *net, real *w, real *m,
+                                 real *v, long *row_step, const real *units,
+                                 int rows, int n)
 {
-    int H = net->number_of_hidden_nodes;
-    int O = net->number_of_outputs;
+    // Replicas (row_step == NULL) are caught up by network_catch_up_batch()
+    if (!net->is_training || optimizer_mode != OPTIMIZER_LAZY_ADAM || row_step == NULL)
+        return;
 
-    // Hidden layer — initialize with biases
-    for (int j = 0; j < H; j++)
-        net->hidden_layer[j] = net->hidden_layer_bias[j];
+    AdamCoeffs adam = adam_coeffs(net->eta, net->adam_beta1_t, net->adam_beta2_t);
+    for (int r = 0; r < rows; r++)
+        if (units[r] != 0.0 && row_step[r] < net->adam_t)
+            adam_catch_up_row(&adam, net->adam_t, w + (size_t)r * n,
+                              m + (size_t)r * n, v + (size_t)r * n, n,
+                              row_step + r);
+}
 
-    // Accumulate: i outer, j inner -> sequential access to hidden_weights row i
-    for (int i = 0; i < net->number_of_inputs; i++)
-    {
-        double in_i = net->input_layer[i];
-        if (in_i == 0.0) continue;
-        double *w_row = net->hidden_weights + i * H;
-        for (int j = 0; j < H; j++)
-            net->hidden_layer[j] += in_i * w_row[j];
-    }
+// Shared tail of the single-sample forward passes: activation, dropout and
+// output layer, once hidden_layer holds the pre-activation sums.
+static void forward_from_hidden(struct network *net)
+{
+    int H = net->number_of_hidden_nodes;
+    int O = net->number_of_outputs;
+    int Os = net->output_stride;
 
     for (int j = 0; j < H; j++)
     {
@@ -226,30 +275,37 @@ void forward_pass(struct network *net)
         net->hidden_layer[j] = relu(net->hidden_layer[j]);
     }
 
-    // Apply dropout during training
+    // Apply dropout during training: one bulk draw of the keep bits
     if (net->is_training && net->dropout_rate > 0.0)
     {
-        double scale = 1.0 / (1.0 - net->dropout_rate);
+        real scale = (real)(1.0 / (1.0 - net->dropout_rate));
+        rng_bernoulli_mask(&net->dropout_rng, net->dropout_mask, H,
+                           1.0 - net->dropout_rate);
         for (int j = 0; j < H; j++)
-        {
-            // Bernoulli dropout: keep with probability (1 - dropout_rate)
-            double keep = ((double)rand() / RAND_MAX) > net->dropout_rate ? 1.0 : 0.0;
-            net->dropout_mask[j] = keep;
-            net->hidden_layer[j] *= keep * scale;
-        }
+            net->hidden_layer[j] *= RNG_MASK_BIT(net->dropout_mask, j) ? scale : 0;
     }
 
-    // Output layer — initialize with biases
-    for (int o = 0; o < O; o++)
-        net->output_layer[o] = net->output_layer_bias[o];
+    catch_up_active_rows(net, net->output_weights, net->m_output_weights,
+                         net->v_output_weights, net->output_row_step,
+                         net->hidden_layer, H, Os);
 
-    // Accumulate: h outer, o inner -> sequential access to output_weights row h
-    for (int h = 0; h < H; h++)
+    const ShapeKernels *shape = kernels_for_shape(net->number_of_inputs, H, O);
+    if (shape != NULL)
+    {
+        shape->output_layer(net->output_layer, net->output_layer_bias,
+                            net->hidden_layer, net->output_weights);
+    }
+    else
     {
-        double hid_h = net->hidden_layer[h];
-        double *w_row = net->output_weights + h * O;
-        for (int o = 0; o < O; o++)
-            net->output_layer[o] += hid_h * w_row[o];
+        // Output layer — initialize with biases (padding included)
+        for (int o = 0; o < Os; o++)
+            net->output_layer[o] = net->output_layer_bias[o];
+
+        // Accumulate: h outer, o inner -> sequential access to output_weights row h
+        for (int h = 0; h < H; h++)
+        {
+            kernels.axpy(net->output_layer, net->hidden_layer[h], net->output_weights + h * Os, Os);
+        }
     }
 
     if (O == 1)
@@ -265,109 +321,382 @@ void forward_pass(struct network *net)
 }
 
 
-void back_propagation(struct network *net)
+void forward_pass(struct network *net)
 {
     int H = net->number_of_hidden_nodes;
-    int O = net->number_of_outputs;
-    double eta = net->eta;
 
-    // Advance Adam timestep; update running beta^t products
-    net->adam_t += 1;
-    net->adam_beta1_t *= ADAM_BETA1;
-    net->adam_beta2_t *= ADAM_BETA2;
+    catch_up_active_rows(net, net->hidden_weights, net->m_hidden_weights,
+                         net->v_hidden_weights, net->hidden_row_step,
+                         net->input_layer, net->number_of_inputs, H);
+
+    const ShapeKernels *shape = kernels_for_shape(net->number_of_inputs, H,
+                                                  net->number_of_outputs);
+    if (shape != NULL)
+    {
+        shape->hidden_layer(net->hidden_layer, net->hidden_layer_bias,
+                            net->input_layer, net->hidden_weights);
+        forward_from_hidden(net);
+        return;
+    }
+
+    // Hidden layer — initialize with biases
+    for (int j = 0; j < H; j++)
+        net->hidden_layer[j] = net->hidden_layer_bias[j];
+
+    // Accumulate: i outer, j inner -> sequential access to hidden_weights row i
+    for (int i = 0; i < net->number_of_inputs; i++)
+    {
+        real in_i = net->input_layer[i];
+        if (in_i == 0.0) continue;
+        kernels.axpy(net->hidden_layer, in_i, net->hidden_weights + i * H, H);
+    }
+
+    forward_from_hidden(net);
+}
+
+void forward_pass_sparse(struct network *net, const int *indices,
+                         const real *values, int nnz)
+{
+    int H = net->number_of_hidden_nodes;
+
+    for (int j = 0; j < H; j++)
+        net->hidden_layer[j] = net->hidden_layer_bias[j];
+
+    // Gather only the rows of hidden_weights that have a non-zero input
+    for (int k = 0; k < nnz; k++)
+        kernels.axpy(net->hidden_layer, values[k],
+                     net->hidden_weights + (size_t)indices[k] * H, H);
+
+    forward_from_hidden(net);
+}
+
 
-    // Precompute inverse bias corrections (avoids division in inner loops)
-    double inv_bc1 = 1.0 / (1.0 - net->adam_beta1_t);
-    double inv_bc2 = 1.0 / (1.0 - net->adam_beta2_t);
+// Glyphs per tile in forward_pass_batch(): every weight row is loaded once
+// and applied to the whole tile, whose accumulators (TILE x H) stay in L1.
+#define FORWARD_BATCH_TILE 16
 
-    // Output layer delta (Softmax + Cross Entropy combined gradient)
+// out[t][k] = bias[k] + sum_i in[t][i] * w[i][k] for the t < T rows of a tile.
+// Input rows are `in_stride` apart, weight rows `ldw` apart, accumulator
+// rows `K` apart.
+static void dense_tile(const real *in, int in_stride, int T, int n_in,
+                       const real *w, int ldw, const real *bias, int K, real *acc)
+{
+    for (int t = 0; t < T; t++)
+        memcpy(acc + t * K, bias, sizeof(real) * K);
+
+    for (int i = 0; i < n_in; i++)
+    {
+        const real *w_row = w + (size_t)i * ldw;
+        for (int t = 0; t < T; t++)
+        {
+            real in_i = in[(size_t)t * in_stride + i];
+            if (in_i == 0.0) continue;
+            kernels.axpy(acc + t * K, in_i, w_row, K);
+        }
+    }
+}
+
+MlpWeights network_weights(const struct network *net)
+{
+    MlpWeights w =
+    {
+        net->number_of_inputs, net->number_of_hidden_nodes, net->number_of_outputs,
+        net->output_stride, net->hidden_weights, net->hidden_layer_bias,
+        net->output_weights, net->output_layer_bias
+    };
+    return w;
+}
+
+void forward_pass_batch(struct network *net, const real *inputs, int n,
+                        real *outputs)
+{
+    MlpWeights w = network_weights(net);
+    mlp_forward_batch(&w, inputs, n, outputs);
+}
+
+// ReLU of T rows of hidden pre-activations (in place), then the output
+// layer and its activation. The output rows are accumulated whole, padding
+// included, in logits ([T][output_stride]); out gets the O real columns.
+static void output_tile(const MlpWeights *w, real *hidden, int T, real *logits,
+                        real *out)
+{
+    int H = w->number_of_hidden_nodes;
+    int O = w->number_of_outputs;
+    int Os = w->output_stride;
+
+    for (int j = 0; j < T * H; j++)
+        hidden[j] = relu(hidden[j]);
+
+    dense_tile(hidden, H, T, H, w->output_weights, Os, w->output_layer_bias, Os, logits);
+    for (int t = 0; t < T; t++)
+    {
+        real *row = logits + (size_t)t * Os;
+        if (O == 1)
+            row[0] = sigmoid(row[0]);
+        else
+            softmax(row, O);
+        memcpy(out + (size_t)t * O, row, sizeof(real) * O);
+    }
+}
+
+void mlp_forward_batch(const MlpWeights *w, const real *inputs, int n,
+                       real *outputs)
+{
+    int I = w->number_of_inputs;
+    int H = w->number_of_hidden_nodes;
+    int O = w->number_of_outputs;
+
+    real *hidden = malloc(sizeof(real) * FORWARD_BATCH_TILE * H);
+    real *logits = malloc(sizeof(real) * FORWARD_BATCH_TILE * w->output_stride);
+    if (hidden == NULL || logits == NULL)
+        errx(1, "Not enough memory!");
+
+    for (int start = 0; start < n; start += FORWARD_BATCH_TILE)
+    {
+        int T = n - start < FORWARD_BATCH_TILE ? n - start : FORWARD_BATCH_TILE;
+        const real *in = inputs + (size_t)start * I;
+        real *out = outputs + (size_t)start * O;
+
+        dense_tile(in, I, T, I, w->hidden_weights, H, w->hidden_layer_bias, H, hidden);
+        output_tile(w, hidden, T, logits, out);
+    }
+
+    free(logits);
+    free(hidden);
+}
+
+void mlp_output_batch(const MlpWeights *w, real *hidden, int n, real *outputs)
+{
+    int H = w->number_of_hidden_nodes;
+    int O = w->number_of_outputs;
+
+    real *logits = malloc(sizeof(real) * FORWARD_BATCH_TILE * w->output_stride);
+    if (logits == NULL)
+        errx(1, "Not enough memory!");
+
+    for (int start = 0; start < n; start += FORWARD_BATCH_TILE)
+    {
+        int T = n - start < FORWARD_BATCH_TILE ? n - start : FORWARD_BATCH_TILE;
+        output_tile(w, hidden + (size_t)start * H, T, logits,
+                    outputs + (size_t)start * O);
+    }
+
+    free(logits);
+}
+
+
+void back_propagation_deltas(struct network *net)
+{
+    int H = net->number_of_hidden_nodes;
+    int O = net->number_of_outputs;
+    int Os = net->output_stride;
+
+    // Output layer delta (Softmax + Cross Entropy combined gradient); the
+    // padding columns stay zero
     for (int o = 0; o < O; o++)
         net->delta_output[o] = net->output_layer[o] - net->goal[o];
 
-    // Hidden layer delta
+    // Hidden layer delta. The ReLU is leaky, so only dropout cuts a unit
+    // off (only backprop through kept neurons)
+    const ShapeKernels *shape = kernels_for_shape(net->number_of_inputs, H, O);
+    int dropout = net->is_training && net->dropout_rate > 0.0;
     for (int h = 0; h < H; h++)
     {
-        double sum = 0.0;
-        double *w_row = net->output_weights + h * O;
-        for (int o = 0; o < O; o++)
-            sum += w_row[o] * net->delta_output[o];
+        if (dropout && !RNG_MASK_BIT(net->dropout_mask, h))
+        {
+            net->delta_hidden[h] = 0;
+            continue;
+        }
+        const real *w_row = net->output_weights + h * Os;
+        real sum = shape != NULL ? shape->output_dot(w_row, net->delta_output)
+                                 : kernels.dot(w_row, net->delta_output, Os);
         net->delta_hidden[h] = sum * dRelu(net->hidden_pre_activation[h]);
-
-        // Apply dropout mask to gradients (only backprop through kept neurons)
-        if (net->is_training && net->dropout_rate > 0.0)
-            net->delta_hidden[h] *= net->dropout_mask[h] / (1.0 - net->dropout_rate);
+        if (dropout)
+            net->delta_hidden[h] *= (real)(1.0 / (1.0 - net->dropout_rate));
     }
 
     // Compute input gradients for CNN BEFORE updating hidden_weights,
-    // so we use the same W that produced the forward pass.
+    // so we use the same W that produced the forward pass. Only non-zero
+    // inputs, listed branch-free; the dots stay H wide, since with 70% of
+    // the units kept a full vector dot beats gathering the kept ones.
+    int active = 0;
     for (int i = 0; i < net->number_of_inputs; i++)
     {
-        double sum = 0.0;
-        double *w_row = net->hidden_weights + i * H;
-        for (int h = 0; h < H; h++)
-            sum += w_row[h] * net->delta_hidden[h];
-        net->delta_input[i] = sum;
+        net->delta_input[i] = 0;
+        net->active_inputs[active] = i;
+        active += net->input_layer[i] != 0;
     }
+    if (shape != NULL)
+        shape->input_dots(net->delta_input, net->hidden_weights, net->active_inputs,
+                          active, net->delta_hidden);
+    else
+        kernels.dot_rows(net->delta_input, net->hidden_weights, H, net->active_inputs,
+                         active, net->delta_hidden, H);
+}
+
+void back_propagation(struct network *net)
+{
+    int I = net->number_of_inputs;
+    int H = net->number_of_hidden_nodes;
+    int Os = net->output_stride;
+
+    back_propagation_deltas(net);
 
-    // Update output weights with Adam
+    AdamCoeffs adam = network_begin_step(net);
+    long t = net->adam_t;
+
+    // Row h of the output weights has gradient delta_output * hidden_layer[h]
+    // (zero in the padding, which therefore stays zero)
     for (int h = 0; h < H; h++)
+        adam_update_row(&adam, t, net->output_weights + h * Os,
+                        net->m_output_weights + h * Os, net->v_output_weights + h * Os,
+                        net->delta_output, net->hidden_layer[h], Os,
+                        net->output_row_step + h);
+    adam_update(&adam, net->output_layer_bias, net->m_output_bias,
+                net->v_output_bias, net->delta_output, 1, Os);
+
+    // Row i of the hidden weights has gradient delta_hidden * input_layer[i]
+    for (int i = 0; i < I; i++)
+        adam_update_row(&adam, t, net->hidden_weights + i * H,
+                        net->m_hidden_weights + i * H, net->v_hidden_weights + i * H,
+                        net->delta_hidden, net->input_layer[i], H,
+                        net->hidden_row_step + i);
+    adam_update(&adam, net->hidden_layer_bias, net->m_hidden_bias,
+                net->v_hidden_bias, net->delta_hidden, 1, H);
+}
+
+AdamCoeffs network_begin_step(struct network *net)
+{
+    return adam_begin_step(net->eta, &net->adam_t,
+                           &net->adam_beta1_t, &net->adam_beta2_t);
+}
+
+// Row r of a batch gradient given in factored form: hidden_weights row r of
+// sample s is input_layer[r] * delta_hidden, output_weights row r is
+// hidden_layer[r] * delta_output. Summed in sample order into acc. Returns
+// 0 if no sample touches the row.
+static int batch_row_gradient(real *acc, struct network *const *samples,
+                              int count, int output_layer, int r, int n)
+{
+    int active = 0;
+    memset(acc, 0, sizeof(real) * n);
+    for (int s = 0; s < count; s++)
     {
-        double hid_h = net->hidden_layer[h];
-        if (hid_h == 0.0) continue;
-        double *w_row  = net->output_weights    + h * O;
-        double *m_row  = net->m_output_weights  + h * O;
-        double *v_row  = net->v_output_weights  + h * O;
-        for (int o = 0; o < O; o++)
-        {
-            double grad = net->delta_output[o] * hid_h;
-            m_row[o] = ADAM_BETA1 * m_row[o] + (1.0 - ADAM_BETA1) * grad;
-            v_row[o] = ADAM_BETA2 * v_row[o] + (1.0 - ADAM_BETA2) * grad * grad;
-            double m_hat = m_row[o] * inv_bc1;
-            double v_hat = v_row[o] * inv_bc2;
-            w_row[o] -= eta * m_hat / (my_sqrt(v_hat) + ADAM_EPS);
-        }
+        const struct network *x = samples[s];
+        real a = output_layer ? x->hidden_layer[r] : x->input_layer[r];
+        if (a == 0.0) continue;
+        kernels.axpy(acc, a, output_layer ? x->delta_output : x->delta_hidden, n);
+        active = 1;
     }
+    return active;
+}
 
-    // Update output biases with Adam
-    for (int o = 0; o < O; o++)
+void network_batch_step(struct network *net, const AdamCoeffs *adam,
+                        struct network *const *samples, int count,
+                        int part, int parts, real *scratch)
+{
+    int I = net->number_of_inputs;
+    int H = net->number_of_hidden_nodes;
+    int Os = net->output_stride;
+    long t = net->adam_t;
+    real mean = (real)(1.0 / count);
+
+    // Hidden rows are split evenly; each row's sum order is fixed, so the
+    // result does not depend on how many parts run it
+    int first = (int)((long)I * part / parts);
+    int last = (int)((long)I * (part + 1) / parts);
+    for (int i = first; i < last; i++)
     {
-        double grad = net->delta_output[o];
-        net->m_output_bias[o] = ADAM_BETA1 * net->m_output_bias[o] + (1.0 - ADAM_BETA1) * grad;
-        net->v_output_bias[o] = ADAM_BETA2 * net->v_output_bias[o] + (1.0 - ADAM_BETA2) * grad * grad;
-        double m_hat = net->m_output_bias[o] * inv_bc1;
-        double v_hat = net->v_output_bias[o] * inv_bc2;
-        net->output_layer_bias[o] -= eta * m_hat / (my_sqrt(v_hat) + ADAM_EPS);
+        int active = batch_row_gradient(scratch, samples, count, 0, i, H);
+        adam_update_row(adam, t, net->hidden_weights + i * H,
+                        net->m_hidden_weights + i * H, net->v_hidden_weights + i * H,
+                        scratch, active ? mean : 0, H, net->hidden_row_step + i);
     }
 
-    // Update hidden weights with Adam
-    for (int i = 0; i < net->number_of_inputs; i++)
+    first = (int)((long)H * part / parts);
+    last = (int)((long)H * (part + 1) / parts);
+    for (int h = first; h < last; h++)
     {
-        double in_i = net->input_layer[i];
-        if (in_i == 0.0) continue;
-        double *w_row  = net->hidden_weights    + i * H;
-        double *m_row  = net->m_hidden_weights  + i * H;
-        double *v_row  = net->v_hidden_weights  + i * H;
-        for (int h = 0; h < H; h++)
-        {
-            double grad = net->delta_hidden[h] * in_i;
-            m_row[h] = ADAM_BETA1 * m_row[h] + (1.0 - ADAM_BETA1) * grad;
-            v_row[h] = ADAM_BETA2 * v_row[h] + (1.0 - ADAM_BETA2) * grad * grad;
-            double m_hat = m_row[h] * inv_bc1;
-            double v_hat = v_row[h] * inv_bc2;
-            w_row[h] -= eta * m_hat / (my_sqrt(v_hat) + ADAM_EPS);
-        }
+        int active = batch_row_gradient(scratch, samples, count, 1, h, Os);
+        adam_update_row(adam, t, net->output_weights + h * Os,
+                        net->m_output_weights + h * Os, net->v_output_weights + h * Os,
+                        scratch, active ? mean : 0, Os, net->output_row_step + h);
     }
 
-    // Update hidden biases with Adam
-    for (int h = 0; h < H; h++)
+    if (part != 0) return;
+
+    // Bias gradients are the deltas themselves
+    memset(scratch, 0, sizeof(real) * H);
+    for (int s = 0; s < count; s++)
+        kernels.axpy(scratch, 1, samples[s]->delta_hidden, H);
+    adam_update(adam, net->hidden_layer_bias, net->m_hidden_bias,
+                net->v_hidden_bias, scratch, mean, H);
+
+    memset(scratch, 0, sizeof(real) * Os);
+    for (int s = 0; s < count; s++)
+        kernels.axpy(scratch, 1, samples[s]->delta_output, Os);
+    adam_update(adam, net->output_layer_bias, net->m_output_bias,
+                net->v_output_bias, scratch, mean, Os);
+}
+
+void network_catch_up_batch(struct network *net, struct network *const *samples,
+                            int count, int part, int parts)
+{
+    if (optimizer_mode != OPTIMIZER_LAZY_ADAM)
+        return;
+
+    int I = net->number_of_inputs;
+    int H = net->number_of_hidden_nodes;
+    int Os = net->output_stride;
+    long t = net->adam_t;
+    AdamCoeffs adam = adam_coeffs(net->eta, net->adam_beta1_t, net->adam_beta2_t);
+
+    int first = (int)((long)I * part / parts);
+    int last = (int)((long)I * (part + 1) / parts);
+    for (int i = first; i < last; i++)
     {
-        double grad = net->delta_hidden[h];
-        net->m_hidden_bias[h] = ADAM_BETA1 * net->m_hidden_bias[h] + (1.0 - ADAM_BETA1) * grad;
-        net->v_hidden_bias[h] = ADAM_BETA2 * net->v_hidden_bias[h] + (1.0 - ADAM_BETA2) * grad * grad;
-        double m_hat = net->m_hidden_bias[h] * inv_bc1;
-        double v_hat = net->v_hidden_bias[h] * inv_bc2;
-        net->hidden_layer_bias[h] -= eta * m_hat / (my_sqrt(v_hat) + ADAM_EPS);
+        if (net->hidden_row_step[i] >= t)
+            continue;
+        int s = 0;
+        while (s < count && samples[s]->input_layer[i] == 0.0)
+            s++;
+        if (s < count)
+            adam_catch_up_row(&adam, t, net->hidden_weights + i * H,
+                              net->m_hidden_weights + i * H,
+                              net->v_hidden_weights + i * H, H,
+                              net->hidden_row_step + i);
     }
+
+    // Which units dropout keeps is only known during the forward pass
+    first = (int)((long)H * part / parts);
+    last = (int)((long)H * (part + 1) / parts);
+    for (int h = first; h < last; h++)
+        adam_catch_up_row(&adam, t, net->output_weights + h * Os,
+                          net->m_output_weights + h * Os, net->v_output_weights + h * Os,
+                          Os, net->output_row_step + h);
+}
+
+void network_catch_up(struct network *net)
+{
+    network_catch_up_batch(net, &net, 1, 0, 1);
+}
+
+void network_sync_optimizer(struct network *net)
+{
+    int I = net->number_of_inputs;
+    int H = net->number_of_hidden_nodes;
+    int Os = net->output_stride;
+    long t = net->adam_t;
+    AdamCoeffs adam = adam_coeffs(net->eta, net->adam_beta1_t, net->adam_beta2_t);
+
+    for (int h = 0; h < H; h++)
+        adam_catch_up_row(&adam, t, net->output_weights + h * Os,
+                          net->m_output_weights + h * Os, net->v_output_weights + h * Os,
+                          Os, net->output_row_step + h);
+    for (int i = 0; i < I; i++)
+        adam_catch_up_row(&adam, t, net->hidden_weights + i * H,
+                          net->m_hidden_weights + i * H, net->v_hidden_weights + i * H,
+                          H, net->hidden_row_step + i);
 }
 
 
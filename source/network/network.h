@@ -2,61 +2,169 @@
 #define NN_H_
 
 #include <stddef.h>
+#include "../common.h"
+#include "kernels.h"
+#include "rng.h"
+
+// Alignment of the arena and of every buffer carved from it (one cache
+// line, one AVX-512 register).
+#define NET_ARENA_ALIGN 64
+
+// Reals per arena line. Output-layer rows (weights, their moments, the
+// biases and the output activations) are padded with zero columns to a
+// whole number of lines, so every row starts on a line and the SIMD loops
+// over it have no remainder. Weight files keep the unpadded layout.
+#define NET_LINE_REALS ((int)(NET_ARENA_ALIGN / sizeof(real)))
+#define NET_ROW_PAD(n) (((n) + NET_LINE_REALS - 1) / NET_LINE_REALS * NET_LINE_REALS)
+
 struct network
 {
+    // Single allocation backing every buffer below; see InitializeNetwork()
+    void *arena;
+    size_t arena_size;
+
     int number_of_inputs;
     int number_of_hidden_nodes;
     int number_of_outputs;
-    double *input_layer;
-    double *delta_input; // Gradients for the input layer (needed for CNN backprop)
+    int output_stride; // NET_ROW_PAD(number_of_outputs): row length of output_weights
+    real *input_layer;
+    real *delta_input; // Gradients for the input layer (needed for CNN backprop)
 
-    double *hidden_layer;
-    double *delta_hidden;
-    double *hidden_layer_bias;
-    double *hidden_weights;
+    real *hidden_layer;
+    real *delta_hidden;
+    real *hidden_layer_bias;
+    real *hidden_weights;
 
     // Adam moment buffers for hidden weights
-    double *m_hidden_weights; // 1st moment
-    double *v_hidden_weights; // 2nd moment
+    real *m_hidden_weights; // 1st moment
+    real *v_hidden_weights; // 2nd moment
 
     // Adam moment buffers for hidden biases
-    double *m_hidden_bias;
-    double *v_hidden_bias;
+    real *m_hidden_bias;
+    real *v_hidden_bias;
 
-    double *output_layer;
-    double *delta_output;
-    double *output_layer_bias;
-    double *output_weights;
+    real *output_layer;
+    real *delta_output;
+    real *output_layer_bias;
+    real *output_weights;
 
     // Adam moment buffers for output weights
-    double *m_output_weights; // 1st moment
-    double *v_output_weights; // 2nd moment
+    real *m_output_weights; // 1st moment
+    real *v_output_weights; // 2nd moment
 
     // Adam moment buffers for output biases
-    double *m_output_bias;
-    double *v_output_bias;
+    real *m_output_bias;
+    real *v_output_bias;
 
-    double *hidden_pre_activation;
+    real *hidden_pre_activation;
+    int *active_inputs; // Non-zero inputs of the current sample (backprop scratch)
 
     double eta;         // Learning rate
     long adam_t;        // Adam timestep counter
     double adam_beta1_t; // ADAM_BETA1^t (running product for bias correction)
     double adam_beta2_t; // ADAM_BETA2^t (running product for bias correction)
 
-    double *goal;
-    double *dropout_mask; // Dropout mask for hidden layer
+    // Last Adam step applied to each weight row, for lazy Adam (optimizer.h)
+    long *hidden_row_step; // [I]
+    long *output_row_step; // [H]
+
+    real *goal;
+    uint64_t *dropout_mask; // Dropout keep bits for the hidden layer, RNG_MASK_WORDS(H) words
     double dropout_rate;  // Dropout probability (0.0 = no dropout)
     int is_training;      // Flag to enable/disable dropout
+    Rng dropout_rng;      // Dropout stream, see network_seed_dropout()
 };
 
+// Read-only view of the dense-layer parameters, shared by struct network
+// and the frozen InferenceModel so both run the same inference kernels.
+typedef struct
+{
+    int number_of_inputs;
+    int number_of_hidden_nodes;
+    int number_of_outputs;
+    int output_stride;             // NET_ROW_PAD(O): row length of output_weights
+    const real *hidden_weights;    // [I][H]
+    const real *hidden_layer_bias; // [H]
+    const real *output_weights;    // [H][output_stride], zero padding columns
+    const real *output_layer_bias; // [output_stride], same
+} MlpWeights;
+
 struct network *InitializeNetwork(double i, double h, double o, char *filepath);
 
+// Training replica of master: own activation and delta buffers, weights and
+// biases shared with master (no optimizer state). Free with freeNetwork().
+struct network *network_replica(const struct network *master);
+
+// Dropout masks are drawn from a per-network stream, so replicas running on
+// different threads stay independent and reproducible.
+void network_seed_dropout(struct network *net, uint64_t seed);
+
 void initialization(struct network *net);
 
 void forward_pass(struct network *net);
 
+// forward_pass() for a sparse input given as nnz (index, value) pairs with
+// ascending indices, e.g. from cnn_forward_infer_sparse(). Only the matching
+// rows of hidden_weights are read; input_layer is left untouched, so this
+// is meant for inference (back_propagation() reads input_layer).
+void forward_pass_sparse(struct network *net, const int *indices,
+                         const real *values, int nnz);
+
+// Inference-only forward pass over n samples at once: inputs is an
+// [n][number_of_inputs] block, outputs receives [n][number_of_outputs].
+// Weights are streamed once per tile of samples; dropout is never applied.
+void forward_pass_batch(struct network *net, const real *inputs, int n,
+                        real *outputs);
+
+// forward_pass_batch() on a bare weight view.
+void mlp_forward_batch(const MlpWeights *w, const real *inputs, int n,
+                       real *outputs);
+
+// Second half of mlp_forward_batch(), for callers that computed the hidden
+// pre-activations ([n][number_of_hidden_nodes], ReLU'd in place) themselves.
+void mlp_output_batch(const MlpWeights *w, real *hidden, int n, real *outputs);
+
+MlpWeights network_weights(const struct network *net);
+
 void back_propagation(struct network *net);
 
+// First half of back_propagation(): fills delta_output, delta_hidden and
+// delta_input without touching the weights. Only the hidden units kept by
+// dropout and the non-zero inputs are computed; the others get a zero
+// delta. A zero input is a feature the CNN's ReLU cut,
+// which passes no gradient back anyway.
+void back_propagation_deltas(struct network *net);
+
+// Advances the Adam timestep of net and returns its coefficients.
+AdamCoeffs network_begin_step(struct network *net);
+
+// Mini-batch Adam step from `count` replicas that each ran forward_pass()
+// and back_propagation_deltas() on one sample; the gradient is their mean,
+// summed in sample order. The rows are split into `parts` so that workers
+// can run part 0..parts-1 concurrently (part 0 also updates the biases);
+// the result does not depend on `parts`. scratch holds
+// max(H, output_stride) reals.
+void network_batch_step(struct network *net, const AdamCoeffs *adam,
+                        struct network *const *samples, int count,
+                        int part, int parts, real *scratch);
+
+// Lazy Adam, mini-batch training: catches up the rows the `count` replicas
+// are about to read, i.e. the hidden rows with a non-zero input in any of
+// them (their input_layer must be filled) and every output row. Replicas
+// do not catch up themselves, so this runs before their forward passes.
+// Split by rows like network_batch_step(); a no-op with dense Adam.
+void network_catch_up_batch(struct network *net, struct network *const *samples,
+                            int count, int part, int parts);
+
+// Per-sample training: network_catch_up_batch() of net's own input, before
+// its forward_pass().
+void network_catch_up(struct network *net);
+
+// Replays the Adam steps that lazy rows skipped, so weights and moments
+// match the current timestep. Called before every row is read outside
+// training (validation, export); saving does not need it.
+void network_sync_optimizer(struct network *net);
+
 void updateweightsetbiases(struct network *net);
 
 int InputImage(struct network *net, size_t index, int ***chars_matrix);
@@ -65,6 +173,13 @@ void freeNetwork(struct network *net);
 
 void set_training_mode(struct network *net, int is_training);
 
+// Whole-model snapshot: weights, Adam moments and activations are copied
+// with one memcpy of the arena. dst/src must hold network_arena_bytes().
+size_t network_arena_bytes(const struct network *net);
+void network_snapshot(const struct network *net, void *dst);
+void network_restore(struct network *net, const void *src);
+
 #define OCR_HIDDEN_NODES 64
+#define OCR_OUTPUT_NODES 52 // A-Z then a-z
 
 #endif
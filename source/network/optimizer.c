@@ -0,0 +1,105 @@
+#include "optimizer.h"
+#include "../common.h"
+
+#include <string.h>
+
+OptimizerMode optimizer_mode = OPTIMIZER_ADAM;
+
+int optimizer_select(const char *name)
+{
+    if (strcmp(name, "adam") == 0)
+        optimizer_mode = OPTIMIZER_ADAM;
+    else if (strcmp(name, "lazy") == 0)
+        optimizer_mode = OPTIMIZER_LAZY_ADAM;
+    else
+        return 0;
+    return 1;
+}
+
+AdamCoeffs adam_coeffs(double eta, double beta1_t, double beta2_t)
+{
+    AdamCoeffs c;
+    c.eta = (real)eta;
+    c.beta1 = ADAM_BETA1;
+    c.beta2 = ADAM_BETA2;
+    c.one_minus_beta1 = (real)(1.0 - ADAM_BETA1);
+    c.one_minus_beta2 = (real)(1.0 - ADAM_BETA2);
+    c.step = (real)(eta / (1.0 - beta1_t));
+    c.inv_bc2 = (real)(1.0 / (1.0 - beta2_t));
+    c.eps = ADAM_EPS;
+    return c;
+}
+
+AdamCoeffs adam_begin_step(double eta, long *t, double *beta1_t, double *beta2_t)
+{
+    *t += 1;
+    *beta1_t *= ADAM_BETA1;
+    *beta2_t *= ADAM_BETA2;
+    return adam_coeffs(eta, *beta1_t, *beta2_t);
+}
+
+void adam_update(const AdamCoeffs *c, real *w, real *m, real *v,
+                 const real *g, real scale, int n)
+{
+    kernels.adam(w, m, v, g, scale, n, c);
+}
+
+// b^k by repeated squaring
+static double pow_steps(double b, long k)
+{
+    double r = 1.0;
+    for (; k > 0; k >>= 1)
+    {
+        if (k & 1) r *= b;
+        b *= b;
+    }
+    return r;
+}
+
+// Brings a row from *row_step to `target` with zero gradients. Over the
+// j-th skipped step (timestep tau), m/sqrt(v) scales by r^j with
+// r = beta1 / sqrt(beta2), and the bias corrections are those of tau.
+static void catch_up(const AdamCoeffs *c, long target, real *w, real *m,
+                     real *v, int n, long *row_step)
+{
+    long k = target - *row_step;
+    if (k <= 0) return;
+
+    const double r = ADAM_BETA1 / __builtin_sqrt(ADAM_BETA2);
+    double b1_tau = pow_steps(ADAM_BETA1, *row_step);
+    double b2_tau = pow_steps(ADAM_BETA2, *row_step);
+    double rj = 1.0, series = 0.0;
+    for (long j = 1; j <= k && rj > 1e-20; j++)
+    {
+        rj *= r;
+        b1_tau *= ADAM_BETA1;
+        b2_tau *= ADAM_BETA2;
+        series += rj * __builtin_sqrt(1.0 - b2_tau) / (1.0 - b1_tau);
+    }
+
+    // The kernel divides by sqrt(v * inv_bc2) of the current step
+    double drift = c->eta * series * __builtin_sqrt((double)c->inv_bc2);
+    kernels.adam_catch_up(w, m, v, n,
+                          (real)pow_steps(ADAM_BETA1, k),
+                          (real)pow_steps(ADAM_BETA2, k),
+                          (real)drift, c);
+    *row_step = target;
+}
+
+void adam_update_row(const AdamCoeffs *c, long t, real *w, real *m, real *v,
+                     const real *g, real scale, int n, long *row_step)
+{
+    if (optimizer_mode == OPTIMIZER_LAZY_ADAM)
+    {
+        if (scale == 0) return;
+        catch_up(c, t - 1, w, m, v, n, row_step);
+    }
+    kernels.adam(w, m, v, g, scale, n, c);
+    *row_step = t;
+}
+
+void adam_catch_up_row(const AdamCoeffs *c, long t, real *w, real *m, real *v,
+                       int n, long *row_step)
+{
+    catch_up(c, t, w, m, v, n, row_step);
+}
@@ -0,0 +1,47 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "../common.h"
+#include "kernels.h"
+
+// Adam shared by the CNN and the MLP. The per-element work runs through
+// kernels.adam / kernels.adam_catch_up; this module owns the timestep
+// bookkeeping and the lazy row scheduling.
+typedef enum
+{
+    OPTIMIZER_ADAM,      // every row is updated on every step
+    OPTIMIZER_LAZY_ADAM, // rows with a zero gradient are skipped, then caught up
+} OptimizerMode;
+
+extern OptimizerMode optimizer_mode;
+
+// Selects the mode by name ("adam", "lazy"). Returns 0 if unknown.
+int optimizer_select(const char *name);
+
+// Coefficients of step t, where beta1_t = ADAM_BETA1^t and beta2_t = ADAM_BETA2^t.
+AdamCoeffs adam_coeffs(double eta, double beta1_t, double beta2_t);
+
+// Advances the timestep and running beta products, returns the new step's
+// coefficients.
+AdamCoeffs adam_begin_step(double eta, long *t, double *beta1_t, double *beta2_t);
+
+// Dense Adam step on n parameters whose gradient is scale * g[k].
+void adam_update(const AdamCoeffs *c, real *w, real *m, real *v,
+                 const real *g, real scale, int n);
+
+// Adam step at timestep t on one weight row whose gradient is scale * g[k]
+// (an outer-product row: scale is the layer input). *row_step is the last
+// step the row saw. In lazy mode a zero scale leaves the row untouched, and
+// the next update first replays the skipped steps.
+void adam_update_row(const AdamCoeffs *c, long t, real *w, real *m, real *v,
+                     const real *g, real scale, int n, long *row_step);
+
+// Replays the zero-gradient steps a lazy row missed up to timestep t.
+// Moments are decayed exactly; the weight drift sums the per-step updates
+// in closed form per row, which is exact as long as eps is small next to
+// sqrt(v). Rows read before being caught up (e.g. by the input gradient)
+// see their weights without the pending drift.
+void adam_catch_up_row(const AdamCoeffs *c, long t, real *w, real *m, real *v,
+                       int n, long *row_step);
+
+#endif
@@ -0,0 +1,385 @@
+#define _POSIX_C_SOURCE 200809L // open_memstream
+
+#include "quantize.h"
+#include "../common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "tools.h"
+
+#define Q8_MAGIC "OCRQ8"
+#define Q8_VERSION 1
+#define Q8_MAX 127
+// Bounds for the per-glyph scratch buffers of quantized_predict()
+#define Q8_MAX_HIDDEN 256
+#define Q8_MAX_OUTPUTS 256
+
+static inline int32_t round_to_int(double x)
+{
+    return (x >= 0.0) ? (int32_t)(x + 0.5) : -(int32_t)(-x + 0.5);
+}
+
+static inline int8_t quantize_value(double x, double inv_scale)
+{
+    int32_t q = round_to_int(x * inv_scale);
+    if (q > Q8_MAX) q = Q8_MAX;
+    if (q < -Q8_MAX) q = -Q8_MAX;
+    return (int8_t)q;
+}
+
+// Symmetric per-column quantization of a row-major [rows][cols] matrix
+// whose rows are `ldw` reals apart, into q with rows `ldq` apart:
+// column c gets scale max|w[.][c]| / 127.
+static void quantize_columns(const real *w, int ldw, int rows, int cols,
+                             int8_t *q, int ldq, float *scale)
+{
+    for (int c = 0; c < cols; c++)
+    {
+        double max_abs = 0.0;
+        for (int r = 0; r < rows; r++)
+        {
+            double v = w[(size_t)r * ldw + c];
+            if (v < 0) v = -v;
+            if (v > max_abs) max_abs = v;
+        }
+        scale[c] = max_abs > 0.0 ? (float)(max_abs / Q8_MAX) : 1.0f;
+    }
+
+    for (int r = 0; r < rows; r++)
+        for (int c = 0; c < cols; c++)
+            q[(size_t)r * ldq + c] =
+                quantize_value(w[(size_t)r * ldw + c], 1.0 / scale[c]);
+}
+
+static QuantizedModel *alloc_quantized_model(int I, int H, int O)
+{
+    QuantizedModel *q = calloc(1, sizeof(QuantizedModel));
+    if (q == NULL) return NULL;
+
+    q->number_of_inputs = I;
+    q->number_of_hidden_nodes = H;
+    q->number_of_outputs = O;
+    q->output_stride = Q8_ROW_PAD(O);
+
+    q->hidden_weights = malloc((size_t)I * H);
+    q->hidden_scale   = malloc(sizeof(float) * H);
+    q->hidden_bias    = malloc(sizeof(float) * H);
+    q->output_weights = calloc((size_t)H * q->output_stride, 1);
+    q->output_scale   = malloc(sizeof(float) * O);
+    q->output_bias    = malloc(sizeof(float) * O);
+    q->conv_lut       = malloc(sizeof(int32_t) * NUM_FILTERS * CONV_PATTERNS);
+
+    if (q->hidden_weights == NULL || q->hidden_scale == NULL ||
+        q->hidden_bias == NULL || q->output_weights == NULL ||
+        q->output_scale == NULL || q->output_bias == NULL || q->conv_lut == NULL)
+    {
+        free_quantized_model(q);
+        return NULL;
+    }
+    return q;
+}
+
+void free_quantized_model(QuantizedModel *q)
+{
+    if (q == NULL) return;
+    free(q->hidden_weights);
+    free(q->hidden_scale);
+    free(q->hidden_bias);
+    free(q->output_weights);
+    free(q->output_scale);
+    free(q->output_bias);
+    free(q->conv_lut);
+    free(q);
+}
+
+// conv_lut[f][code] = max(0, bias + sum of the taps set in code), tap k
+// (row-major) being bit k as in glyph_window_codes()
+static void build_conv_lut(QuantizedModel *q)
+{
+    for (int f = 0; f < NUM_FILTERS; f++)
+        for (int code = 0; code < CONV_PATTERNS; code++)
+        {
+            int32_t acc = q->filter_bias[f];
+            for (int k = 0; k < CONV_TAPS; k++)
+                if ((code >> k) & 1)
+                    acc += q->filters[f][k];
+            q->conv_lut[f * CONV_PATTERNS + code] = acc > 0 ? acc : 0;
+        }
+}
+
+QuantizedModel *quantize_model(const CNN *cnn, const struct network *net)
+{
+    if (cnn == NULL || net == NULL) return NULL;
+
+    int I = net->number_of_inputs;
+    int H = net->number_of_hidden_nodes;
+    int O = net->number_of_outputs;
+    if (I != FLATTEN_SIZE || H > Q8_MAX_HIDDEN || O > Q8_MAX_OUTPUTS) return NULL;
+
+    QuantizedModel *q = alloc_quantized_model(I, H, O);
+    if (q == NULL) return NULL;
+
+    // One output channel per filter: treat its 9 taps as a 9x1 column
+    for (int f = 0; f < NUM_FILTERS; f++)
+    {
+        quantize_columns(&cnn->filters[f][0][0], 1, CONV_SIZE * CONV_SIZE, 1,
+                         q->filters[f], 1, &q->filter_scale[f]);
+        q->filter_bias[f] = round_to_int(cnn->biases[f] / q->filter_scale[f]);
+    }
+    build_conv_lut(q);
+
+    quantize_columns(net->hidden_weights, H, I, H, q->hidden_weights, H, q->hidden_scale);
+    quantize_columns(net->output_weights, net->output_stride, H, O,
+                     q->output_weights, q->output_stride, q->output_scale);
+    for (int j = 0; j < H; j++)
+        q->hidden_bias[j] = (float)net->hidden_layer_bias[j];
+    for (int k = 0; k < O; k++)
+        q->output_bias[k] = (float)net->output_layer_bias[k];
+
+    return q;
+}
+
+size_t quantized_model_bytes(const QuantizedModel *q)
+{
+    size_t I = q->number_of_inputs, H = q->number_of_hidden_nodes,
+           O = q->number_of_outputs;
+    return sizeof(q->filters) + sizeof(q->filter_scale) + sizeof(q->filter_bias)
+        + I * H + H * O + sizeof(float) * 2 * (H + O);
+}
+
+// Quantizes the n activations x[t] of rows[t] with one dynamic symmetric
+// scale, stored in *scale. Those that round to 0 are dropped: returns how
+// many are left, compacted in out and rows.
+static int quantize_activations(const float *x, int *rows, int n, int8_t *out,
+                                float *scale)
+{
+    float max_abs = 0.0f;
+    for (int t = 0; t < n; t++)
+    {
+        float v = x[t] < 0 ? -x[t] : x[t];
+        if (v > max_abs) max_abs = v;
+    }
+    *scale = max_abs > 0.0f ? max_abs / Q8_MAX : 1.0f;
+    if (max_abs == 0.0f) return 0;
+
+    double inv = Q8_MAX / (double)max_abs;
+    int kept = 0;
+    for (int t = 0; t < n; t++)
+    {
+        rows[kept] = rows[t];
+        out[kept] = quantize_value(x[t], inv);
+        kept += out[kept] != 0;
+    }
+    return kept;
+}
+
+// Class of one packed glyph. Only the activations that quantize to a
+// non-zero value are accumulated: the integer sums do not depend on the
+// order, so this gives the labels of the dense int8 product.
+static size_t predict_glyph(const QuantizedModel *q, const GlyphBits *glyph)
+{
+    int H = q->number_of_hidden_nodes;
+    int O = q->number_of_outputs;
+    unsigned short codes[CONV_H][CONV_W];
+    float values[FLATTEN_SIZE];
+    int rows[FLATTEN_SIZE];
+
+    // Conv + ReLU + max-pool by table lookup (pool commutes with the
+    // positive scale), compacted to the non-zero cells
+    glyph_window_codes(glyph, codes);
+    int nnz = 0;
+    for (int f = 0; f < NUM_FILTERS; f++)
+    {
+        const int32_t *table = q->conv_lut + f * CONV_PATTERNS;
+        for (int y = 0; y < POOL_H; y++)
+        {
+            const unsigned short *top = codes[y * POOL_SIZE];
+            const unsigned short *bottom = codes[y * POOL_SIZE + 1];
+            for (int x = 0; x < POOL_W; x++)
+            {
+                int32_t a = table[top[2 * x]], b = table[top[2 * x + 1]];
+                int32_t c = table[bottom[2 * x]], d = table[bottom[2 * x + 1]];
+                int32_t ab = a > b ? a : b, cd = c > d ? c : d;
+                int32_t best = ab > cd ? ab : cd;
+                rows[nnz] = (f * POOL_H + y) * POOL_W + x;
+                values[nnz] = best * q->filter_scale[f];
+                nnz += best != 0;
+            }
+        }
+    }
+
+    // Hidden layer: int8 x int8 -> int32, rescaled per hidden unit
+    int8_t in_q[FLATTEN_SIZE];
+    float in_scale;
+    nnz = quantize_activations(values, rows, nnz, in_q, &in_scale);
+
+    int32_t acc[Q8_MAX_HIDDEN > Q8_ROW_PAD(Q8_MAX_OUTPUTS) ? Q8_MAX_HIDDEN
+                                                          : Q8_ROW_PAD(Q8_MAX_OUTPUTS)];
+    memset(acc, 0, sizeof(int32_t) * H);
+    kernels.axpy_rows_i8(acc, in_q, q->hidden_weights, H, rows, nnz, H);
+
+    float hidden[Q8_MAX_HIDDEN];
+    nnz = 0;
+    for (int j = 0; j < H; j++)
+    {
+        hidden[nnz] = relu(acc[j] * in_scale * q->hidden_scale[j] + q->hidden_bias[j]);
+        rows[nnz] = j;
+        nnz += hidden[nnz] != 0;
+    }
+
+    // Output layer; softmax is monotonic so argmax of the logits suffices
+    int8_t hid_q[Q8_MAX_HIDDEN];
+    float hid_scale;
+    nnz = quantize_activations(hidden, rows, nnz, hid_q, &hid_scale);
+
+    int Os = q->output_stride;
+    memset(acc, 0, sizeof(int32_t) * Os);
+    kernels.axpy_rows_i8(acc, hid_q, q->output_weights, Os, rows, nnz, Os);
+
+    size_t best = 0;
+    float best_logit = 0.0f;
+    for (int k = 0; k < O; k++)
+    {
+        float logit = acc[k] * hid_scale * q->output_scale[k] + q->output_bias[k];
+        if (k == 0 || logit > best_logit)
+        {
+            best_logit = logit;
+            best = k;
+        }
+    }
+    return best;
+}
+
+void quantized_predict_glyphs(const QuantizedModel *q, const GlyphBits *glyphs,
+                              int n, size_t *labels)
+{
+    for (int g = 0; g < n; g++)
+        labels[g] = predict_glyph(q, &glyphs[g]);
+}
+
+size_t quantized_predict(const QuantizedModel *q, const double image[IMAGE_PIXELS])
+{
+    GlyphBits glyph;
+    glyph_pack_image(image, &glyph);
+    return predict_glyph(q, &glyph);
+}
+
+static void write_int8s(FILE *f, const int8_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) fprintf(f, "%d\n", src[i]);
+}
+
+static void write_floats(FILE *f, const float *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) fprintf(f, "%.9g\n", (double)src[i]);
+}
+
+static int read_int8s(FILE *f, int8_t *dst, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        int v;
+        if (fscanf(f, "%d", &v) != 1 || v < -Q8_MAX || v > Q8_MAX) return 0;
+        dst[i] = (int8_t)v;
+    }
+    return 1;
+}
+
+static int read_floats(FILE *f, float *dst, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        if (fscanf(f, "%f", &dst[i]) != 1) return 0;
+    return 1;
+}
+
+int save_quantized_model(const char *filename, const QuantizedModel *q)
+{
+    if (filename == NULL || q == NULL) return 0;
+    char *text = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&text, &size);
+    if (f == NULL) return 0;
+
+    int I = q->number_of_inputs;
+    int H = q->number_of_hidden_nodes;
+    int O = q->number_of_outputs;
+
+    fprintf(f, "%s %d %d %d %d %d %d\n", Q8_MAGIC, Q8_VERSION,
+            NUM_FILTERS, CONV_SIZE, I, H, O);
+
+    write_floats(f, q->filter_scale, NUM_FILTERS);
+    for (int k = 0; k < NUM_FILTERS; k++) fprintf(f, "%d\n", q->filter_bias[k]);
+    write_int8s(f, &q->filters[0][0], sizeof(q->filters));
+
+    write_floats(f, q->hidden_scale, H);
+    write_floats(f, q->hidden_bias, H);
+    write_int8s(f, q->hidden_weights, (size_t)I * H);
+
+    write_floats(f, q->output_scale, O);
+    write_floats(f, q->output_bias, O);
+    for (int j = 0; j < H; j++)
+        write_int8s(f, q->output_weights + (size_t)j * q->output_stride, O);
+
+    // Formatted in memory first, so a failed write keeps the old file whole
+    int ok = fclose(f) == 0 && write_file_atomic(filename, text, size);
+    free(text);
+    return ok;
+}
+
+QuantizedModel *load_quantized_model(const char *filename)
+{
+    if (filename == NULL || fileempty(filename)) return NULL;
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) return NULL;
+
+    char magic[16];
+    int version, nf, ks, I, H, O;
+    if (fscanf(f, "%15s %d %d %d %d %d %d", magic, &version, &nf, &ks, &I, &H, &O) != 7
+        || strcmp(magic, Q8_MAGIC) != 0
+        || version != Q8_VERSION
+        || nf != NUM_FILTERS
+        || ks != CONV_SIZE
+        || I != FLATTEN_SIZE
+        || H <= 0 || H > Q8_MAX_HIDDEN
+        || O <= 0 || O > Q8_MAX_OUTPUTS)
+    {
+        fprintf(stderr, "load_quantized_model: incompatible file %s (ignored)\n", filename);
+        fclose(f);
+        return NULL;
+    }
+
+    QuantizedModel *q = alloc_quantized_model(I, H, O);
+    if (q == NULL)
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    int ok = read_floats(f, q->filter_scale, NUM_FILTERS);
+    for (int k = 0; ok && k < NUM_FILTERS; k++)
+        ok = fscanf(f, "%d", &q->filter_bias[k]) == 1;
+    ok = ok && read_int8s(f, &q->filters[0][0], sizeof(q->filters));
+
+    ok = ok && read_floats(f, q->hidden_scale, H);
+    ok = ok && read_floats(f, q->hidden_bias, H);
+    ok = ok && read_int8s(f, q->hidden_weights, (size_t)I * H);
+
+    ok = ok && read_floats(f, q->output_scale, O);
+    ok = ok && read_floats(f, q->output_bias, O);
+    for (int j = 0; ok && j < H; j++)
+        ok = read_int8s(f, q->output_weights + (size_t)j * q->output_stride, O);
+
+    fclose(f);
+
+    if (!ok)
+    {
+        fprintf(stderr, "load_quantized_model: file %s truncated or corrupt\n", filename);
+        free_quantized_model(q);
+        return NULL;
+    }
+    build_conv_lut(q);
+    return q;
+}
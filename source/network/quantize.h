@@ -0,0 +1,63 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "network.h"
+#include "cnn.h"
+
+// Post-training int8 model for OCR inference. Every weight matrix is stored
+// as int8 with one float scale per output channel (conv filter, hidden unit,
+// output class); products are accumulated in int32 and rescaled once per
+// channel. Activations are quantized per glyph with a dynamic scale. The
+// conv runs on bit-packed glyphs through an int32 table per filter, and
+// the dense layers through kernels.axpy_rows_i8.
+// Output rows are padded to whole 16-lane int32 vectors so that
+// kernels.axpy_rows_i8 runs no remainder loop
+#define Q8_ROW_PAD(n) (((n) + 15) & ~15)
+
+typedef struct
+{
+    int number_of_inputs;
+    int number_of_hidden_nodes;
+    int number_of_outputs;
+
+    // Convolution: int8 taps, per-filter scale, bias in filter-scale units
+    int8_t filters[NUM_FILTERS][CONV_SIZE * CONV_SIZE];
+    float filter_scale[NUM_FILTERS];
+    int32_t filter_bias[NUM_FILTERS];
+    int32_t *conv_lut;      // [NUM_FILTERS][CONV_PATTERNS] ReLU'd responses,
+                            // built from the above (not saved)
+
+    // Dense layers: [I][H] and [H][output_stride] int8 weights (zero
+    // padding columns, in memory only), per-column scales
+    int output_stride;      // Q8_ROW_PAD(number_of_outputs)
+    int8_t *hidden_weights;
+    float *hidden_scale;
+    float *hidden_bias;
+    int8_t *output_weights;
+    float *output_scale;
+    float *output_bias;
+} QuantizedModel;
+
+// Builds the int8 model from trained fp weights. Returns NULL on OOM or if
+// the MLP is not a FLATTEN_SIZE-input network of at most 256 hidden/outputs.
+QuantizedModel *quantize_model(const CNN *cnn, const struct network *net);
+void free_quantized_model(QuantizedModel *q);
+
+// Returns 1 on success.
+int save_quantized_model(const char *filename, const QuantizedModel *q);
+// Returns NULL if the file is missing, incompatible or truncated.
+QuantizedModel *load_quantized_model(const char *filename);
+
+// Classifies n bit-packed glyphs; labels receives the class index of each.
+void quantized_predict_glyphs(const QuantizedModel *q, const GlyphBits *glyphs,
+                              int n, size_t *labels);
+// Classifies one binary glyph (non-zero pixel = ink). Returns the class index.
+size_t quantized_predict(const QuantizedModel *q, const double image[IMAGE_PIXELS]);
+
+// Size in bytes of the int8 weight matrices and their scales/biases (the
+// conv table left out).
+size_t quantized_model_bytes(const QuantizedModel *q);
+
+#endif
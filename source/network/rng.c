@@ -0,0 +1,67 @@
+#include "rng.h"
+
+#include <string.h>
+
+Rng rng_main = { { 0x9E3779B97F4A7C15ULL, 0xBF58476D1CE4E5B9ULL,
+                   0x94D049BB133111EBULL, 0x2545F4914F6CDD1DULL } };
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(Rng *rng, uint64_t seed)
+{
+    for (int k = 0; k < 4; k++)
+        rng->s[k] = splitmix64(&seed);
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+uint64_t rng_next(Rng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+double rng_uniform(Rng *rng)
+{
+    return (double)(rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+uint32_t rng_below(Rng *rng, uint32_t n)
+{
+    return (uint32_t)(((rng_next(rng) >> 32) * n) >> 32);
+}
+
+void rng_bernoulli_mask(Rng *rng, uint64_t *words, int n, double p)
+{
+    // Lane value < threshold <=> bit set; 65536 makes p = 1 always set
+    uint32_t threshold = p <= 0 ? 0 : p >= 1 ? 65536 : (uint32_t)(p * 65536.0 + 0.5);
+
+    memset(words, 0, sizeof(uint64_t) * RNG_MASK_WORDS(n));
+    for (int k = 0; k < n; k += 4)
+    {
+        uint64_t r = rng_next(rng);
+        for (int lane = 0; lane < 4 && k + lane < n; lane++)
+        {
+            uint64_t bit = (uint32_t)((r >> (16 * lane)) & 0xFFFF) < threshold;
+            words[(k + lane) >> 6] |= bit << ((k + lane) & 63);
+        }
+    }
+}
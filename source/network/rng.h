@@ -0,0 +1,38 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// xoshiro256** generator. Every consumer owns its state explicitly: one per
+// thread, per network (dropout) or per job, so runs are reproducible from a
+// single seed whatever the scheduling.
+typedef struct
+{
+    uint64_t s[4];
+} Rng;
+
+// Generator of the main thread: weight initialization, dataset split and
+// augmentation. Seeded from the clock at startup, or from --seed.
+extern Rng rng_main;
+
+// Expands a 64-bit seed into the state with splitmix64.
+void rng_seed(Rng *rng, uint64_t seed);
+
+uint64_t rng_next(Rng *rng);
+
+// Uniform double in [0, 1), 53-bit resolution.
+double rng_uniform(Rng *rng);
+
+// Uniform integer in [0, n) by multiply-shift (bias below n / 2^32).
+uint32_t rng_below(Rng *rng, uint32_t n);
+
+// Fills the first n bits of words[(n + 63) / 64] with independent
+// Bernoulli(p) draws, four per rng_next() call (16-bit thresholds, so p is
+// rounded to a multiple of 1/65536). Bits past n are cleared.
+void rng_bernoulli_mask(Rng *rng, uint64_t *words, int n, double p);
+
+#define RNG_MASK_WORDS(n) (((size_t)(n) + 63) / 64)
+#define RNG_MASK_BIT(words, k) (((words)[(k) >> 6] >> ((k) & 63)) & 1)
+
+#endif
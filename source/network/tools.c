@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE // posix_memalign, madvise
+
 #include "../network/tools.h"
 #include "../common.h"
 
@@ -5,6 +7,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "../network/network.h"
 #include "../network/cnn.h"
@@ -162,9 +170,9 @@ double dRelu(double x)
     return x > 0.0 ? 1.0 : 0.01;
 }
 
-void softmax(double *input, int n)
+void softmax(real *input, int n)
 {
-    double max = input[0];
+    real max = input[0];
     for (int i = 1; i < n; i++)
     {
         if (input[i] > max) max = input[i];
@@ -177,7 +185,7 @@ void softmax(double *input, int n)
         sum += input[i];
     }
 
-    double inv_sum = 1.0 / sum;
+    real inv_sum = (real)(1.0 / sum);
     for (int i = 0; i < n; i++)
     {
         input[i] *= inv_sum;
@@ -187,7 +195,7 @@ void softmax(double *input, int n)
 // Uniform random number between min and max
 double random_uniform(double min, double max)
 {
-    return min + (max - min) * ((double)rand() / RAND_MAX);
+    return min + (max - min) * rng_uniform(&rng_main);
 }
 
 // He Initialization for ReLU (Uniform)
@@ -208,7 +216,31 @@ double init_weight_xavier(int fan_in, int fan_out)
 
 double init_weight()
 {
-    return ((double)rand() / (double)RAND_MAX) * 2.0 - 1.0;
+    return rng_uniform(&rng_main) * 2.0 - 1.0;
+}
+
+void *alloc_arena(size_t bytes, size_t alignment)
+{
+    if (bytes == 0) bytes = alignment;
+
+    // Large arenas are 2 MB aligned/rounded so the kernel can back them with
+    // transparent huge pages (one TLB entry instead of 512).
+    int huge = bytes >= ARENA_HUGE_PAGE;
+    if (huge)
+    {
+        alignment = ARENA_HUGE_PAGE;
+        bytes = (bytes + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+    }
+
+    void *arena = NULL;
+    if (posix_memalign(&arena, alignment, bytes) != 0)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (huge)
+        madvise(arena, bytes, MADV_HUGEPAGE);
+#endif
+    memset(arena, 0, bytes);
+    return arena;
 }
 
 int cfileexists(const char *filename)
@@ -232,21 +264,126 @@ int fileempty(const char *filename)
     return (len > 0) ? 0 : 1;
 }
 
-// Versioned weight file: dimensions + weights/biases + full Adam state.
-// Incompatible with pre-v2 files; those are ignored on load.
+int file_older(const char *derived, const char *source)
+{
+    struct stat d, s;
+    if (stat(derived, &d) != 0 || stat(source, &s) != 0) return 0;
+    if (d.st_mtim.tv_sec != s.st_mtim.tv_sec)
+        return d.st_mtim.tv_sec < s.st_mtim.tv_sec;
+    return d.st_mtim.tv_nsec < s.st_mtim.tv_nsec;
+}
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t n)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < n; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// fsync of the directory holding path, so a rename into it is durable
+static void sync_parent(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+    if (dir == NULL) return;
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+int write_file_atomic(const char *filename, const void *data, size_t size)
+{
+    size_t length = strlen(filename);
+    char *tmp = malloc(length + sizeof(".tmp"));
+    if (tmp == NULL) return 0;
+    memcpy(tmp, filename, length);
+    memcpy(tmp + length, ".tmp", sizeof(".tmp"));
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0;
+    for (size_t done = 0; ok && done < size; )
+    {
+        ssize_t n = write(fd, (const char *)data + done, size - done);
+        ok = n > 0;
+        done += ok ? (size_t)n : 0;
+    }
+    ok = ok && fsync(fd) == 0;
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    ok = ok && rename(tmp, filename) == 0;
+    if (ok)
+        sync_parent(filename);
+    else
+    {
+        perror(filename);
+        unlink(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+// Versioned weight file: dimensions, precision, weights/biases + full Adam state.
+// v2 files (always double precision) are still accepted; older ones are ignored.
+// Values are stored as text, so a file of either precision loads into a build
+// of the other one (rounded to float when going 64 -> 32 bits).
 #define NET_MAGIC "OCRNET"
-#define NET_VERSION 2
+#define NET_VERSION 3
+
+#ifdef OCR_FLOAT32
+#define REAL_TEXT_FMT "%.9g\n"
+#else
+#define REAL_TEXT_FMT "%.17g\n"
+#endif
 
-static int read_doubles(FILE *f, double *dst, size_t n)
+int read_reals(FILE *f, real *dst, size_t n)
 {
     for (size_t i = 0; i < n; i++)
-        if (fscanf(f, "%lf", &dst[i]) != 1) return 0;
+    {
+        double v;
+        if (fscanf(f, "%lf", &v) != 1) return 0;
+        dst[i] = (real)v;
+    }
+    return 1;
+}
+
+void write_reals(FILE *f, const real *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) fprintf(f, REAL_TEXT_FMT, (double)src[i]);
+}
+
+// v2 network/CNN headers have no precision field and are double.
+int read_precision(FILE *f, int version, const char *filename, const char *who)
+{
+    int bits = 64;
+    if (version >= 3 && (fscanf(f, "%d", &bits) != 1 || (bits != 32 && bits != 64)))
+        return 0;
+    if (bits != REAL_BITS)
+        fprintf(stderr, "%s: %s holds %d-bit weights, converting to %d-bit\n",
+                who, filename, bits, REAL_BITS);
     return 1;
 }
 
-static void write_doubles(FILE *f, const double *src, size_t n)
+// The output-layer matrices as H unpadded rows of O, read from / written to
+// rows `stride` reals apart
+static void write_rows(FILE *f, const real *src, int rows, int cols, int stride)
 {
-    for (size_t i = 0; i < n; i++) fprintf(f, "%.17g\n", src[i]);
+    for (int r = 0; r < rows; r++)
+        write_reals(f, src + (size_t)r * stride, cols);
+}
+
+static int read_rows(FILE *f, real *dst, int rows, int cols, int stride)
+{
+    int ok = 1;
+    for (int r = 0; r < rows && ok; r++)
+        ok = read_reals(f, dst + (size_t)r * stride, cols);
+    return ok;
 }
 
 void save_network(const char *filename, struct network *network)
@@ -255,28 +392,32 @@ void save_network(const char *filename, struct network *network)
     FILE *f = fopen(filename, "w");
     if (f == NULL) { perror(filename); return; }
 
+    // The file has no per-row steps: bring lazy Adam rows up to date first
+    network_sync_optimizer(network);
+
     int I = network->number_of_inputs;
     int H = network->number_of_hidden_nodes;
     int O = network->number_of_outputs;
+    int Os = network->output_stride;
 
-    fprintf(f, "%s %d %d %d %d\n", NET_MAGIC, NET_VERSION, I, H, O);
+    fprintf(f, "%s %d %d %d %d %d\n", NET_MAGIC, NET_VERSION, I, H, O, REAL_BITS);
     fprintf(f, "%ld %.17g %.17g\n",
             network->adam_t, network->adam_beta1_t, network->adam_beta2_t);
 
-    write_doubles(f, network->hidden_layer_bias, H);
-    write_doubles(f, network->hidden_weights,    (size_t)I * H);
-    write_doubles(f, network->output_layer_bias, O);
-    write_doubles(f, network->output_weights,    (size_t)H * O);
+    write_reals(f, network->hidden_layer_bias, H);
+    write_reals(f, network->hidden_weights,    (size_t)I * H);
+    write_reals(f, network->output_layer_bias, O);
+    write_rows(f, network->output_weights, H, O, Os);
 
-    write_doubles(f, network->m_hidden_bias,    H);
-    write_doubles(f, network->v_hidden_bias,    H);
-    write_doubles(f, network->m_hidden_weights, (size_t)I * H);
-    write_doubles(f, network->v_hidden_weights, (size_t)I * H);
+    write_reals(f, network->m_hidden_bias,    H);
+    write_reals(f, network->v_hidden_bias,    H);
+    write_reals(f, network->m_hidden_weights, (size_t)I * H);
+    write_reals(f, network->v_hidden_weights, (size_t)I * H);
 
-    write_doubles(f, network->m_output_bias,    O);
-    write_doubles(f, network->v_output_bias,    O);
-    write_doubles(f, network->m_output_weights, (size_t)H * O);
-    write_doubles(f, network->v_output_weights, (size_t)H * O);
+    write_reals(f, network->m_output_bias,    O);
+    write_reals(f, network->v_output_bias,    O);
+    write_rows(f, network->m_output_weights, H, O, Os);
+    write_rows(f, network->v_output_weights, H, O, Os);
 
     fclose(f);
 }
@@ -291,10 +432,11 @@ int load_network(const char *filename, struct network *network)
     int version, I, H, O;
     if (fscanf(f, "%15s %d %d %d %d", magic, &version, &I, &H, &O) != 5
         || strcmp(magic, NET_MAGIC) != 0
-        || version != NET_VERSION
+        || version < 2 || version > NET_VERSION
         || I != network->number_of_inputs
         || H != network->number_of_hidden_nodes
-        || O != network->number_of_outputs)
+        || O != network->number_of_outputs
+        || !read_precision(f, version, filename, "load_network"))
     {
         fprintf(stderr, "load_network: incompatible file %s (ignored)\n", filename);
         fclose(f);
@@ -306,34 +448,40 @@ int load_network(const char *filename, struct network *network)
                      &network->adam_beta1_t,
                      &network->adam_beta2_t) == 3);
 
-    ok &= read_doubles(f, network->hidden_layer_bias, H);
-    ok &= read_doubles(f, network->hidden_weights,    (size_t)I * H);
-    ok &= read_doubles(f, network->output_layer_bias, O);
-    ok &= read_doubles(f, network->output_weights,    (size_t)H * O);
+    ok &= read_reals(f, network->hidden_layer_bias, H);
+    ok &= read_reals(f, network->hidden_weights,    (size_t)I * H);
+    ok &= read_reals(f, network->output_layer_bias, O);
+    ok &= read_rows(f, network->output_weights, H, O, network->output_stride);
 
-    ok &= read_doubles(f, network->m_hidden_bias,    H);
-    ok &= read_doubles(f, network->v_hidden_bias,    H);
-    ok &= read_doubles(f, network->m_hidden_weights, (size_t)I * H);
-    ok &= read_doubles(f, network->v_hidden_weights, (size_t)I * H);
+    ok &= read_reals(f, network->m_hidden_bias,    H);
+    ok &= read_reals(f, network->v_hidden_bias,    H);
+    ok &= read_reals(f, network->m_hidden_weights, (size_t)I * H);
+    ok &= read_reals(f, network->v_hidden_weights, (size_t)I * H);
 
-    ok &= read_doubles(f, network->m_output_bias,    O);
-    ok &= read_doubles(f, network->v_output_bias,    O);
-    ok &= read_doubles(f, network->m_output_weights, (size_t)H * O);
-    ok &= read_doubles(f, network->v_output_weights, (size_t)H * O);
+    ok &= read_reals(f, network->m_output_bias,    O);
+    ok &= read_reals(f, network->v_output_bias,    O);
+    ok &= read_rows(f, network->m_output_weights, H, O, network->output_stride);
+    ok &= read_rows(f, network->v_output_weights, H, O, network->output_stride);
 
     fclose(f);
 
+    // Saved networks are synced: every row is at the saved timestep
+    for (int i = 0; i < I; i++)
+        network->hidden_row_step[i] = network->adam_t;
+    for (int h = 0; h < H; h++)
+        network->output_row_step[h] = network->adam_t;
+
     if (!ok)
         fprintf(stderr, "load_network: file %s truncated or corrupt\n", filename);
     return ok;
 }
 
-void shuffle(int *array, size_t n)
+void shuffle(Rng *rng, int *array, size_t n)
 {
     if (array == NULL || n <= 1) return;
     for (size_t i = 0; i < n - 1; i++)
     {
-        size_t j = i + rand() / (RAND_MAX / (n - i) + 1);
+        size_t j = i + rng_below(rng, (uint32_t)(n - i));
         int t = array[j];
         array[j] = array[i];
         array[i] = t;
@@ -525,56 +673,249 @@ double *resize_image_to_28x28(SDL_Surface *img)
     return input;
 }
 
-// Helper to load a single directory of images
-void load_directory(const char *path, TrainingDataSet *dataset, int is_uppercase)
+// One training image found on disk
+typedef struct
+{
+    char path[512];
+    char label;
+    long long stamp[3]; // size, mtime seconds and nanoseconds
+} SourceImage;
+
+typedef struct
+{
+    SourceImage *images;
+    int count;
+    int capacity;
+    uint64_t key;   // FNV-1a of the preprocessing and of every path, size and mtime
+} SourceList;
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(((const SourceImage *)a)->path, ((const SourceImage *)b)->path);
+}
+
+// Appends the images of a directory to list in name order (readdir order
+// depends on the file system), labelled from the first letter of their name
+// in the case of the directory
+static void list_directory(const char *path, int is_uppercase, SourceList *list)
 {
-    DIR *d;
+    DIR *d = opendir(path);
+    if (d == NULL)
+    {
+        printf("Failed to open directory: %s\n", path);
+        return;
+    }
+
+    int first = list->count;
     struct dirent *dir;
-    d = opendir(path);
-    if (d)
+    while ((dir = readdir(d)) != NULL)
     {
-        while ((dir = readdir(d)) != NULL)
+        if (!strstr(dir->d_name, ".png") && !strstr(dir->d_name, ".jpg")
+            && !strstr(dir->d_name, ".bmp"))
+            continue;
+
+        if (list->count == list->capacity)
         {
-            if (strstr(dir->d_name, ".png") || strstr(dir->d_name, ".jpg") || strstr(dir->d_name, ".bmp"))
-            {
-                char fullpath[512];
-                snprintf(fullpath, sizeof(fullpath), "%s/%s", path, dir->d_name);
-
-                SDL_Surface *img = load_image(fullpath);
-                if (img)
-                {
-                    double *input = resize_image_to_28x28(img);
-                    SDL_FreeSurface(img);
-
-                    if (input == NULL)
-                    {
-                        printf("Warning: Failed to resize image %s\n", fullpath);
-                        continue;
-                    }
-
-                    if (!ensure_dataset_capacity(dataset))
-                    {
-                        free(input);
-                        printf("Error: Memory allocation failed\n");
-                        break;
-                    }
-
-                    char label = dir->d_name[0];
-                    if (is_uppercase && label >= 'a' && label <= 'z') label -= 32;
-                    if (!is_uppercase && label >= 'A' && label <= 'Z') label += 32;
-
-                    dataset->inputs[dataset->count] = input;
-                    dataset->labels[dataset->count] = label;
-                    dataset->count++;
-                }
-            }
+            int capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+            SourceImage *grown = realloc(list->images, sizeof(SourceImage) * capacity);
+            if (grown == NULL) errx(1, "Not enough memory!");
+            list->images = grown;
+            list->capacity = capacity;
         }
-        closedir(d);
+        SourceImage *image = &list->images[list->count];
+        snprintf(image->path, sizeof(image->path), "%s/%s", path, dir->d_name);
+
+        struct stat st;
+        if (stat(image->path, &st) != 0)
+            continue;
+        image->stamp[0] = st.st_size;
+        image->stamp[1] = st.st_mtim.tv_sec;
+        image->stamp[2] = st.st_mtim.tv_nsec;
+
+        char label = dir->d_name[0];
+        if (is_uppercase && label >= 'a' && label <= 'z') label -= 32;
+        if (!is_uppercase && label >= 'A' && label <= 'Z') label += 32;
+        image->label = label;
+        list->count++;
     }
-    else
+    closedir(d);
+
+    qsort(list->images + first, list->count - first, sizeof(SourceImage), compare_paths);
+    for (int i = first; i < list->count; i++)
     {
-        printf("Failed to open directory: %s\n", path);
+        const SourceImage *image = &list->images[i];
+        list->key = fnv1a(list->key, image->path, strlen(image->path) + 1);
+        list->key = fnv1a(list->key, image->stamp, sizeof(image->stamp));
+    }
+}
+
+enum
+{
+    LOAD_CHUNK = 16,        // images a decode worker takes at a time
+    LOAD_MAX_THREADS = 64
+};
+
+// Decode workers share the list and fill one preallocated slot per image.
+// They print nothing: failures are reported by the calling thread.
+typedef struct
+{
+    const SourceList *list;
+    double **slots;         // [list->count], NULL where an image failed
+    int next;               // first image not taken yet, guarded by lock
+    pthread_mutex_t lock;
+} LoadJob;
+
+static void *load_worker(void *arg)
+{
+    LoadJob *job = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        int start = job->next;
+        job->next += LOAD_CHUNK;
+        pthread_mutex_unlock(&job->lock);
+        if (start >= job->list->count)
+            return NULL;
+
+        int end = start + LOAD_CHUNK < job->list->count ? start + LOAD_CHUNK
+                                                         : job->list->count;
+        for (int i = start; i < end; i++)
+        {
+            // Not load_image(), which exits on an unreadable file
+            SDL_Surface *img = IMG_Load(job->list->images[i].path);
+            if (img == NULL)
+                continue;
+            job->slots[i] = resize_image_to_28x28(img);
+            SDL_FreeSurface(img);
+        }
+    }
+}
+
+// Decodes and normalizes the listed images into dataset on one worker per
+// core, the calling thread included. The samples keep the listing order
+// whatever the scheduling.
+static void load_images(const SourceList *list, TrainingDataSet *dataset)
+{
+    int n = list->count;
+    if (n == 0) return;
+
+    LoadJob job = { list, calloc(n, sizeof(double *)), 0, PTHREAD_MUTEX_INITIALIZER };
+    dataset->inputs = malloc(sizeof(double *) * n);
+    dataset->labels = malloc(sizeof(char) * n);
+    if (job.slots == NULL || dataset->inputs == NULL || dataset->labels == NULL)
+        errx(1, "Not enough memory!");
+    dataset->capacity = n;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores < 1 ? 1 : cores > LOAD_MAX_THREADS ? LOAD_MAX_THREADS : (int)cores;
+    if (threads > (n + LOAD_CHUNK - 1) / LOAD_CHUNK)
+        threads = (n + LOAD_CHUNK - 1) / LOAD_CHUNK;
+
+    // SDL_image loads its codecs on first use: do it before the workers race
+    IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
+    pthread_t workers[LOAD_MAX_THREADS];
+    int started = 0;
+    for (int t = 1; t < threads; t++)
+        if (pthread_create(&workers[started], NULL, load_worker, &job) == 0)
+            started++;
+    load_worker(&job);
+    for (int t = 0; t < started; t++)
+        pthread_join(workers[t], NULL);
+    pthread_mutex_destroy(&job.lock);
+
+    int skipped = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (job.slots[i] == NULL)
+        {
+            printf("Warning: can't load %s, skipped\n", list->images[i].path);
+            skipped++;
+            continue;
+        }
+        dataset->inputs[dataset->count] = job.slots[i];
+        dataset->labels[dataset->count] = list->images[i].label;
+        dataset->count++;
     }
+    free(job.slots);
+    if (skipped > 0)
+        printf("Warning: %d of %d images skipped\n", skipped, n);
+}
+
+// Dataset cache: the decoded samples of the last load, valid while the key
+// of the source images is unchanged. A header, then per sample the 28x28
+// 0/1 image packed 8 pixels per byte (pixel p is bit p % 8 of byte p / 8)
+// followed by its label.
+#define DATASET_MAGIC "OCRDSET"
+#define DATASET_VERSION 1
+#define GLYPH_BYTES (IMAGE_PIXELS / 8)      // 98
+#define DATASET_RECORD (GLYPH_BYTES + 1)
+
+typedef struct
+{
+    char magic[8];      // DATASET_MAGIC with its NUL
+    uint32_t version;
+    uint32_t count;
+    uint64_t key;
+} DatasetCacheHeader;
+
+static int read_dataset_cache(uint64_t key, TrainingDataSet *dataset)
+{
+    FILE *f = fopen(OCR_DATASET_CACHE, "rb");
+    if (f == NULL) return 0;
+
+    DatasetCacheHeader header;
+    unsigned char *records = NULL;
+    int ok = fread(&header, sizeof(header), 1, f) == 1
+          && memcmp(header.magic, DATASET_MAGIC, sizeof(header.magic)) == 0
+          && header.version == DATASET_VERSION && header.key == key;
+    if (ok)
+    {
+        records = malloc((size_t)header.count * DATASET_RECORD + 1);
+        if (records == NULL) errx(1, "Not enough memory!");
+        ok = fread(records, DATASET_RECORD, header.count, f) == header.count
+          && fgetc(f) == EOF;
+    }
+    fclose(f);
+
+    for (uint32_t i = 0; ok && i < header.count; i++)
+    {
+        const unsigned char *record = records + (size_t)i * DATASET_RECORD;
+        double *input = malloc(sizeof(double) * IMAGE_PIXELS);
+        if (input == NULL || !ensure_dataset_capacity(dataset))
+            errx(1, "Not enough memory!");
+        for (int p = 0; p < IMAGE_PIXELS; p++)
+            input[p] = (record[p >> 3] >> (p & 7)) & 1;
+        dataset->inputs[dataset->count] = input;
+        dataset->labels[dataset->count] = (char)record[GLYPH_BYTES];
+        dataset->count++;
+    }
+    free(records);
+    return ok;
+}
+
+static void write_dataset_cache(uint64_t key, const TrainingDataSet *dataset)
+{
+    size_t size = sizeof(DatasetCacheHeader) + (size_t)dataset->count * DATASET_RECORD;
+    unsigned char *buffer = calloc(1, size);
+    if (buffer == NULL) return;
+
+    DatasetCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+    header.version = DATASET_VERSION;
+    header.count = dataset->count;
+    header.key = key;
+    memcpy(buffer, &header, sizeof(header));
+
+    for (int i = 0; i < dataset->count; i++)
+    {
+        unsigned char *record = buffer + sizeof(header) + (size_t)i * DATASET_RECORD;
+        for (int p = 0; p < IMAGE_PIXELS; p++)
+            record[p >> 3] |= (dataset->inputs[i][p] != 0) << (p & 7);
+        record[GLYPH_BYTES] = (unsigned char)dataset->labels[i];
+    }
+    write_file_atomic(OCR_DATASET_CACHE, buffer, size);
+    free(buffer);
 }
 
 TrainingDataSet *loadDataSet(void)
@@ -587,8 +928,24 @@ TrainingDataSet *loadDataSet(void)
     dataset->count    = 0;
     dataset->capacity = 0;
 
-    load_directory("img/training/maj", dataset, 1);
-    load_directory("img/training/min", dataset, 0);
+    // Listing the images is cheap; decoding them is skipped while the cache
+    // matches them
+    SourceList list = { NULL, 0, 0, FNV1A_INIT };
+    int preprocessing[2] = { IMAGE_SIZE, BW_THRESHOLD };
+    list.key = fnv1a(list.key, preprocessing, sizeof(preprocessing));
+    list_directory("img/training/maj", 1, &list);
+    list_directory("img/training/min", 0, &list);
+
+    if (list.count > 0 && read_dataset_cache(list.key, dataset))
+        printf("Loaded %d samples from %s\n", dataset->count, OCR_DATASET_CACHE);
+    else
+    {
+        load_images(&list, dataset);
+        if (dataset->count > 0)
+            write_dataset_cache(list.key, dataset);
+    }
+    free(list.images);
+    dataset->source_key = list.key;
 
     if (dataset->count == 0)
     {
@@ -602,7 +959,7 @@ TrainingDataSet *loadDataSet(void)
 }
 
 #define CNN_MAGIC "OCRCNN"
-#define CNN_VERSION 2
+#define CNN_VERSION 4
 
 void save_cnn(const char *filename, void *cnn_ptr)
 {
@@ -611,17 +968,26 @@ void save_cnn(const char *filename, void *cnn_ptr)
     FILE *f = fopen(filename, "w");
     if (f == NULL) { perror(filename); return; }
 
-    fprintf(f, "%s %d %d %d\n", CNN_MAGIC, CNN_VERSION, NUM_FILTERS, CONV_SIZE);
+    fprintf(f, "%s %d %d %d %d %d\n", CNN_MAGIC, CNN_VERSION, NUM_FILTERS, CONV_SIZE,
+            REAL_BITS, (int)cnn->stage2);
     fprintf(f, "%ld %.17g %.17g\n",
             cnn->adam_t, cnn->adam_beta1_t, cnn->adam_beta2_t);
 
     const size_t kernel_count = (size_t)NUM_FILTERS * CONV_SIZE * CONV_SIZE;
-    write_doubles(f, cnn->biases,      NUM_FILTERS);
-    write_doubles(f, &cnn->filters[0][0][0],   kernel_count);
-    write_doubles(f, cnn->m_biases,    NUM_FILTERS);
-    write_doubles(f, cnn->v_biases,    NUM_FILTERS);
-    write_doubles(f, &cnn->m_filters[0][0][0], kernel_count);
-    write_doubles(f, &cnn->v_filters[0][0][0], kernel_count);
+    write_reals(f, cnn->biases,      NUM_FILTERS);
+    write_reals(f, &cnn->filters[0][0][0],   kernel_count);
+    write_reals(f, cnn->m_biases,    NUM_FILTERS);
+    write_reals(f, cnn->v_biases,    NUM_FILTERS);
+    write_reals(f, &cnn->m_filters[0][0][0], kernel_count);
+    write_reals(f, &cnn->v_filters[0][0][0], kernel_count);
+    if (cnn->stage2 != CNN_STAGE2_NONE) {
+        write_reals(f, cnn->biases2,    STAGE2_FILTERS);
+        write_reals(f, cnn->filters2,   STAGE2_WEIGHTS);
+        write_reals(f, cnn->m_biases2,  STAGE2_FILTERS);
+        write_reals(f, cnn->v_biases2,  STAGE2_FILTERS);
+        write_reals(f, cnn->m_filters2, STAGE2_WEIGHTS);
+        write_reals(f, cnn->v_filters2, STAGE2_WEIGHTS);
+    }
 
     fclose(f);
 }
@@ -634,12 +1000,15 @@ int load_cnn(const char *filename, void *cnn_ptr)
     if (f == NULL) return 0;
 
     char magic[16];
-    int version, nf, ks;
+    int version, nf, ks, stage2 = CNN_STAGE2_NONE;
     if (fscanf(f, "%15s %d %d %d", magic, &version, &nf, &ks) != 4
         || strcmp(magic, CNN_MAGIC) != 0
-        || version != CNN_VERSION
+        || version < 2 || version > CNN_VERSION
         || nf != NUM_FILTERS
-        || ks != CONV_SIZE)
+        || ks != CONV_SIZE
+        || !read_precision(f, version, filename, "load_cnn")
+        || (version >= 4 && fscanf(f, "%d", &stage2) != 1)
+        || stage2 < CNN_STAGE2_NONE || stage2 > CNN_STAGE2_CONV_POOL)
     {
         fprintf(stderr, "load_cnn: incompatible file %s (ignored)\n", filename);
         fclose(f);
@@ -652,12 +1021,24 @@ int load_cnn(const char *filename, void *cnn_ptr)
                      &cnn->adam_beta2_t) == 3);
 
     const size_t kernel_count = (size_t)NUM_FILTERS * CONV_SIZE * CONV_SIZE;
-    ok &= read_doubles(f, cnn->biases,                NUM_FILTERS);
-    ok &= read_doubles(f, &cnn->filters[0][0][0],     kernel_count);
-    ok &= read_doubles(f, cnn->m_biases,              NUM_FILTERS);
-    ok &= read_doubles(f, cnn->v_biases,              NUM_FILTERS);
-    ok &= read_doubles(f, &cnn->m_filters[0][0][0],   kernel_count);
-    ok &= read_doubles(f, &cnn->v_filters[0][0][0],   kernel_count);
+    ok &= read_reals(f, cnn->biases,                NUM_FILTERS);
+    ok &= read_reals(f, &cnn->filters[0][0][0],     kernel_count);
+    ok &= read_reals(f, cnn->m_biases,              NUM_FILTERS);
+    ok &= read_reals(f, cnn->v_biases,              NUM_FILTERS);
+    ok &= read_reals(f, &cnn->m_filters[0][0][0],   kernel_count);
+    ok &= read_reals(f, &cnn->v_filters[0][0][0],   kernel_count);
+
+    // Versions 2 and 3 predate the second stage: flat
+    cnn->stage2 = (CnnStage2)stage2;
+    cnn->output_size = cnn_stage2_outputs(cnn->stage2);
+    if (cnn->stage2 != CNN_STAGE2_NONE) {
+        ok &= read_reals(f, cnn->biases2,    STAGE2_FILTERS);
+        ok &= read_reals(f, cnn->filters2,   STAGE2_WEIGHTS);
+        ok &= read_reals(f, cnn->m_biases2,  STAGE2_FILTERS);
+        ok &= read_reals(f, cnn->v_biases2,  STAGE2_FILTERS);
+        ok &= read_reals(f, cnn->m_filters2, STAGE2_WEIGHTS);
+        ok &= read_reals(f, cnn->v_filters2, STAGE2_WEIGHTS);
+    }
 
     fclose(f);
 
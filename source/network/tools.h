@@ -2,6 +2,8 @@
 #define TOOLS_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include "../network/network.h"
 
 
@@ -12,6 +14,7 @@ typedef struct
     char *labels;     // Array of expected characters
     int count;        // Total number of training samples
     int capacity;     // Allocated capacity (for pre-allocation, internal use)
+    uint64_t source_key; // Dataset cache key of the images it was read from, or 0
 } TrainingDataSet;
 
 void progressBar(int step, int nb);
@@ -24,20 +27,46 @@ double sigmoid(double x);
 double dSigmoid(double x);
 double relu(double x);
 double dRelu(double x);
-void softmax(double *input, int n);
+void softmax(real *input, int n);
+// Weight initializers draw from rng_main
 double init_weight();
 double init_weight_he(int fan_in);
 double init_weight_xavier(int fan_in, int fan_out);
 
+// Zeroed block aligned to `alignment` (a power of two, multiple of
+// sizeof(void *)); blocks of 2 MB or more are huge-page aligned and
+// advised. Release with free(). Returns NULL on failure.
+#define ARENA_HUGE_PAGE (2u << 20)
+void *alloc_arena(size_t bytes, size_t alignment);
+
 int cfileexists(const char *filename);
 int fileempty(const char *filename);
+// 1 if both files exist and derived was last modified before source
+int file_older(const char *derived, const char *source);
+
+// 64-bit FNV-1a of n bytes, continuing from hash (FNV1A_INIT to start)
+#define FNV1A_INIT 0xcbf29ce484222325ull
+uint64_t fnv1a(uint64_t hash, const void *data, size_t n);
+
+// Replaces filename with data atomically: writes filename.tmp, fsyncs it,
+// then renames it over filename, so a crash leaves either the old or the
+// new file, never a torn one. Returns 1 on success.
+int write_file_atomic(const char *filename, const void *data, size_t size);
+// Text I/O of weight arrays, one value per line (full precision of `real`).
+// read_reals returns 0 on a short read.
+int  read_reals(FILE *f, real *dst, size_t n);
+void write_reals(FILE *f, const real *src, size_t n);
+// Reads the precision field (32/64) of a weight-file header of `version`,
+// warning when it differs from REAL_BITS. Returns 0 on a malformed value.
+int  read_precision(FILE *f, int version, const char *filename, const char *who);
+
 void save_network(const char *filename, struct network *network);
 // Returns 1 on full success, 0 if the file is missing/incompatible/truncated.
 int  load_network(const char *filename, struct network *network);
 // CNN save/load — uses void* to avoid circular include with cnn.h
 void save_cnn(const char *filename, void *cnn);
 int  load_cnn(const char *filename, void *cnn);
-void shuffle(int *array, size_t n);
+void shuffle(Rng *rng, int *array, size_t n);
 size_t IndexAnswer(struct network *net);
 char RetrieveChar(size_t val);
 int LabelIndex(char c);
@@ -3,6 +3,9 @@
 #include "../network/tools.h"
 #include "../network/network.h"
 #include "../network/cnn.h"
+#include "../network/quantize.h"
+#include "../network/inference.h"
+#include "../network/autotune.h"
 #include "../sdl/our_sdl.h"
 #include "../segmentation/segmentation.h"
 #include "../process/process.h"
@@ -14,8 +17,8 @@
 
 typedef struct
 {
-    CNN *cnn;
-    struct network *network;
+    InferenceModel *model;     // frozen fp CNN + MLP
+    QuantizedModel *quantized; // int8 model, preferred when present
     SDL_Surface *image;
     SDL_Surface ***chars;
     SDL_Surface **blocs;
@@ -68,68 +71,145 @@ static void free_ocr_context(OcrContext *ctx)
 
     if (ctx->image != NULL)
         SDL_FreeSurface(ctx->image);
-    freeNetwork(ctx->network);
-    free_cnn(ctx->cnn);
+    free_inference_model(ctx->model);
+    free_quantized_model(ctx->quantized);
     SDL_Quit();
 }
 
-static char recognize_matrix(CNN *cnn, struct network *network, int *matrix)
+#define OCR_CLASSES 52
+
+// Recognizes `count` glyph matrices at once and writes one char per glyph.
+// The 0/1 matrices are bit-packed and go through the binary conv path of
+// the int8 model if there is one, else of the fp model.
+static int recognize_batch(const OcrContext *ctx, int **matrices,
+                           int count, char *out)
 {
-    double input[IMAGE_PIXELS];
-    for (int i = 0; i < IMAGE_PIXELS; i++)
-        input[i] = (double)matrix[i];
+    GlyphBits *glyphs = malloc(sizeof(GlyphBits) * (count + 1));
+    size_t *labels = malloc(sizeof(size_t) * (count + 1));
+    if (glyphs == NULL || labels == NULL)
+    {
+        free(glyphs);
+        free(labels);
+        return 0;
+    }
+
+    for (int g = 0; g < count; g++)
+        glyph_pack_matrix(matrices[g], &glyphs[g]);
 
-    cnn_forward_infer(cnn, input, network->input_layer);
-    forward_pass(network);
-    return RetrieveChar(IndexAnswer(network));
+    int ok = 1;
+    if (ctx->quantized != NULL)
+        quantized_predict_glyphs(ctx->quantized, glyphs, count, labels);
+    else
+        ok = inference_predict_glyphs(ctx->model, glyphs, count, labels);
+    for (int g = 0; ok && g < count; g++)
+        out[g] = RetrieveChar(labels[g]);
+
+    free(glyphs);
+    free(labels);
+    return ok;
+}
+
+// Untrained models frozen as is, for setups where neither --train nor
+// --export-inference has been run
+static InferenceModel *freeze_fresh_models(void)
+{
+    CNN *cnn = init_cnn();
+    if (cnn == NULL) return NULL;
+
+    // Must match training: one input per CNN feature
+    struct network *net = InitializeNetwork(cnn->output_size, OCR_HIDDEN_NODES,
+                                            OCR_CLASSES, NULL);
+    InferenceModel *model = inference_from_training(cnn, net);
+
+    freeNetwork(net);
+    free_cnn(cnn);
+    return model;
 }
 
 static char *build_ocr_result(OcrContext *ctx)
 {
     int newline_count = ctx->bloc_count > 0 ? ctx->bloc_count - 1 : 0;
     char *result = calloc(ctx->chars_count + newline_count + 1, sizeof(char));
-    if (result == NULL)
+    int **glyphs = malloc(sizeof(int *) * (ctx->chars_count + 1));
+    char *recognized = malloc(ctx->chars_count + 1);
+    if (result == NULL || glyphs == NULL || recognized == NULL)
+    {
+        free(result);
+        free(glyphs);
+        free(recognized);
         return NULL;
+    }
+
+    // Gather every non-space glyph of the page so the MLP runs batched
+    int glyph_count = 0;
+    for (int i = 0; i < ctx->chars_count; i++)
+        if (ctx->chars_matrix[i] != NULL)
+            glyphs[glyph_count++] = ctx->chars_matrix[i];
+
+    if (!recognize_batch(ctx, glyphs, glyph_count, recognized))
+    {
+        free(result);
+        free(glyphs);
+        free(recognized);
+        return NULL;
+    }
 
     int matrix_idx = 0;
+    int glyph_idx = 0;
     int out_idx = 0;
     for (int b = 0; b < ctx->bloc_count; b++)
     {
         for (int c = 0; c < ctx->charslen[b]; c++)
         {
             int *matrix = ctx->chars_matrix[matrix_idx++];
-            result[out_idx++] = matrix == NULL
-                ? ' '
-                : recognize_matrix(ctx->cnn, ctx->network, matrix);
+            result[out_idx++] = matrix == NULL ? ' ' : recognized[glyph_idx++];
         }
         if (b < ctx->bloc_count - 1)
             result[out_idx++] = '\n';
     }
     result[out_idx] = '\0';
+
+    free(glyphs);
+    free(recognized);
     return result;
 }
 
+// A file derived from ocr.model (--quantize, --export-inference) is only
+// used while no --train has written a newer ocr.model since
+static int current_derived(const char *filename)
+{
+    if (!file_older(filename, OCR_MODEL_FILE))
+        return 1;
+    fprintf(stderr, "PerformOCR: %s is older than %s (ignored, run the export again)\n",
+            filename, OCR_MODEL_FILE);
+    return 0;
+}
+
 char *PerformOCR(const char *filepath)
 {
     if (filepath == NULL) return NULL;
 
     OcrContext ctx;
     memset(&ctx, 0, sizeof(ctx));
+    kernels_autotune();
 
-    // Initialize CNN and load its saved weights. Fall back to fresh init on failure.
-    ctx.cnn = init_cnn();
-    if (ctx.cnn == NULL) return NULL;
-    if (!load_cnn(OCR_CNN_WEIGHTS, ctx.cnn))
-        cnn_reset(ctx.cnn);
-
-    // Initialize MLP with CNN output size (must match training: FLATTEN_SIZE inputs)
-    ctx.network = InitializeNetwork(FLATTEN_SIZE, OCR_HIDDEN_NODES, 52, OCR_MLP_WEIGHTS);
-    if (ctx.network == NULL)
+    // Production path: the int8 model, which --quantize writes only when it
+    // measured faster than the fp one. Otherwise the frozen fp model from
+    // --export-inference, then the weights of the training model (both
+    // mapped in place), and as a last resort untrained weights.
+    if (current_derived(OCR_Q8_WEIGHTS))
+        ctx.quantized = load_quantized_model(OCR_Q8_WEIGHTS);
+    if (ctx.quantized == NULL)
     {
-        free_ocr_context(&ctx);
-        return NULL;
+        if (current_derived(OCR_INFERENCE_WEIGHTS))
+            ctx.model = load_inference_model(OCR_INFERENCE_WEIGHTS);
+        if (ctx.model == NULL)
+            ctx.model = load_inference_model(OCR_MODEL_FILE);
+        if (ctx.model == NULL)
+            ctx.model = freeze_fresh_models();
+        if (ctx.model == NULL)
+            return NULL;
     }
-    set_training_mode(ctx.network, 0);
 
     // Initialize SDL and load image
     init_sdl();
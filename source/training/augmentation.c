@@ -96,11 +96,15 @@ void shift_matrix(double *input, int dx, int dy, double *output) {
     }
 }
 
-// Add random noise into caller-supplied `output`
-void add_noise(double *input, double intensity, double *output) {
+// Add random noise into caller-supplied `output`: the flip mask of all
+// pixels is drawn in one bulk call
+void add_noise(double *input, double intensity, double *output, Rng *rng) {
+    uint64_t flips[RNG_MASK_WORDS(IMAGE_PIXELS)];
+    rng_bernoulli_mask(rng, flips, IMAGE_PIXELS, intensity);
+
     memcpy(output, input, IMAGE_PIXELS * sizeof(double));
     for (int i = 0; i < IMAGE_PIXELS; i++) {
-        if (((double)rand() / RAND_MAX) < intensity)
+        if (RNG_MASK_BIT(flips, i))
             output[i] = (output[i] > 0.5) ? 0.0 : 1.0;
     }
 }
@@ -123,7 +127,7 @@ void scale_matrix(double *input, double scale, double *output) {
 }
 
 // Main augmentation function
-int augment_dataset(TrainingDataSet *dataset, int multiplier) {
+int augment_dataset(TrainingDataSet *dataset, int multiplier, Rng *rng) {
     if (!dataset || multiplier <= 1) return 0;
 
     printf("Augmenting dataset by %dx...\n", multiplier);
@@ -153,20 +157,20 @@ int augment_dataset(TrainingDataSet *dataset, int multiplier) {
         char label = dataset->labels[i];
 
         for (int m = 1; m < multiplier; m++) {
-            int op = rand() % 4;
+            int op = rng_below(rng, 4);
 
             if (op == 0) {
-                double angle = (rand() % 41) - 20;  // -20 to +20 degrees
+                double angle = (int)rng_below(rng, 41) - 20;  // -20 to +20 degrees
                 rotate_matrix(original_img, angle, scratch);
             } else if (op == 1) {
-                int dx = (rand() % 7) - 3;  // -3 to +3 pixels
-                int dy = (rand() % 7) - 3;
+                int dx = (int)rng_below(rng, 7) - 3;  // -3 to +3 pixels
+                int dy = (int)rng_below(rng, 7) - 3;
                 shift_matrix(original_img, dx, dy, scratch);
             } else if (op == 2) {
-                double noise_level = 0.02 + ((double)rand() / RAND_MAX) * 0.08;  // 2-10%
-                add_noise(original_img, noise_level, scratch);
+                double noise_level = 0.02 + rng_uniform(rng) * 0.08;  // 2-10%
+                add_noise(original_img, noise_level, scratch, rng);
             } else {
-                double scale = 0.75 + ((double)rand() / RAND_MAX) * 0.5;  // 0.75-1.25
+                double scale = 0.75 + rng_uniform(rng) * 0.5;  // 0.75-1.25
                 scale_matrix(original_img, scale, scratch);
             }
 
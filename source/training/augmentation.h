@@ -7,13 +7,14 @@
 
 // Augment the dataset in-memory by a multiplier factor
 // E.g. multiplier=10 means the dataset size increases by 10x
+// Random choices are drawn from rng
 // Returns 1 on success, 0 on failure
-int augment_dataset(TrainingDataSet *dataset, int multiplier);
+int augment_dataset(TrainingDataSet *dataset, int multiplier, Rng *rng);
 
 // Individual transformation functions — write into caller-supplied output[IMAGE_PIXELS]
 void rotate_matrix(double *input, double angle, double *output);
 void shift_matrix(double *input, int dx, int dy, double *output);
 void scale_matrix(double *input, double scale_factor, double *output);
-void add_noise(double *input, double intensity, double *output);
+void add_noise(double *input, double intensity, double *output, Rng *rng);
 
 #endif
@@ -0,0 +1,267 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "checkpoint.h"
+#include "../network/tools.h"
+
+#include <err.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATE_MAGIC "OCRSTATE"
+#define STATE_VERSION 2
+
+// The bytes of one or more files of a batch. Files sharing a block are
+// always all pending or all taken by the thread, so refs is only ever
+// touched by one side.
+typedef struct
+{
+    void *data;
+    size_t size;
+    int refs;
+} SharedData;
+
+typedef struct
+{
+    char *filename;
+    SharedData *data;
+    int replaceable;
+} PendingFile;
+
+static void release_data(SharedData *data)
+{
+    if (--data->refs > 0) return;
+    free(data->data);
+    free(data);
+}
+
+struct CheckpointWriter
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+    // Files waiting for the thread, in write order, guarded by lock
+    PendingFile *pending;
+    int pending_count;
+    int pending_capacity;
+    int stopping;
+};
+
+static void *writer_main(void *arg)
+{
+    CheckpointWriter *writer = arg;
+    PendingFile *batch = NULL;
+    pthread_mutex_lock(&writer->lock);
+    for (;;)
+    {
+        while (writer->pending_count == 0 && !writer->stopping)
+            pthread_cond_wait(&writer->wake, &writer->lock);
+        if (writer->pending_count == 0)
+            break;
+
+        // Take the whole list, so the files of a batch land in order
+        int count = writer->pending_count;
+        batch = writer->pending;
+        writer->pending = NULL;
+        writer->pending_count = 0;
+        writer->pending_capacity = 0;
+        pthread_mutex_unlock(&writer->lock);
+
+        for (int k = 0; k < count; k++)
+        {
+            SharedData *data = batch[k].data;
+            if (!write_file_atomic(batch[k].filename, data->data, data->size))
+                fprintf(stderr, "checkpoint: failed to write %s\n", batch[k].filename);
+            free(batch[k].filename);
+            release_data(data);
+        }
+        free(batch);
+
+        pthread_mutex_lock(&writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+CheckpointWriter *checkpoint_writer_create(void)
+{
+    CheckpointWriter *writer = calloc(1, sizeof(CheckpointWriter));
+    if (writer == NULL) return NULL;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0)
+    {
+        pthread_cond_destroy(&writer->wake);
+        pthread_mutex_destroy(&writer->lock);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+void checkpoint_submit(CheckpointWriter *writer, const CheckpointFile *files,
+                       int count)
+{
+    char *names[CHECKPOINT_MAX_FILES];
+    SharedData *blocks[CHECKPOINT_MAX_FILES];
+    for (int k = 0; k < count; k++)
+    {
+        if ((names[k] = strdup(files[k].filename)) == NULL)
+            errx(1, "Not enough memory!");
+        blocks[k] = NULL;
+        for (int j = 0; j < k && blocks[k] == NULL; j++)
+            if (files[j].data == files[k].data)
+                blocks[k] = blocks[j];
+        if (blocks[k] == NULL)
+        {
+            if ((blocks[k] = malloc(sizeof(SharedData))) == NULL)
+                errx(1, "Not enough memory!");
+            blocks[k]->data = files[k].data;
+            blocks[k]->size = files[k].size;
+            blocks[k]->refs = 0;
+        }
+        blocks[k]->refs++;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+
+    // Superseded files are dropped, the others keep their place
+    int kept = 0;
+    for (int p = 0; p < writer->pending_count; p++)
+    {
+        PendingFile *old = &writer->pending[p];
+        int superseded = 0;
+        for (int k = 0; k < count && !superseded && old->replaceable; k++)
+            superseded = strcmp(old->filename, files[k].filename) == 0;
+        if (superseded)
+        {
+            free(old->filename);
+            release_data(old->data);
+        }
+        else
+            writer->pending[kept++] = *old;
+    }
+
+    if (kept + count > writer->pending_capacity)
+    {
+        int capacity = kept + count;
+        PendingFile *grown = realloc(writer->pending, sizeof(PendingFile) * capacity);
+        if (grown == NULL) errx(1, "Not enough memory!");
+        writer->pending = grown;
+        writer->pending_capacity = capacity;
+    }
+    for (int k = 0; k < count; k++)
+    {
+        PendingFile file = { names[k], blocks[k], files[k].replaceable };
+        writer->pending[kept + k] = file;
+    }
+    writer->pending_count = kept + count;
+
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void checkpoint_writer_free(CheckpointWriter *writer)
+{
+    if (writer == NULL) return;
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = 1;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+    pthread_cond_destroy(&writer->wake);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+}
+
+static void write_rng(FILE *f, const char *name, const Rng *rng)
+{
+    fprintf(f, "%s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+            name, rng->s[0], rng->s[1], rng->s[2], rng->s[3]);
+}
+
+static int read_rng(FILE *f, const char *name, Rng *rng)
+{
+    char key[32];
+    return fscanf(f, "%31s %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+                  key, &rng->s[0], &rng->s[1], &rng->s[2], &rng->s[3]) == 5
+        && strcmp(key, name) == 0;
+}
+
+char *training_state_format(const TrainingState *state, size_t *size)
+{
+    char *text = NULL;
+    FILE *f = open_memstream(&text, size);
+    if (f == NULL) return NULL;
+
+    fprintf(f, "%s %d\n", STATE_MAGIC, STATE_VERSION);
+    fprintf(f, "epoch %d\n", state->epoch);
+    fprintf(f, "eta %.17g\n", state->eta);
+    fprintf(f, "best_val_accuracy %.9g\n", state->best_val_accuracy);
+    fprintf(f, "epochs_without_improvement %d\n", state->epochs_without_improvement);
+    fprintf(f, "batch_size %d\n", state->batch_size);
+    fprintf(f, "run_seed %llu\n", state->run_seed);
+    write_rng(f, "data_rng", &state->data_rng);
+    write_rng(f, "rng", &state->rng);
+    write_rng(f, "dropout_rng", &state->dropout_rng);
+    fprintf(f, "model_checksum %" PRIu64 "\n", state->model_checksum);
+    fprintf(f, "dataset_key %" PRIu64 "\n", state->dataset_key);
+    fprintf(f, "count %d\n", state->count);
+    for (int i = 0; i < state->count; i++)
+        fprintf(f, "%d\n", state->order[i]);
+
+    if (fclose(f) != 0)
+    {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+int training_state_load(const char *filename, TrainingState *state)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) return 0;
+
+    char magic[16];
+    int version = 0;
+    memset(state, 0, sizeof(*state));
+    int ok = fscanf(f, "%15s %d", magic, &version) == 2
+          && strcmp(magic, STATE_MAGIC) == 0 && version == STATE_VERSION
+          && fscanf(f, " epoch %d", &state->epoch) == 1
+          && fscanf(f, " eta %lf", &state->eta) == 1
+          && fscanf(f, " best_val_accuracy %f", &state->best_val_accuracy) == 1
+          && fscanf(f, " epochs_without_improvement %d",
+                    &state->epochs_without_improvement) == 1
+          && fscanf(f, " batch_size %d", &state->batch_size) == 1
+          && fscanf(f, " run_seed %llu", &state->run_seed) == 1
+          && read_rng(f, "data_rng", &state->data_rng)
+          && read_rng(f, "rng", &state->rng)
+          && read_rng(f, "dropout_rng", &state->dropout_rng)
+          && fscanf(f, " model_checksum %" SCNu64, &state->model_checksum) == 1
+          && fscanf(f, " dataset_key %" SCNu64, &state->dataset_key) == 1
+          && fscanf(f, " count %d", &state->count) == 1
+          && state->epoch >= 0 && state->count > 0;
+
+    if (ok)
+    {
+        state->order = malloc(sizeof(int) * state->count);
+        if (state->order == NULL) errx(1, "Not enough memory!");
+        for (int i = 0; ok && i < state->count; i++)
+            ok = fscanf(f, "%d", &state->order[i]) == 1
+              && state->order[i] >= 0 && state->order[i] < state->count;
+    }
+    fclose(f);
+
+    if (!ok)
+    {
+        fprintf(stderr, "training_state_load: file %s truncated or corrupt\n", filename);
+        free(state->order);
+        state->order = NULL;
+    }
+    return ok;
+}
@@ -0,0 +1,66 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../network/rng.h"
+
+// Background writer of training checkpoints. The training thread packs
+// snapshots in memory (model_pack(), training_state_format()) and hands
+// them over; a writer thread saves each with write_file_atomic() (temp file,
+// fsync, rename), so submitting never waits for the disk.
+typedef struct CheckpointWriter CheckpointWriter;
+
+typedef struct
+{
+    const char *filename;
+    void *data;           // malloc'ed; the writer owns and frees it, once
+                          // when several files of a batch share it
+    size_t size;
+    int replaceable;      // a later batch may drop it if not started yet
+} CheckpointFile;
+
+#define CHECKPOINT_MAX_FILES 8
+
+// NULL on failure.
+CheckpointWriter *checkpoint_writer_create(void);
+
+// Queues a batch of count files, written in order. Replaceable files of an
+// earlier batch not started yet are dropped when this one has a file of the
+// same name; the others are kept and written before this batch, so files
+// that refer to each other (resume weights and state) land in submission
+// order. count <= CHECKPOINT_MAX_FILES.
+void checkpoint_submit(CheckpointWriter *writer, const CheckpointFile *files,
+                       int count);
+
+// Writes the pending files, if any, then stops the thread.
+void checkpoint_writer_free(CheckpointWriter *writer);
+
+// What --resume needs besides the weights: the epoch loop, the schedule
+// and every generator of an interrupted run.
+typedef struct
+{
+    int epoch;                      // next epoch to run
+    double eta;                     // MLP learning rate, decay applied
+    float best_val_accuracy;
+    int epochs_without_improvement;
+    int batch_size;                 // 0: per-sample training
+    unsigned long long run_seed;    // dropout seed of mini-batch training
+    Rng data_rng;                   // rng_main at the start of the run: split,
+                                    // augmentation and init replay from it
+    Rng rng;                        // rng_main after the epoch (shuffles)
+    Rng dropout_rng;                // dropout stream of per-sample training
+    uint64_t model_checksum;        // of the weights saved with this state
+    uint64_t dataset_key;           // source_key of the images it trained on
+    int count;                      // augmented training samples
+    int *order;                     // sample order after the last shuffle, [count]
+} TrainingState;
+
+// Text form of state, malloc'ed, for checkpoint_submit(). NULL on OOM.
+char *training_state_format(const TrainingState *state, size_t *size);
+
+// Reads a state written by training_state_format(); order is malloc'ed.
+// Returns 0 if the file is missing or malformed.
+int training_state_load(const char *filename, TrainingState *state);
+
+#endif
@@ -0,0 +1,336 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "parallel.h"
+#include "../common.h"
+#include "../network/optimizer.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One sample of the current batch and the network replica that processes it
+typedef struct
+{
+    struct network *net;
+    const double *input;
+    int label;
+    unsigned long long seed;
+    int correct;
+    double loss;
+
+    // Second CNN stage only: its input and input gradients, pool masks,
+    // and the sample's stage-2 weight gradients ([STAGE2_WEIGHTS] then
+    // [STAGE2_FILTERS])
+    real *stage1;
+    real *stage1_grads;
+    unsigned char *stage2_mask;
+    real *stage2_grads;
+} Slot;
+
+typedef enum
+{
+    PHASE_FEATURES, // CNN forward of every slot, into its MLP input
+    PHASE_CATCH_UP, // lazy Adam: rows the batch reads, split by rows
+    PHASE_SAMPLES,  // MLP forward + deltas of every slot, CNN backward
+    PHASE_UPDATE,   // reduction and Adam step, split by rows
+    PHASE_STOP
+} Phase;
+
+struct ParallelTrainer
+{
+    CNN *cnn;
+    struct network *net;
+    int threads;
+    pthread_t *workers;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    Phase phase;
+
+    int batch_size;
+    Slot *slots;                // [batch_size]
+    struct network **samples;   // [batch_size]
+    ConvWorkspace *conv; // slot s is workspace image s
+    int count;
+    AdamCoeffs adam;
+    real *scratch; // [threads][max(H, output_stride)]
+    int scratch_stride;
+};
+
+typedef struct
+{
+    ParallelTrainer *trainer;
+    int id;
+} WorkerArgs;
+
+// splitmix64 finalizer
+static unsigned long long mix64(unsigned long long z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void slot_features(ParallelTrainer *trainer, int s)
+{
+    Slot *slot = &trainer->slots[s];
+    const CNN *cnn = trainer->cnn;
+
+    int staged = cnn->stage2 != CNN_STAGE2_NONE;
+    cnn_forward_batch(&cnn->filters[0][0][0], cnn->biases, trainer->conv, s, 1,
+                      &slot->input, staged ? slot->stage1 : slot->net->input_layer);
+    if (staged)
+        cnn_stage2_forward(cnn->stage2, cnn->filters2, cnn->biases2, slot->stage1,
+                           slot->net->input_layer, slot->stage2_mask);
+}
+
+static void train_slot(ParallelTrainer *trainer, int s)
+{
+    Slot *slot = &trainer->slots[s];
+    struct network *net = slot->net;
+    const CNN *cnn = trainer->cnn;
+    int staged = cnn->stage2 != CNN_STAGE2_NONE;
+
+    for (int o = 0; o < net->number_of_outputs; o++)
+        net->goal[o] = 0.0;
+    net->goal[slot->label] = 1.0;
+
+    network_seed_dropout(net, slot->seed);
+    forward_pass(net);
+    slot->loss = -my_log(net->output_layer[slot->label] + 1e-12);
+    slot->correct = (int)IndexAnswer(net) == slot->label;
+
+    back_propagation_deltas(net);
+    if (!staged)
+    {
+        cnn_backward_batch(trainer->conv, s, 1, net->delta_input);
+        return;
+    }
+    memset(slot->stage2_grads, 0, sizeof(real) * (STAGE2_WEIGHTS + STAGE2_FILTERS));
+    cnn_stage2_backward(cnn->stage2, cnn->filters2, slot->stage1, slot->stage2_mask,
+                        net->delta_input, slot->stage1_grads, slot->stage2_grads,
+                        slot->stage2_grads + STAGE2_WEIGHTS);
+    cnn_backward_batch(trainer->conv, s, 1, slot->stage1_grads);
+}
+
+// Mean of the CNN gradients the slots scattered, summed in slot order,
+// then one step
+static void update_cnn(ParallelTrainer *trainer)
+{
+    CNN *cnn = trainer->cnn;
+    real *fg = &cnn->filter_grads[0][0][0];
+    const int taps = NUM_FILTERS * CONV_TAPS;
+
+    cnn_gradients_batch(cnn, trainer->conv, trainer->count);
+
+    real mean = (real)(1.0 / trainer->count);
+    for (int k = 0; k < taps; k++)
+        fg[k] *= mean;
+    for (int f = 0; f < NUM_FILTERS; f++)
+        cnn->bias_grads[f] *= mean;
+
+    if (cnn->stage2 != CNN_STAGE2_NONE)
+    {
+        memset(cnn->filter2_grads, 0, sizeof(cnn->filter2_grads));
+        memset(cnn->bias2_grads, 0, sizeof(cnn->bias2_grads));
+        for (int s = 0; s < trainer->count; s++)
+        {
+            const real *g = trainer->slots[s].stage2_grads;
+            for (int k = 0; k < STAGE2_WEIGHTS; k++)
+                cnn->filter2_grads[k] += g[k];
+            for (int o = 0; o < STAGE2_FILTERS; o++)
+                cnn->bias2_grads[o] += g[STAGE2_WEIGHTS + o];
+        }
+        for (int k = 0; k < STAGE2_WEIGHTS; k++)
+            cnn->filter2_grads[k] *= mean;
+        for (int o = 0; o < STAGE2_FILTERS; o++)
+            cnn->bias2_grads[o] *= mean;
+    }
+
+    cnn_adam_step(cnn, trainer->net->eta * TRAIN_CNN_ETA_SCALE);
+}
+
+static void run_phase(ParallelTrainer *trainer, int id)
+{
+    switch (trainer->phase)
+    {
+    case PHASE_FEATURES:
+        for (int s = id; s < trainer->count; s += trainer->threads)
+            slot_features(trainer, s);
+        break;
+    case PHASE_CATCH_UP:
+        network_catch_up_batch(trainer->net, trainer->samples, trainer->count,
+                               id, trainer->threads);
+        break;
+    case PHASE_SAMPLES:
+        for (int s = id; s < trainer->count; s += trainer->threads)
+            train_slot(trainer, s);
+        break;
+    case PHASE_UPDATE:
+        network_batch_step(trainer->net, &trainer->adam, trainer->samples,
+                           trainer->count, id, trainer->threads,
+                           trainer->scratch + (size_t)id * trainer->scratch_stride);
+        if (id == 0)
+            update_cnn(trainer);
+        break;
+    case PHASE_STOP:
+        break;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    WorkerArgs *args = arg;
+    ParallelTrainer *trainer = args->trainer;
+    int id = args->id;
+    free(args);
+
+    for (;;)
+    {
+        pthread_barrier_wait(&trainer->start);
+        if (trainer->phase == PHASE_STOP)
+            break;
+        run_phase(trainer, id);
+        pthread_barrier_wait(&trainer->done);
+    }
+    return NULL;
+}
+
+// Runs one phase on every worker, the calling thread acting as worker 0
+static void dispatch(ParallelTrainer *trainer, Phase phase)
+{
+    trainer->phase = phase;
+    pthread_barrier_wait(&trainer->start);
+    if (phase == PHASE_STOP)
+        return;
+    run_phase(trainer, 0);
+    pthread_barrier_wait(&trainer->done);
+}
+
+ParallelTrainer *parallel_trainer_create(CNN *cnn, struct network *net, int threads,
+                                         int batch_size)
+{
+    if (threads < 1) threads = 1;
+    if (batch_size < 1) batch_size = 1;
+    if (batch_size > PARALLEL_MAX_BATCH_SIZE) batch_size = PARALLEL_MAX_BATCH_SIZE;
+
+    ParallelTrainer *trainer = calloc(1, sizeof(ParallelTrainer));
+    if (trainer == NULL) return NULL;
+    trainer->cnn = cnn;
+    trainer->net = net;
+    trainer->threads = threads;
+    trainer->batch_size = batch_size;
+
+    int H = net->number_of_hidden_nodes;
+    int Os = net->output_stride;
+    trainer->scratch_stride = H > Os ? H : Os;
+    trainer->scratch = malloc(sizeof(real) * (size_t)threads * trainer->scratch_stride);
+    trainer->workers = malloc(sizeof(pthread_t) * threads);
+    trainer->slots = calloc(batch_size, sizeof(Slot));
+    trainer->samples = calloc(batch_size, sizeof(struct network *));
+    trainer->conv = conv_workspace_create(batch_size, 1);
+    if (trainer->scratch == NULL || trainer->workers == NULL || trainer->slots == NULL
+        || trainer->samples == NULL || trainer->conv == NULL)
+        errx(1, "Not enough memory!");
+
+    for (int s = 0; s < batch_size; s++)
+    {
+        Slot *slot = &trainer->slots[s];
+        slot->net = network_replica(net);
+        if (cnn->stage2 == CNN_STAGE2_NONE)
+            continue;
+        slot->stage1 = malloc(sizeof(real) * FLATTEN_SIZE);
+        slot->stage1_grads = malloc(sizeof(real) * FLATTEN_SIZE);
+        slot->stage2_mask = malloc(STAGE2_MAX_OUTPUTS);
+        slot->stage2_grads = malloc(sizeof(real) * (STAGE2_WEIGHTS + STAGE2_FILTERS));
+        if (slot->stage1 == NULL || slot->stage1_grads == NULL
+            || slot->stage2_mask == NULL || slot->stage2_grads == NULL)
+            errx(1, "Not enough memory!");
+    }
+
+    pthread_barrier_init(&trainer->start, NULL, threads);
+    pthread_barrier_init(&trainer->done, NULL, threads);
+    for (int t = 1; t < threads; t++)
+    {
+        WorkerArgs *args = malloc(sizeof(WorkerArgs));
+        if (args == NULL)
+            errx(1, "Not enough memory!");
+        args->trainer = trainer;
+        args->id = t;
+        if (pthread_create(&trainer->workers[t], NULL, worker_main, args) != 0)
+            errx(1, "Failed to start training thread %d of %d", t, threads);
+    }
+    return trainer;
+}
+
+void parallel_trainer_free(ParallelTrainer *trainer)
+{
+    if (trainer == NULL) return;
+
+    dispatch(trainer, PHASE_STOP);
+    for (int t = 1; t < trainer->threads; t++)
+        pthread_join(trainer->workers[t], NULL);
+    pthread_barrier_destroy(&trainer->start);
+    pthread_barrier_destroy(&trainer->done);
+
+    for (int s = 0; s < trainer->batch_size; s++)
+    {
+        Slot *slot = &trainer->slots[s];
+        freeNetwork(slot->net);
+        free(slot->stage1);
+        free(slot->stage1_grads);
+        free(slot->stage2_mask);
+        free(slot->stage2_grads);
+    }
+    conv_workspace_free(trainer->conv);
+    free(trainer->slots);
+    free(trainer->samples);
+    free(trainer->scratch);
+    free(trainer->workers);
+    free(trainer);
+}
+
+void parallel_train_epoch(ParallelTrainer *trainer, const TrainingDataSet *set,
+                          const int *order, int n, unsigned long long seed,
+                          int epoch, EpochStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    int pos = 0;
+    while (pos < n)
+    {
+        // Fill the batch with the next labelled samples
+        trainer->count = 0;
+        for (; pos < n && trainer->count < trainer->batch_size; pos++)
+        {
+            int idx = order[pos];
+            int label = LabelIndex(set->labels[idx]);
+            if (label == -1) continue;
+
+            Slot *slot = &trainer->slots[trainer->count];
+            slot->input = set->inputs[idx];
+            slot->label = label;
+            slot->seed = mix64(seed ^ mix64(((unsigned long long)epoch << 32) + pos));
+            trainer->samples[trainer->count] = slot->net;
+            trainer->count++;
+        }
+        if (trainer->count == 0) break;
+
+        // Replicas share the master's weights but not its row steps: lazy
+        // rows the batch reads are caught up before anything reads them
+        dispatch(trainer, PHASE_FEATURES);
+        if (optimizer_mode == OPTIMIZER_LAZY_ADAM)
+            dispatch(trainer, PHASE_CATCH_UP);
+        dispatch(trainer, PHASE_SAMPLES);
+
+        for (int s = 0; s < trainer->count; s++)
+        {
+            stats->loss += trainer->slots[s].loss;
+            stats->correct += trainer->slots[s].correct;
+        }
+        stats->samples += trainer->count;
+
+        trainer->adam = network_begin_step(trainer->net);
+        dispatch(trainer, PHASE_UPDATE);
+    }
+}
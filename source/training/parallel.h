@@ -0,0 +1,41 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "../network/network.h"
+#include "../network/cnn.h"
+#include "../network/tools.h"
+
+// Default samples per Adam step of the data-parallel trainer. The batch
+// does not depend on the thread count, so a seeded run gives the same
+// weights for any count.
+#define PARALLEL_BATCH_SIZE 32
+#define PARALLEL_MAX_BATCH_SIZE 1024
+
+// The CNN learns at this fraction of the MLP learning rate.
+#define TRAIN_CNN_ETA_SCALE 0.1
+
+typedef struct
+{
+    int samples;  // labelled samples trained on
+    int correct;  // predicted right by the forward pass before the update
+    double loss;  // summed cross-entropy
+} EpochStats;
+
+typedef struct ParallelTrainer ParallelTrainer;
+
+// Trains cnn + net with `threads` workers, the calling thread being one of
+// them, in batches of `batch_size` samples (clamped to
+// [1, PARALLEL_MAX_BATCH_SIZE]). Each batch slot owns a network replica and
+// shares one batched convolution workspace; gradients are reduced in slot
+// order and applied in one Adam step. NULL on failure.
+ParallelTrainer *parallel_trainer_create(CNN *cnn, struct network *net, int threads,
+                                         int batch_size);
+void parallel_trainer_free(ParallelTrainer *trainer);
+
+// One epoch over set samples order[0..n) in mini-batches. The dropout of
+// the sample at position k is seeded from (seed, epoch, k).
+void parallel_train_epoch(ParallelTrainer *trainer, const TrainingDataSet *set,
+                          const int *order, int n, unsigned long long seed,
+                          int epoch, EpochStats *stats);
+
+#endif
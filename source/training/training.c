@@ -3,11 +3,18 @@
 #include "../network/tools.h"
 #include "../network/network.h"
 #include "../network/cnn.h"
+#include "../network/quantize.h"
+#include "../network/inference.h"
+#include "../network/modelfile.h"
+#include "../network/autotune.h"
 #include "augmentation.h"
+#include "checkpoint.h"
+#include "parallel.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
+#include <time.h>
 
 
 enum
@@ -31,6 +38,7 @@ static TrainingDataSet *allocate_dataset_shell(int capacity)
     dataset->labels = malloc(sizeof(char) * capacity);
     dataset->count = 0;
     dataset->capacity = capacity;
+    dataset->source_key = 0;
 
     if (dataset->inputs == NULL || dataset->labels == NULL)
         errx(1, "Failed to allocate dataset samples");
@@ -81,7 +89,7 @@ static void split_dataset_stratified(TrainingDataSet *dataset,
         indices[i] = i;
     }
 
-    shuffle(indices, dataset->count);
+    shuffle(&rng_main, indices, dataset->count);
     for (int i = 0; i < dataset->count; i++)
     {
         int source_index = indices[i];
@@ -123,8 +131,10 @@ static int argmax_output(struct network *net)
 
 static int predict_label(CNN *cnn, struct network *net, double *input)
 {
-    cnn_forward_infer(cnn, input, net->input_layer);
-    forward_pass(net);
+    int indices[FLATTEN_SIZE];
+    real values[FLATTEN_SIZE];
+    int nnz = cnn_forward_infer_sparse(cnn, input, indices, values);
+    forward_pass_sparse(net, indices, values, nnz);
     return argmax_output(net);
 }
 
@@ -145,13 +155,113 @@ static float validation_accuracy(CNN *cnn, struct network *net, TrainingDataSet
     return val_set->count > 0 ? (float)correct / val_set->count * 100.0f : 0.0f;
 }
 
+// Per-sample SGD on the calling thread, one Adam step per sample.
+static void train_epoch_sequential(CNN *cnn, struct network *net,
+                                   const TrainingDataSet *train_set,
+                                   const int *indices, EpochStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < train_set->count; i++)
+    {
+        int idx = indices[i];
+
+        int label_index = LabelIndex(train_set->labels[idx]);
+        if (label_index == -1) continue;
+
+        cnn_forward(cnn, train_set->inputs[idx], net->input_layer);
+        set_goal(net, label_index);
+        network_catch_up(net);
+        forward_pass(net);
+
+        // Cross-entropy loss on the correct class
+        double p = net->output_layer[label_index];
+        stats->loss += -my_log(p + 1e-12);
+        stats->samples++;
+
+        if (argmax_output(net) == label_index)
+            stats->correct++;
+
+        back_propagation(net);
+        cnn_backward(cnn, net->delta_input, net->eta * TRAIN_CNN_ETA_SCALE);
+    }
+}
+
 void TrainNetwork(void)
 {
+    TrainingOptions options = { 0, 0, 0, -1, 0, 0, 0 };
+    TrainNetworkWithOptions(&options);
+}
+
+// The latest weights alternate between two files, so the state always
+// names a complete one even if a crash cuts the next write short
+static const char *resume_model_file(int epoch)
+{
+    return epoch % 2 == 0 ? OCR_RESUME_MODEL_EVEN : OCR_RESUME_MODEL_ODD;
+}
+
+// Hands the checkpoints of the epoch just finished to the writer thread:
+// the model when it is a new best, then the latest weights and the loop
+// state for --resume. Both weight files share one packed copy. A pending
+// best model may be replaced by a newer one, but the resume files are all
+// written in order: weights k+2 go to the file state k names, so they must
+// not land before state k+1 does.
+static void submit_checkpoints(CheckpointWriter *checkpoints, CNN *cnn,
+                               struct network *net, int new_best,
+                               TrainingState *state)
+{
+    size_t size = 0;
+    void *weights = model_pack(cnn, net, 1, &size);
+    if (weights == NULL) errx(1, "Not enough memory!");
+    state->model_checksum = ((const ModelHeader *)weights)->checksum;
+
+    CheckpointFile files[3];
+    int count = 0;
+    if (new_best)
+    {
+        files[count].filename = OCR_MODEL_FILE;
+        files[count].data = weights;
+        files[count].size = size;
+        files[count++].replaceable = 1;
+    }
+
+    files[count].filename = resume_model_file(state->epoch);
+    files[count].data = weights;
+    files[count].size = size;
+    files[count++].replaceable = 0;
+
+    files[count].filename = OCR_RESUME_STATE;
+    files[count].data = training_state_format(state, &files[count].size);
+    files[count].replaceable = 0;
+    if (files[count++].data == NULL) errx(1, "Not enough memory!");
+
+    checkpoint_submit(checkpoints, files, count);
+}
+
+void TrainNetworkWithOptions(const TrainingOptions *options)
+{
+    kernels_autotune();
+
+    // Resuming replays the interrupted run's split, augmentation and init
+    // from its saved generator, then restores the loop state on top
+    TrainingState resume;
+    memset(&resume, 0, sizeof(resume));
+    if (options->resume)
+    {
+        if (!training_state_load(OCR_RESUME_STATE, &resume))
+            errx(1, "No interrupted training to resume in %s", OCR_RESUME_STATE);
+        rng_main = resume.data_rng;
+    }
+    // A seed fixes the split, augmentation, init, shuffles and dropout
+    else if (options->seeded)
+        rng_seed(&rng_main, options->seed);
+    Rng data_rng = rng_main;
+
     printf("Loading Dataset...\n");
     TrainingDataSet *dataset = loadDataSet();
 
     if (dataset == NULL)
         errx(1, "Failed to load dataset!");
+    uint64_t dataset_key = dataset->source_key;
 
     TrainingDataSet *train_set = NULL;
     TrainingDataSet *val_set = NULL;
@@ -165,92 +275,149 @@ void TrainNetwork(void)
 
     // Augment ONLY the training set
     printf("Augmenting training set by %dx...\n", TRAIN_AUGMENT_MULTIPLIER);
-    augment_dataset(train_set, TRAIN_AUGMENT_MULTIPLIER);
+    augment_dataset(train_set, TRAIN_AUGMENT_MULTIPLIER, &rng_main);
     printf("Augmentation complete. Training set size: %d\n", train_set->count);
+    if (options->resume && (train_set->count != resume.count
+                            || dataset_key != resume.dataset_key))
+        errx(1, "The training images changed since the interrupted run");
 
-    // Initialize CNN (load saved weights if they exist, fall back to fresh init on failure)
+    // Initialize CNN (load the saved model if there is one, keep the fresh
+    // init when it is missing or incompatible)
     printf("\nInitializing CNN (Conv 3x3 -> Pool 2x2)...\n");
     CNN *cnn = init_cnn();
     if (!cnn) errx(1, "Failed to init CNN");
-    if (!fileempty(OCR_CNN_WEIGHTS))
+    const char *model_file = options->resume ? resume_model_file(resume.epoch)
+                                             : OCR_MODEL_FILE;
+    ModelFile *saved_model = model_open(model_file);
+    if (options->resume && (saved_model == NULL
+                            || saved_model->header->checksum != resume.model_checksum))
+        errx(1, "%s does not hold the weights of the interrupted run", model_file);
+    int loaded = model_load_cnn(saved_model, cnn);
+    if (loaded)
+        printf("Loaded CNN weights from %s\n", model_file);
+
+    // A requested shape other than the saved one starts from scratch
+    if (!options->resume && options->cnn_shape >= 0
+        && cnn->stage2 != (CnnStage2)options->cnn_shape)
     {
-        if (load_cnn(OCR_CNN_WEIGHTS, cnn))
-            printf("Loaded CNN weights from %s\n", OCR_CNN_WEIGHTS);
-        else
+        const char *saved = cnn_stage2_name(cnn->stage2);
+        cnn_set_stage2(cnn, (CnnStage2)options->cnn_shape);
+        if (loaded)
+        {
+            printf("Saved CNN is %s, starting a fresh %s CNN\n",
+                   saved, cnn_stage2_name(cnn->stage2));
             cnn_reset(cnn);
+        }
     }
 
-    // Initialize MLP with CNN output size (1352 inputs)
-    // 1352 = 8 filters * 13 * 13
+    // Initialize MLP with CNN output size (1352 inputs when flat,
+    // 8 filters * 13 * 13); a saved MLP of another width is ignored
     int hidden_nodes = OCR_HIDDEN_NODES;
     printf("\n=== NETWORK CONFIGURATION ===\n");
-    printf("Architecture: CNN -> %d-%d-52\n", FLATTEN_SIZE, hidden_nodes);
+    printf("Architecture: CNN (%s) -> %d-%d-52\n", cnn_stage2_name(cnn->stage2),
+           cnn->output_size, hidden_nodes);
 
-    struct network *net = InitializeNetwork(FLATTEN_SIZE, hidden_nodes, 52, OCR_MLP_WEIGHTS);
+    struct network *net = InitializeNetwork(cnn->output_size, hidden_nodes, 52, NULL);
     if (net == NULL) errx(1, "Failed to initialize network!");
+    if (!model_load_network(saved_model, net) && options->resume)
+        errx(1, "%s does not hold the weights of the interrupted run", model_file);
+    model_close(saved_model);
 
-    int epochs = MAX_EPOCHS;
+    int epochs = options->epochs > 0 ? options->epochs : MAX_EPOCHS;
     int *indices = malloc(sizeof(int) * train_set->count);
     for(int i = 0; i < train_set->count; i++) indices[i] = i;
 
     // Training Hyperparameters (Adam optimizer)
-    net->eta = 0.001;  // Adam default learning rate
+    net->eta = options->resume ? resume.eta : 0.001;  // Adam default learning rate
 
     printf("Learning rate: %.5f (Adam)\n", net->eta);
 
+    // Mini-batch data-parallel training when threads, a seed or a batch size
+    // are given: its result depends only on the seed and the batch size, not
+    // on the thread count
+    ParallelTrainer *trainer = NULL;
+    unsigned long long run_seed = options->resume ? resume.run_seed : options->seed;
+    int batch_size = 0;
+    if (options->resume ? resume.batch_size > 0
+        : options->threads > 0 || options->seeded || options->batch_size > 0)
+    {
+        int threads = options->threads > 0 ? options->threads : 1;
+        batch_size = options->resume ? resume.batch_size
+                   : options->batch_size > 0 ? options->batch_size : PARALLEL_BATCH_SIZE;
+        trainer = parallel_trainer_create(cnn, net, threads, batch_size);
+        if (trainer == NULL) errx(1, "Failed to start the parallel trainer");
+        if (!options->seeded && !options->resume)
+            run_seed = rng_next(&rng_main);
+        printf("Data-parallel: %d thread(s), batch %d, seed %llu\n",
+               threads, batch_size, run_seed);
+    }
+
+    // Checkpoints are written by a background thread while training goes on
+    CheckpointWriter *checkpoints = checkpoint_writer_create();
+    if (checkpoints == NULL) errx(1, "Failed to start the checkpoint writer");
+
     float best_val_accuracy = -1.0f;
     int epochs_without_improvement = 0;
+    int first_epoch = 0;
+    if (options->resume)
+    {
+        best_val_accuracy = resume.best_val_accuracy;
+        epochs_without_improvement = resume.epochs_without_improvement;
+        first_epoch = resume.epoch;
+        memcpy(indices, resume.order, sizeof(int) * train_set->count);
+        rng_main = resume.rng;
+        net->dropout_rng = resume.dropout_rng;
+        free(resume.order);
+        if (epochs_without_improvement >= EARLY_STOPPING_PATIENCE)
+            first_epoch = epochs;
+        if (first_epoch < epochs)
+            printf("Resuming at epoch %d/%d (best validation %.2f%%)\n",
+                   first_epoch + 1, epochs, best_val_accuracy);
+        else
+            printf("The saved run had already finished\n");
+    }
+
+    TrainingState state;
+    memset(&state, 0, sizeof(state));
+    state.batch_size = batch_size;
+    state.run_seed = run_seed;
+    state.data_rng = data_rng;
+    state.dataset_key = dataset_key;
+    state.count = train_set->count;
+    state.order = indices;
 
     printf("Starting Training...\n");
     printf("================================================================================\n");
 
-    for (int epoch = 0; epoch < epochs; epoch++)
+    for (int epoch = first_epoch; epoch < epochs; epoch++)
     {
-        shuffle(indices, train_set->count);
-        int epoch_correct = 0;
-        double total_error = 0.0;
-        int trained_samples = 0;
+        shuffle(&rng_main, indices, train_set->count);
 
         // Training phase
-        for (int i = 0; i < train_set->count; i++)
-        {
-            int idx = indices[i];
-
-            int label_index = LabelIndex(train_set->labels[idx]);
-            if (label_index == -1) continue;
-
-            cnn_forward(cnn, train_set->inputs[idx], net->input_layer);
-            set_goal(net, label_index);
-            forward_pass(net);
-
-            // Cross-entropy loss on the correct class
-            double p = net->output_layer[label_index];
-            total_error += -my_log(p + 1e-12);
-            trained_samples++;
-
-            if (argmax_output(net) == label_index)
-                epoch_correct++;
-
-            back_propagation(net);
-            cnn_backward(cnn, net->delta_input, net->eta * 0.1);
-        }
+        EpochStats stats;
+        if (trainer != NULL)
+            parallel_train_epoch(trainer, train_set, indices, train_set->count,
+                                 run_seed, epoch, &stats);
+        else
+            train_epoch_sequential(cnn, net, train_set, indices, &stats);
 
-        int denom = trained_samples > 0 ? trained_samples : 1;
-        float train_accuracy = (float)epoch_correct / denom * 100.0f;
-        double avg_loss = total_error / denom;
+        int denom = stats.samples > 0 ? stats.samples : 1;
+        float train_accuracy = (float)stats.correct / denom * 100.0f;
+        double avg_loss = stats.loss / denom;
 
+        // Validation reads every row: replay the steps lazy rows skipped
+        network_sync_optimizer(net);
         float val_accuracy = validation_accuracy(cnn, net, val_set);
 
         printf("Epoch %3d/%d | Train: %6.2f%% | Val: %6.2f%% | Loss: %.5f",
                epoch + 1, epochs, train_accuracy, val_accuracy, avg_loss);
 
-        if (val_accuracy > best_val_accuracy)
+        int new_best = val_accuracy > best_val_accuracy;
+        if (new_best)
         {
             best_val_accuracy = val_accuracy;
             epochs_without_improvement = 0;
             printf(" * NEW BEST");
-            save_network(OCR_MLP_WEIGHTS, net);
-            save_cnn(OCR_CNN_WEIGHTS, cnn);
         }
         else
         {
@@ -263,6 +430,14 @@ void TrainNetwork(void)
             printf("    -> Learning rate adjusted to: %.6f\n", net->eta);
         }
 
+        state.epoch = epoch + 1;
+        state.eta = net->eta;
+        state.best_val_accuracy = best_val_accuracy;
+        state.epochs_without_improvement = epochs_without_improvement;
+        state.rng = rng_main;
+        state.dropout_rng = net->dropout_rng;
+        submit_checkpoints(checkpoints, cnn, net, new_best, &state);
+
         if (epochs_without_improvement >= EARLY_STOPPING_PATIENCE)
         {
             printf("\nEarly stopping.\n");
@@ -270,11 +445,194 @@ void TrainNetwork(void)
         }
     }
 
+    checkpoint_writer_free(checkpoints);
     printf("\nTraining complete. Best validation model kept on disk.\n");
 
+    parallel_trainer_free(trainer);
     free(indices);
     freeDataSet(train_set);
     freeDataSet(val_set);
     freeNetwork(net);
     free_cnn(cnn);
 }
+
+// Loads the trained CNN + MLP for offline conversion; exits if missing.
+static void load_trained_models(CNN **cnn_out, struct network **net_out)
+{
+    CNN *cnn = init_cnn();
+    if (!cnn) errx(1, "Failed to init CNN");
+    ModelFile *file = model_open(OCR_MODEL_FILE);
+    if (!model_load_cnn(file, cnn))
+        errx(1, "No trained model in %s, run --train or --import-text first", OCR_MODEL_FILE);
+
+    struct network *net = InitializeNetwork(cnn->output_size, OCR_HIDDEN_NODES,
+                                            OCR_CLASS_COUNT, NULL);
+    if (!model_load_network(file, net))
+        errx(1, "No %d-%d-%d MLP in %s", cnn->output_size, OCR_HIDDEN_NODES,
+             OCR_CLASS_COUNT, OCR_MODEL_FILE);
+    model_close(file);
+    network_sync_optimizer(net);
+    set_training_mode(net, 0);
+
+    *cnn_out = cnn;
+    *net_out = net;
+}
+
+void ExportInferenceModel(void)
+{
+    CNN *cnn = NULL;
+    struct network *net = NULL;
+    load_trained_models(&cnn, &net);
+
+    size_t bytes = model_save(OCR_INFERENCE_WEIGHTS, cnn, net, 0);
+    if (bytes == 0)
+        errx(1, "Failed to write %s", OCR_INFERENCE_WEIGHTS);
+
+    printf("Inference model written to %s (%zu KB, training state was %zu KB)\n",
+           OCR_INFERENCE_WEIGHTS, bytes / 1024,
+           (network_arena_bytes(net) + sizeof(CNN)) / 1024);
+
+    freeNetwork(net);
+    free_cnn(cnn);
+}
+
+void ExportTextWeights(void)
+{
+    CNN *cnn = NULL;
+    struct network *net = NULL;
+    load_trained_models(&cnn, &net);
+
+    save_cnn(OCR_CNN_WEIGHTS, cnn);
+    save_network(OCR_MLP_WEIGHTS, net);
+    printf("Text weights written to %s and %s\n", OCR_CNN_WEIGHTS, OCR_MLP_WEIGHTS);
+
+    freeNetwork(net);
+    free_cnn(cnn);
+}
+
+void ImportTextWeights(void)
+{
+    CNN *cnn = init_cnn();
+    if (!cnn) errx(1, "Failed to init CNN");
+    if (fileempty(OCR_CNN_WEIGHTS) || !load_cnn(OCR_CNN_WEIGHTS, cnn))
+        errx(1, "No CNN weights in %s", OCR_CNN_WEIGHTS);
+
+    struct network *net = InitializeNetwork(cnn->output_size, OCR_HIDDEN_NODES,
+                                            OCR_CLASS_COUNT, NULL);
+    if (fileempty(OCR_MLP_WEIGHTS) || !load_network(OCR_MLP_WEIGHTS, net))
+        errx(1, "No MLP weights in %s", OCR_MLP_WEIGHTS);
+
+    if (model_save(OCR_MODEL_FILE, cnn, net, 1) == 0)
+        errx(1, "Failed to write %s", OCR_MODEL_FILE);
+    printf("Model written to %s\n", OCR_MODEL_FILE);
+
+    freeNetwork(net);
+    free_cnn(cnn);
+}
+
+// Best of a few runs, in seconds per glyph: the batch is small enough for
+// one run to be skewed by the scheduler
+#define QUANTIZE_TIMING_RUNS 5
+
+static double time_glyphs(const InferenceModel *model, const QuantizedModel *q,
+                          const GlyphBits *glyphs, int n, size_t *labels)
+{
+    double best = 0;
+    for (int run = 0; run < QUANTIZE_TIMING_RUNS; run++)
+    {
+        clock_t t0 = clock();
+        if (q != NULL)
+            quantized_predict_glyphs(q, glyphs, n, labels);
+        else if (!inference_predict_glyphs(model, glyphs, n, labels))
+            errx(1, "Not enough memory!");
+        double seconds = (double)(clock() - t0) / CLOCKS_PER_SEC;
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+    return n > 0 ? best / n : 0;
+}
+
+void QuantizeNetwork(void)
+{
+    kernels_autotune();
+    CNN *cnn = NULL;
+    struct network *net = NULL;
+    load_trained_models(&cnn, &net);
+    if (cnn->stage2 != CNN_STAGE2_NONE)
+        errx(1, "int8 quantization supports only the flat CNN shape (this one is %s)",
+             cnn_stage2_name(cnn->stage2));
+
+    QuantizedModel *q = quantize_model(cnn, net);
+    InferenceModel *model = inference_from_training(cnn, net);
+    if (q == NULL || model == NULL) errx(1, "Failed to quantize model");
+
+    size_t fp_bytes = sizeof(real) * ((size_t)NUM_FILTERS * (CONV_SIZE * CONV_SIZE + 1)
+        + (size_t)FLATTEN_SIZE * OCR_HIDDEN_NODES + OCR_HIDDEN_NODES
+        + (size_t)OCR_HIDDEN_NODES * OCR_CLASS_COUNT + OCR_CLASS_COUNT);
+    printf("Weights: %zu KB (fp%d) -> %zu KB (int8)\n",
+           fp_bytes / 1024, REAL_BITS, quantized_model_bytes(q) / 1024);
+
+    printf("Loading Dataset...\n");
+    TrainingDataSet *dataset = loadDataSet();
+    if (dataset == NULL) errx(1, "Failed to load dataset!");
+
+    // The packed glyphs PerformOCR feeds to either model
+    GlyphBits *glyphs = malloc(sizeof(GlyphBits) * (dataset->count + 1));
+    int *expected = malloc(sizeof(int) * (dataset->count + 1));
+    size_t *fp_labels = malloc(sizeof(size_t) * (dataset->count + 1));
+    size_t *q_labels = malloc(sizeof(size_t) * (dataset->count + 1));
+    if (glyphs == NULL || expected == NULL || fp_labels == NULL || q_labels == NULL)
+        errx(1, "Not enough memory!");
+    int total = 0;
+    for (int i = 0; i < dataset->count; i++)
+    {
+        int label_index = LabelIndex(dataset->labels[i]);
+        if (label_index == -1) continue;
+        glyph_pack_image(dataset->inputs[i], &glyphs[total]);
+        expected[total++] = label_index;
+    }
+
+    double fp_time = time_glyphs(model, NULL, glyphs, total, fp_labels);
+    double q_time = time_glyphs(NULL, q, glyphs, total, q_labels);
+
+    int fp_correct = 0, q_correct = 0, agree = 0;
+    for (int i = 0; i < total; i++)
+    {
+        fp_correct += (int)fp_labels[i] == expected[i];
+        q_correct += (int)q_labels[i] == expected[i];
+        agree += fp_labels[i] == q_labels[i];
+    }
+
+    int denom = total > 0 ? total : 1;
+    printf("\n=== INT8 ACCURACY REPORT (img/training, %d samples) ===\n", total);
+    printf("fp%d accuracy : %6.2f%%\n", REAL_BITS, fp_correct * 100.0 / denom);
+    printf("int8 accuracy : %6.2f%%\n", q_correct * 100.0 / denom);
+    printf("Agreement     : %6.2f%%\n", agree * 100.0 / denom);
+    printf("Latency/glyph : fp%d %.2f us, int8 %.2f us (%s kernels)\n", REAL_BITS,
+           fp_time * 1e6, q_time * 1e6, kernels.name);
+
+    // PerformOCR prefers the int8 model whenever its file exists, so it is
+    // only kept when it wins here
+    if (q_time < fp_time)
+    {
+        if (!save_quantized_model(OCR_Q8_WEIGHTS, q))
+            errx(1, "Failed to write %s", OCR_Q8_WEIGHTS);
+        printf("Quantized model written to %s\n", OCR_Q8_WEIGHTS);
+    }
+    else
+    {
+        remove(OCR_Q8_WEIGHTS);
+        printf("int8 is not faster here: %s not written, the fp model stays in use\n",
+               OCR_Q8_WEIGHTS);
+    }
+
+    free(q_labels);
+    free(fp_labels);
+    free(expected);
+    free(glyphs);
+    freeDataSet(dataset);
+    free_inference_model(model);
+    free_quantized_model(q);
+    freeNetwork(net);
+    free_cnn(cnn);
+}
@@ -3,9 +3,42 @@
 
 #include "../network/network.h"
 
-// Trains the neural network
+typedef struct
+{
+    int threads;             // data-parallel workers; 0 = per-sample SGD on one core
+    int seeded;              // use `seed` for every random choice of the run
+    unsigned long long seed;
+    int cnn_shape;           // CnnStage2 to train; -1 keeps the saved CNN's shape
+    int batch_size;          // samples per Adam step; 0 = PARALLEL_BATCH_SIZE
+    int resume;              // continue the run saved in OCR_RESUME_STATE
+    int epochs;              // last epoch to train; 0 = the default maximum
+} TrainingOptions;
+
+// Trains the neural network (per-sample SGD, clock-seeded)
 void TrainNetwork(void);
 
+// With threads > 0, a seed or a batch size, trains in mini-batches split
+// across `threads`; a given seed and batch size then yield bit-identical
+// weights for any thread count. After every epoch, the latest weights and
+// the loop state are saved; with `resume`, training continues from them as
+// if it had not been interrupted (seed, batch size and shape come from the
+// saved run).
+void TrainNetworkWithOptions(const TrainingOptions *options);
+
+// Quantizes the trained CNN + MLP to int8 and prints an accuracy and latency
+// report of the int8 model against the fp model on img/training. Writes
+// OCR_Q8_WEIGHTS only if the int8 model is the faster one.
+void QuantizeNetwork(void);
+
+// Freezes the trained CNN + MLP into a weights-only inference model and
+// writes it to OCR_INFERENCE_WEIGHTS, which PerformOCR then loads.
+void ExportInferenceModel(void);
+
+// Text import/export of the model: OCR_MODEL_FILE to OCR_CNN_WEIGHTS and
+// OCR_MLP_WEIGHTS (%.17g, one value per line), and back.
+void ExportTextWeights(void);
+void ImportTextWeights(void);
+
 // Helper to print training statistics
 void PrintTrainingStats(char expected, char recognized, int *correct_count, int total_count);
 
@@ -0,0 +1,41 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <math.h>
+#include <stdio.h>
+
+// Assertions of the `make check` programs: a failed check is reported and
+// counted, and the program exits with check_status().
+static int check_failures;
+
+#define CHECK(cond)                                                           \
+    do                                                                        \
+    {                                                                         \
+        if (!(cond))                                                          \
+        {                                                                     \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond);                                                   \
+            check_failures++;                                                 \
+        }                                                                     \
+    } while (0)
+
+// |got - want| within tol, relative to the magnitude of want beyond 1
+#define CHECK_CLOSE(got, want, tol)                                           \
+    do                                                                        \
+    {                                                                         \
+        double got_ = (got), want_ = (want);                                  \
+        if (!(fabs(got_ - want_) <= (tol) * (1.0 + fabs(want_))))             \
+        {                                                                     \
+            fprintf(stderr, "%s:%d: %s = %.17g, expected %.17g\n",            \
+                    __FILE__, __LINE__, #got, got_, want_);                   \
+            check_failures++;                                                 \
+        }                                                                     \
+    } while (0)
+
+static int check_status(const char *name)
+{
+    printf("%s: %s\n", name, check_failures == 0 ? "ok" : "FAILED");
+    return check_failures != 0;
+}
+
+#endif
@@ -0,0 +1,184 @@
+// Every kernel set the CPU supports against the scalar one, on lengths
+// that exercise the vector bodies and their remainders, from unaligned
+// pointers. The int8 kernel must match exactly.
+
+#include "check.h"
+#include "../source/network/cnn.h"
+#include "../source/network/kernels.h"
+#include "../source/network/network.h"
+#include "../source/network/optimizer.h"
+#include "../source/network/rng.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_N 67
+#define ROWS 9
+#define TOL (REAL_BITS == 32 ? 1e-5 : 1e-12)
+
+static Rng rng;
+
+static void fill(real *x, int n, double sparsity)
+{
+    for (int k = 0; k < n; k++)
+        x[k] = rng_uniform(&rng) < sparsity ? 0 : (real)(rng_uniform(&rng) * 2 - 1);
+}
+
+static void check_all_close(const real *got, const real *want, int n)
+{
+    for (int k = 0; k < n; k++)
+        CHECK_CLOSE(got[k], want[k], TOL);
+}
+
+// The generic kernels of the active set on one length, results in out
+static void run_dense(int n, real *out)
+{
+    real x[ROWS * MAX_N + 1], y[MAX_N + 1], a[ROWS];
+    real w[MAX_N + 1], m[MAX_N + 1], v[MAX_N + 1], g[MAX_N + 1], filters[12];
+    int rows[] = { 0, 3, 4, 8 };
+    Rng saved = rng;
+
+    fill(x, ROWS * MAX_N + 1, 0);
+    fill(y, n + 1, 0);
+    fill(a, ROWS, 0);
+    fill(filters, 12, 0);
+    fill(g, n + 1, 0);
+    fill(w, n + 1, 0);
+    fill(m, n + 1, 0);
+    for (int k = 0; k <= n; k++)
+        v[k] = (real)rng_uniform(&rng) * (real)1e-3;
+    rng = saved;
+
+    real *o = out;
+    memcpy(o, y + 1, sizeof(real) * n);
+    kernels.axpy(o, (real)0.75, x + 1, n);
+    o += n;
+    memcpy(o, y + 1, sizeof(real) * n);
+    kernels.axpy_rows(o, a, x + 1, MAX_N, rows, 4, n);
+    o += n;
+    *o++ = kernels.dot(x + 1, y + 1, n);
+    real dots[ROWS] = { 0 };
+    kernels.dot_rows(dots, x + 1, MAX_N, rows, 4, y + 1, n);
+    memcpy(o, dots, sizeof(dots));
+    o += ROWS;
+
+    // 3 filters of depth 4 over n positions
+    real bias[3] = { (real)0.5, (real)-0.25, 0 };
+    kernels.gemm_bias(o, n, filters, bias, 3, 4, x + 1, MAX_N, n);
+    o += 3 * n;
+
+    AdamCoeffs c = adam_coeffs(0.01, 0.9 * 0.9, 0.999 * 0.999);
+    kernels.adam(w + 1, m + 1, v + 1, g + 1, (real)0.5, n, &c);
+    kernels.adam_catch_up(w + 1, m + 1, v + 1, n, (real)0.81, (real)0.998,
+                          (real)0.02, &c);
+    memcpy(o, w + 1, sizeof(real) * n);
+    memcpy(o + n, m + 1, sizeof(real) * n);
+    memcpy(o + 2 * n, v + 1, sizeof(real) * n);
+}
+
+// axpy_rows_i8() of the active set on one length, results in out
+static void run_int8(int n, int32_t *out)
+{
+    int8_t x[ROWS * MAX_N + 1], a[ROWS];
+    int rows[] = { 0, 3, 4, 8 };
+    Rng saved = rng;
+    for (int k = 0; k < ROWS * MAX_N + 1; k++)
+        x[k] = (int8_t)(rng_uniform(&rng) * 255 - 127);
+    for (int k = 0; k < ROWS; k++)
+        a[k] = (int8_t)(rng_uniform(&rng) * 255 - 127);
+    for (int k = 0; k < n; k++)
+        out[k] = (int32_t)(rng_uniform(&rng) * 2e6) - 1000000;
+    rng = saved;
+    kernels.axpy_rows_i8(out, a, x + 1, MAX_N, rows, 4, n);
+}
+
+// The fixed-shape kernels of the OCR network, results in out
+static void run_shape(real *out)
+{
+    enum { I = FLATTEN_SIZE, H = OCR_HIDDEN_NODES, O = OCR_OUTPUT_NODES,
+           Os = NET_ROW_PAD(O) };
+    const ShapeKernels *shape = kernels_for_shape(I, H, O);
+    CHECK(shape != NULL);
+    if (shape == NULL) return;
+
+    real *in = malloc(sizeof(real) * I);
+    real *wh = malloc(sizeof(real) * I * H);
+    real *wo = calloc((size_t)H * Os, sizeof(real));
+    real bh[H], bo[Os], delta_o[Os], delta_h[H];
+    if (in == NULL || wh == NULL || wo == NULL) errx(1, "Not enough memory!");
+    Rng saved = rng;
+    fill(in, I, 0.7);
+    fill(wh, I * H, 0);
+    fill(bh, H, 0);
+    memset(bo, 0, sizeof(bo));
+    memset(delta_o, 0, sizeof(delta_o));
+    fill(bo, O, 0);
+    fill(delta_o, O, 0);
+    fill(delta_h, H, 0);
+    for (int h = 0; h < H; h++)
+        fill(wo + h * Os, O, 0);
+    rng = saved;
+
+    int rows[I], count = 0;
+    for (int i = 0; i < I; i++)
+        if (in[i] != 0)
+            rows[count++] = i;
+
+    real *o = out;
+    shape->hidden_layer(o, bh, in, wh);
+    o += H;
+    shape->output_layer(o, bo, o - H, wo);
+    o += Os;
+    for (int h = 0; h < H; h++)
+        *o++ = shape->output_dot(wo + h * Os, delta_o);
+    real *dots = calloc(I, sizeof(real));
+    if (dots == NULL) errx(1, "Not enough memory!");
+    shape->input_dots(dots, wh, rows, count, delta_h);
+    memcpy(o, dots, sizeof(real) * I);
+
+    free(dots);
+    free(wo);
+    free(wh);
+    free(in);
+}
+
+int main(void)
+{
+    enum { DENSE = 2 * MAX_N + 1 + ROWS + 3 * MAX_N + 3 * MAX_N,
+           SHAPE = OCR_HIDDEN_NODES + NET_ROW_PAD(OCR_OUTPUT_NODES)
+                 + OCR_HIDDEN_NODES + FLATTEN_SIZE };
+    static real want[MAX_N + 1][DENSE], got[DENSE];
+    static real want_shape[SHAPE], got_shape[SHAPE];
+    static int32_t want_i8[MAX_N + 1][MAX_N], got_i8[MAX_N];
+
+    rng_seed(&rng, 4);
+    kernels_select("scalar");
+    for (int n = 1; n <= MAX_N; n++)
+    {
+        run_dense(n, want[n]);
+        run_int8(n, want_i8[n]);
+    }
+    run_shape(want_shape);
+
+    for (int s = 0; kernels_set_name(s) != NULL; s++)
+    {
+        const char *name = kernels_set_name(s);
+        if (strcmp(name, "scalar") == 0 || !kernels_select(name))
+            continue;
+        int before = check_failures;
+        for (int n = 1; n <= MAX_N; n++)
+        {
+            memset(got, 0, sizeof(got));
+            run_dense(n, got);
+            check_all_close(got, want[n], DENSE);
+            run_int8(n, got_i8);
+            CHECK(memcmp(got_i8, want_i8[n], sizeof(int32_t) * n) == 0);
+        }
+        memset(got_shape, 0, sizeof(got_shape));
+        run_shape(got_shape);
+        check_all_close(got_shape, want_shape, SHAPE);
+        printf("  %s against scalar: %s\n", name, check_failures == before ? "ok" : "differs");
+    }
+    return check_status("kernels");
+}
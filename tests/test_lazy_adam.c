@@ -0,0 +1,137 @@
+// Lazy Adam against dense Adam on the master network, per sample
+// (back_propagation) and in mini-batches (network_catch_up_batch, then
+// network_batch_step). Inputs are sparse and dropout is on, so hidden and
+// output rows both skip steps. Once synced, the weights must match up to
+// the closed-form catch-up's drift where v is not large next to eps^2:
+// a percent of how far training moved them, where rows read stale are off
+// by most of it.
+
+#include "check.h"
+#include "../source/network/cnn.h"
+#include "../source/network/network.h"
+#include "../source/network/optimizer.h"
+#include "../source/network/rng.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SAMPLES 48
+#define STEPS 96
+#define BATCH 6
+#define TOL 0.05
+
+enum { I = FLATTEN_SIZE, H = OCR_HIDDEN_NODES, O = OCR_OUTPUT_NODES };
+
+static real inputs[SAMPLES][I];
+static int labels[SAMPLES];
+
+static void load_sample(struct network *net, int k)
+{
+    memcpy(net->input_layer, inputs[k], sizeof(real) * I);
+    memset(net->goal, 0, sizeof(real) * O);
+    net->goal[labels[k]] = 1;
+}
+
+static struct network *fresh_network(void)
+{
+    rng_seed(&rng_main, 7);
+    struct network *net = InitializeNetwork(I, H, O, NULL);
+    if (net == NULL) errx(1, "Not enough memory!");
+    net->eta = 0.01;
+    set_training_mode(net, 1);
+    network_seed_dropout(net, 11);
+    return net;
+}
+
+static struct network *train_per_sample(void)
+{
+    struct network *net = fresh_network();
+    for (int step = 0; step < STEPS; step++)
+    {
+        load_sample(net, step % SAMPLES);
+        network_catch_up(net);
+        forward_pass(net);
+        back_propagation(net);
+    }
+    network_sync_optimizer(net);
+    return net;
+}
+
+static struct network *train_batches(void)
+{
+    struct network *net = fresh_network();
+    struct network *samples[BATCH];
+    real *scratch = malloc(sizeof(real) * (H > net->output_stride ? H : net->output_stride));
+    if (scratch == NULL) errx(1, "Not enough memory!");
+    for (int s = 0; s < BATCH; s++)
+        if ((samples[s] = network_replica(net)) == NULL)
+            errx(1, "Not enough memory!");
+
+    for (int step = 0; step < STEPS / BATCH; step++)
+    {
+        for (int s = 0; s < BATCH; s++)
+            load_sample(samples[s], (step * BATCH + s) % SAMPLES);
+        network_catch_up_batch(net, samples, BATCH, 0, 1);
+        for (int s = 0; s < BATCH; s++)
+        {
+            network_seed_dropout(samples[s], (uint64_t)step * BATCH + s);
+            forward_pass(samples[s]);
+            back_propagation_deltas(samples[s]);
+        }
+        AdamCoeffs adam = network_begin_step(net);
+        network_batch_step(net, &adam, samples, BATCH, 0, 1, scratch);
+    }
+    network_sync_optimizer(net);
+
+    for (int s = 0; s < BATCH; s++)
+        freeNetwork(samples[s]);
+    free(scratch);
+    return net;
+}
+
+static void check_same_weights(const struct network *lazy, const struct network *dense)
+{
+    // Relative to how far training moved the weights
+    struct network *init = fresh_network();
+    double moved = 0, diff = 0;
+    for (size_t k = 0; k < (size_t)I * H; k++)
+    {
+        moved = fmax(moved, fabs(dense->hidden_weights[k] - init->hidden_weights[k]));
+        diff = fmax(diff, fabs(lazy->hidden_weights[k] - dense->hidden_weights[k]));
+    }
+    for (size_t k = 0; k < (size_t)H * dense->output_stride; k++)
+    {
+        moved = fmax(moved, fabs(dense->output_weights[k] - init->output_weights[k]));
+        diff = fmax(diff, fabs(lazy->output_weights[k] - dense->output_weights[k]));
+    }
+    freeNetwork(init);
+    CHECK(moved > 0);
+    CHECK(diff <= TOL * moved);
+}
+
+int main(void)
+{
+    Rng data;
+    rng_seed(&data, 3);
+    for (int k = 0; k < SAMPLES; k++)
+    {
+        // About 1 input in 5 non-zero, like the CNN's ReLU features
+        for (int i = 0; i < I; i++)
+            inputs[k][i] = rng_uniform(&data) < 0.2 ? (real)rng_uniform(&data) : 0;
+        labels[k] = k % O;
+    }
+
+    struct network *(*const runs[])(void) = { train_per_sample, train_batches };
+    for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++)
+    {
+        optimizer_mode = OPTIMIZER_ADAM;
+        struct network *dense = runs[r]();
+        optimizer_mode = OPTIMIZER_LAZY_ADAM;
+        struct network *lazy = runs[r]();
+        check_same_weights(lazy, dense);
+        freeNetwork(lazy);
+        freeNetwork(dense);
+    }
+    return check_status("lazy adam");
+}
@@ -0,0 +1,177 @@
+#define _POSIX_C_SOURCE 200809L // mkstemp
+
+// The model container: a lazy Adam network packed with its optimizer state
+// opens back to the same weights, moments and row steps; without it, to
+// the synced weights, in place. A flipped byte anywhere, or a missing one,
+// must get the file rejected.
+
+#include "check.h"
+#include "../source/network/cnn.h"
+#include "../source/network/modelfile.h"
+#include "../source/network/network.h"
+#include "../source/network/optimizer.h"
+#include "../source/network/rng.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STEPS 24
+
+enum { I = FLATTEN_SIZE, H = OCR_HIDDEN_NODES, O = OCR_OUTPUT_NODES };
+
+static struct network *fresh_network(void)
+{
+    struct network *net = InitializeNetwork(I, H, O, NULL);
+    if (net == NULL) errx(1, "Not enough memory!");
+    return net;
+}
+
+// Lazy Adam on sparse inputs, so most hidden rows lag behind adam_t
+static struct network *trained_network(void)
+{
+    Rng data;
+    rng_seed(&data, 5);
+    rng_seed(&rng_main, 9);
+    optimizer_mode = OPTIMIZER_LAZY_ADAM;
+    struct network *net = fresh_network();
+    net->eta = 0.01;
+    for (int step = 0; step < STEPS; step++)
+    {
+        for (int i = 0; i < I; i++)
+            net->input_layer[i] = rng_uniform(&data) < 0.05 ? (real)rng_uniform(&data) : 0;
+        memset(net->goal, 0, sizeof(real) * O);
+        net->goal[step % O] = 1;
+        network_catch_up(net);
+        forward_pass(net);
+        back_propagation(net);
+    }
+    return net;
+}
+
+static int same_reals(const real *a, const real *b, size_t n)
+{
+    return memcmp(a, b, sizeof(real) * n) == 0;
+}
+
+static void check_same_network(const struct network *got, const struct network *want)
+{
+    size_t hidden = (size_t)I * H, output = (size_t)H * want->output_stride;
+    CHECK(same_reals(got->hidden_weights, want->hidden_weights, hidden));
+    CHECK(same_reals(got->m_hidden_weights, want->m_hidden_weights, hidden));
+    CHECK(same_reals(got->v_hidden_weights, want->v_hidden_weights, hidden));
+    CHECK(same_reals(got->output_weights, want->output_weights, output));
+    CHECK(same_reals(got->m_output_weights, want->m_output_weights, output));
+    CHECK(same_reals(got->v_output_weights, want->v_output_weights, output));
+    CHECK(same_reals(got->hidden_layer_bias, want->hidden_layer_bias, H));
+    CHECK(same_reals(got->output_layer_bias, want->output_layer_bias, O));
+    CHECK(memcmp(got->hidden_row_step, want->hidden_row_step, sizeof(long) * I) == 0);
+    CHECK(memcmp(got->output_row_step, want->output_row_step, sizeof(long) * H) == 0);
+    CHECK(got->adam_t == want->adam_t);
+    CHECK(got->adam_beta1_t == want->adam_beta1_t);
+    CHECK(got->adam_beta2_t == want->adam_beta2_t);
+    CHECK(got->eta == want->eta);
+}
+
+static void write_bytes(const char *path, const unsigned char *data, size_t size)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL || fwrite(data, 1, size, f) != size || fclose(f) != 0)
+        err(1, "%s", path);
+}
+
+// The container with one byte changed, or cut short, must not open
+static void check_rejected(const char *path, const unsigned char *data, size_t size)
+{
+    unsigned char *copy = malloc(size);
+    if (copy == NULL) errx(1, "Not enough memory!");
+    size_t offsets[] = { 0, offsetof(ModelHeader, hidden), offsetof(ModelHeader, net_eta),
+                         sizeof(ModelHeader) + offsetof(ModelSection, offset),
+                         size / 2, size - 1 };
+    for (size_t k = 0; k < sizeof(offsets) / sizeof(offsets[0]); k++)
+    {
+        memcpy(copy, data, size);
+        copy[offsets[k]] ^= 0x10;
+        write_bytes(path, copy, size);
+        ModelFile *file = model_open(path);
+        CHECK(file == NULL);
+        model_close(file);
+    }
+    write_bytes(path, data, size - 1);
+    ModelFile *file = model_open(path);
+    CHECK(file == NULL);
+    model_close(file);
+    free(copy);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/test_modelfile-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) err(1, "mkstemp");
+    close(fd);
+
+    CNN *cnn = init_cnn();
+    struct network *net = trained_network();
+    struct network *synced = fresh_network();
+    size_t size;
+
+    // With the optimizer: everything as it was, lazy rows still behind
+    unsigned char *data = model_pack(cnn, net, 1, &size);
+    if (data == NULL) errx(1, "Not enough memory!");
+    write_bytes(path, data, size);
+    ModelFile *file = model_open(path);
+    CHECK(file != NULL);
+    if (file != NULL)
+    {
+        CNN *loaded_cnn = init_cnn();
+        struct network *loaded = fresh_network();
+        CHECK(model_load_cnn(file, loaded_cnn));
+        CHECK(same_reals(&loaded_cnn->filters[0][0][0], &cnn->filters[0][0][0],
+                         NUM_FILTERS * CONV_SIZE * CONV_SIZE));
+        CHECK(same_reals(loaded_cnn->biases, cnn->biases, NUM_FILTERS));
+        CHECK(model_load_network(file, loaded));
+        check_same_network(loaded, net);
+        CHECK(!model_synced(file));
+
+        // The synced copy the offline loaders read
+        CHECK(model_load_network(file, synced));
+        network_sync_optimizer(synced);
+        real *weights = malloc(sizeof(real) * I * H);
+        if (weights == NULL) errx(1, "Not enough memory!");
+        CHECK(model_read_synced(file, MODEL_HIDDEN_WEIGHTS, weights, I, H, H));
+        CHECK(same_reals(weights, synced->hidden_weights, (size_t)I * H));
+        free(weights);
+
+        freeNetwork(loaded);
+        free_cnn(loaded_cnn);
+        model_close(file);
+    }
+    check_rejected(path, data, size);
+    free(data);
+
+    // Packing left net lagging; without the optimizer, the weights are
+    // saved synced and read in place
+    CHECK(model_save(path, cnn, net, 0) > 0);
+    file = model_open(path);
+    CHECK(file != NULL);
+    if (file != NULL)
+    {
+        CHECK(model_synced(file));
+        const real *hidden = model_section(file, MODEL_HIDDEN_WEIGHTS, (size_t)I * H);
+        CHECK(hidden != NULL && same_reals(hidden, synced->hidden_weights, (size_t)I * H));
+        const real *output = model_section(file, MODEL_OUTPUT_WEIGHTS,
+                                           (size_t)H * net->output_stride);
+        CHECK(output != NULL && same_reals(output, synced->output_weights,
+                                           (size_t)H * net->output_stride));
+        model_close(file);
+    }
+
+    unlink(path);
+    freeNetwork(synced);
+    freeNetwork(net);
+    free_cnn(cnn);
+    return check_status("model file");
+}
@@ -0,0 +1,115 @@
+#define _POSIX_C_SOURCE 200809L // mkdtemp, symlink
+
+// Training two epochs in one run, and one epoch then --resume up to the
+// second, must leave the same resume weights and state. Runs seeded, with
+// lazy Adam, in a temporary directory holding two images per letter of
+// img/training.
+
+#include "check.h"
+#include "../source/common.h"
+#include "../source/network/optimizer.h"
+#include "../source/network/tools.h"
+#include "../source/training/training.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EPOCHS 2
+#define SEED 42
+#define IMAGES (2 * 26 * 2)
+
+static void make_dir(const char *path)
+{
+    if (mkdir(path, 0755) != 0)
+        err(1, "%s", path);
+}
+
+// Image k of the subset: two per letter, capitals first
+static void image_path(char *path, size_t size, int k)
+{
+    int lower = k >= IMAGES / 2;
+    snprintf(path, size, "img/training/%s/%c%d.png", lower ? "min" : "maj",
+             (lower ? 'a' : 'A') + k % (IMAGES / 2) / 2, k % 2);
+}
+
+static uint64_t file_hash(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return 0;
+    uint64_t hash = FNV1A_INIT;
+    unsigned char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        hash = fnv1a(hash, buffer, n);
+    fclose(f);
+    return hash;
+}
+
+// Starts from scratch, keeping the kernel choice of the first run
+static void remove_checkpoints(void)
+{
+    remove(OCR_MODEL_FILE);
+    remove(OCR_RESUME_MODEL_EVEN);
+    remove(OCR_RESUME_MODEL_ODD);
+    remove(OCR_RESUME_STATE);
+}
+
+static void train(int epochs, int resume)
+{
+    TrainingOptions options = { 1, !resume, SEED, -1, 0, resume, epochs };
+    TrainNetworkWithOptions(&options);
+}
+
+int main(void)
+{
+    char repo[4096], dir[] = "/tmp/test_resume-XXXXXX";
+    if (getcwd(repo, sizeof(repo)) == NULL) err(1, "getcwd");
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) err(1, "%s", dir);
+    make_dir("img");
+    make_dir("img/training");
+    make_dir("img/training/maj");
+    make_dir("img/training/min");
+    make_dir("source");
+    make_dir("source/OCR-data");
+    for (int k = 0; k < IMAGES; k++)
+    {
+        char link[64], target[4096 + 64];
+        image_path(link, sizeof(link), k);
+        snprintf(target, sizeof(target), "%s/%s", repo, link);
+        if (symlink(target, link) != 0)
+            err(1, "%s", link);
+    }
+    optimizer_mode = OPTIMIZER_LAZY_ADAM;
+    const char *model = EPOCHS % 2 == 0 ? OCR_RESUME_MODEL_EVEN : OCR_RESUME_MODEL_ODD;
+
+    train(EPOCHS, 0);
+    uint64_t want_model = file_hash(model), want_state = file_hash(OCR_RESUME_STATE);
+    CHECK(want_model != 0 && want_state != 0);
+
+    remove_checkpoints();
+    train(EPOCHS - 1, 0);
+    train(EPOCHS, 1);
+    CHECK(file_hash(model) == want_model);
+    CHECK(file_hash(OCR_RESUME_STATE) == want_state);
+
+    remove_checkpoints();
+    remove(OCR_TUNING_CACHE);
+    remove(OCR_DATASET_CACHE);
+    for (int k = 0; k < IMAGES; k++)
+    {
+        char link[64];
+        image_path(link, sizeof(link), k);
+        remove(link);
+    }
+    const char *dirs[] = { "source/OCR-data", "source", "img/training/maj",
+                           "img/training/min", "img/training", "img" };
+    for (size_t k = 0; k < sizeof(dirs) / sizeof(dirs[0]); k++)
+        rmdir(dirs[k]);
+    if (chdir(repo) == 0)
+        rmdir(dir);
+    return check_status("resume");
+}